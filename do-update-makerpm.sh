@@ -151,6 +151,7 @@ include_files_to_copy[0]="
 include_files_to_copy[1]="
 	include/uapi/rdma/hfi/hfi1_user.h
 	include/uapi/rdma/hfi/hfi1_ioctl.h
+	include/uapi/rdma/hfi/hfi1_rcv_occ.h
 "
 include_files_to_copy[2]=""
 include_files_to_copy[3]="
@@ -87,6 +87,18 @@ uint rcv_intr_count = 16; /* same as qib */
 module_param(rcv_intr_count, uint, S_IRUGO);
 MODULE_PARM_DESC(rcv_intr_count, "Receive interrupt mitigation count");
 
+uint rcv_intr_mod = HFI1_RCV_INTR_MOD_STEP;
+module_param(rcv_intr_mod, uint, S_IRUGO);
+MODULE_PARM_DESC(rcv_intr_mod, "Receive interrupt moderation engine: 0 - static, 1 - double/halve (default), 2 - rate based");
+
+uint krcv_busy_poll;
+module_param(krcv_busy_poll, uint, S_IRUGO);
+MODULE_PARM_DESC(krcv_busy_poll, "Let IB_POLL_DIRECT kernel CQ pollers process the kernel receive context of their QPs once enabled in debugfs: usecs without packets before the interrupt is re-enabled, 0 - disabled (default)");
+
+uint krcv_napi;
+module_param(krcv_napi, uint, S_IRUGO);
+MODULE_PARM_DESC(krcv_napi, "NAPI weight for kernel receive contexts, max 64, 0 - process in the IRQ handler and thread (default)");
+
 ushort link_crc_mask = SUPPORTED_CRCS;
 module_param(link_crc_mask, ushort, S_IRUGO);
 MODULE_PARM_DESC(link_crc_mask, "CRCs to use on the link");
@@ -1734,6 +1746,24 @@ static u64 access_sw_send_schedule(const struct cntr_entry *entry,
 			      mode, data);
 }
 
+static u64 access_sw_cpu_rx_zcopy(const struct cntr_entry *entry,
+				  void *context, int vl, int mode, u64 data)
+{
+	struct hfi1_devdata *dd = context;
+
+	return read_write_cpu(dd, &dd->z_rx_zcopy, dd->rx_zcopy, vl,
+			      mode, data);
+}
+
+static u64 access_sw_cpu_rx_copy(const struct cntr_entry *entry,
+				 void *context, int vl, int mode, u64 data)
+{
+	struct hfi1_devdata *dd = context;
+
+	return read_write_cpu(dd, &dd->z_rx_copy, dd->rx_copy, vl,
+			      mode, data);
+}
+
 /* Software counters for the error status bits within MISC_ERR_STATUS */
 static u64 access_misc_pll_lock_fail_err_cnt(const struct cntr_entry *entry,
 					     void *context, int vl, int mode,
@@ -4287,6 +4317,10 @@ static struct cntr_entry dev_cntrs[DEV_CNTR_LAST] = {
 			    hfi1_access_sw_tid_wait),
 [C_SW_SEND_SCHED] = CNTR_ELEM("SendSched", 0, 0, CNTR_NORMAL,
 			    access_sw_send_schedule),
+[C_SW_CPU_RX_ZCOPY] = CNTR_ELEM("RxZCopy", 0, 0, CNTR_NORMAL,
+			    access_sw_cpu_rx_zcopy),
+[C_SW_CPU_RX_COPY] = CNTR_ELEM("RxCopy", 0, 0, CNTR_NORMAL,
+			    access_sw_cpu_rx_copy),
 [C_SDMA_DESC_FETCHED_CNT] = CNTR_ELEM("SDEDscFdCn",
 				      SEND_DMA_DESC_FETCHED_CNT, 0,
 				      CNTR_NORMAL | CNTR_32BIT | CNTR_SDMA,
@@ -8516,6 +8550,194 @@ static void hfi1_rcd_eoi_intr(struct hfi1_ctxtdata *rcd)
 	local_irq_restore(flags);
 }
 
+/*
+ * Kernel receive context busy poll.
+ *
+ * A kernel consumer that finds its CQ empty may process the kernel receive
+ * context serving the CQ's QPs itself rather than wait for the receive
+ * interrupt and the handoff to receive_context_thread().  Contexts opt in
+ * through the krcv_busy_poll debugfs file.  The first poller holds the
+ * receive interrupt off the same way the IRQ handler does while it
+ * processes packets: the interrupt is simply not cleared.  At most one
+ * interrupt is taken after that, and it finds the context held and
+ * returns.  The interrupt is cleared and re-checked (hfi1_rcd_eoi_intr())
+ * once the context has seen no packets for krcv_busy_poll usecs, either by
+ * the next poller or by busy_poll_timer if the pollers went away.
+ *
+ * OWNED serializes the pollers, the IRQ handler and its thread.  An
+ * interrupt that loses the race for OWNED leaves PENDING behind so that
+ * whoever releases the context does the end of interrupt for it.
+ */
+static bool rcd_busy_poll_claim(struct hfi1_ctxtdata *rcd)
+{
+	return !test_and_set_bit_lock(HFI1_RCD_BP_OWNED,
+				      &rcd->busy_poll_flags);
+}
+
+static void rcd_busy_poll_release(struct hfi1_ctxtdata *rcd)
+{
+	unsigned long *flags = &rcd->busy_poll_flags;
+
+	for (;;) {
+		clear_bit_unlock(HFI1_RCD_BP_OWNED, flags);
+		smp_mb__after_atomic();
+		/* a held interrupt is handled when the hold ends */
+		if (!test_bit(HFI1_RCD_BP_PENDING, flags) ||
+		    test_bit(HFI1_RCD_BP_HELD, flags))
+			return;
+		/* whoever owns the context now will see PENDING */
+		if (!rcd_busy_poll_claim(rcd))
+			return;
+		if (test_and_clear_bit(HFI1_RCD_BP_PENDING, flags))
+			hfi1_rcd_eoi_intr(rcd);
+	}
+}
+
+static bool rcd_busy_poll_irq_claim(struct hfi1_ctxtdata *rcd)
+{
+	set_bit(HFI1_RCD_BP_PENDING, &rcd->busy_poll_flags);
+	smp_mb__after_atomic();
+	if (!rcd_busy_poll_claim(rcd))
+		return false;
+	if (test_bit(HFI1_RCD_BP_HELD, &rcd->busy_poll_flags)) {
+		rcd_busy_poll_release(rcd);
+		return false;
+	}
+	clear_bit(HFI1_RCD_BP_PENDING, &rcd->busy_poll_flags);
+	return true;
+}
+
+static ktime_t rcd_busy_poll_period(void)
+{
+	return ns_to_ktime((u64)krcv_busy_poll * NSEC_PER_USEC);
+}
+
+/* must own the context */
+static bool rcd_busy_poll_idle(struct hfi1_ctxtdata *rcd)
+{
+	return ktime_get_ns() - rcd->busy_poll_last >
+		(u64)krcv_busy_poll * NSEC_PER_USEC;
+}
+
+/* must own the context, ends the hold and brings the interrupt back */
+static void rcd_busy_poll_unhold(struct hfi1_ctxtdata *rcd)
+{
+	clear_bit(HFI1_RCD_BP_HELD, &rcd->busy_poll_flags);
+	clear_bit(HFI1_RCD_BP_PENDING, &rcd->busy_poll_flags);
+	smp_mb__after_atomic();
+	hfi1_rcd_eoi_intr(rcd);
+}
+
+static enum hrtimer_restart rcd_busy_poll_timer(struct hrtimer *t)
+{
+	struct hfi1_ctxtdata *rcd = container_of(t, struct hfi1_ctxtdata,
+						 busy_poll_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+
+	if (!rcd_busy_poll_claim(rcd)) {
+		hrtimer_forward_now(t, rcd_busy_poll_period());
+		return HRTIMER_RESTART;
+	}
+	if (test_bit(HFI1_RCD_BP_HELD, &rcd->busy_poll_flags)) {
+		if (rcd_busy_poll_idle(rcd)) {
+			rcd_busy_poll_unhold(rcd);
+		} else {
+			hrtimer_forward_now(t, rcd_busy_poll_period());
+			ret = HRTIMER_RESTART;
+		}
+	}
+	rcd_busy_poll_release(rcd);
+	return ret;
+}
+
+/*
+ * Process one batch of packets on a kernel receive context on behalf of a
+ * poller.  Returns true if any packets were processed.
+ */
+static bool rcd_busy_poll(struct hfi1_ctxtdata *rcd)
+{
+	bool found;
+	u32 head;
+
+	if (!rcd_busy_poll_claim(rcd))
+		return false;
+
+	if (!test_and_set_bit(HFI1_RCD_BP_HELD, &rcd->busy_poll_flags)) {
+		rcd->busy_poll_last = ktime_get_ns();
+		hrtimer_start(&rcd->busy_poll_timer, rcd_busy_poll_period(),
+			      HRTIMER_MODE_REL);
+	}
+
+	head = hfi1_rcd_head(rcd);
+	(void)rcd->do_interrupt(rcd, 0);
+	found = hfi1_rcd_head(rcd) != head;
+
+	if (found)
+		rcd->busy_poll_last = ktime_get_ns();
+	else if (rcd_busy_poll_idle(rcd))
+		rcd_busy_poll_unhold(rcd);
+
+	rcd_busy_poll_release(rcd);
+	return found;
+}
+
+/**
+ * hfi1_busy_poll_cq - rdmavt busy_poll_cq callback
+ * @cq: the empty kernel CQ
+ *
+ * Poll the receive context serving the QP that last completed into @cq,
+ * if that context has busy poll enabled.  rdmavt only calls this for
+ * IB_POLL_DIRECT CQs, whose consumers poll from process context.
+ */
+bool hfi1_busy_poll_cq(struct rvt_cq *cq)
+{
+	struct hfi1_devdata *dd = dd_from_ibdev(cq->ibcq.device);
+	u32 qpn = READ_ONCE(cq->poll_qpn);
+	struct hfi1_ctxtdata *rcd = NULL;
+	struct rvt_qp *qp;
+	bool found;
+
+	/* QP0 and QP1 are served by the control context */
+	if (!krcv_busy_poll || qpn <= 1)
+		return false;
+
+	rcu_read_lock();
+	qp = rvt_lookup_qpn(&dd->verbs_dev.rdi, &dd->pport->ibport_data.rvp,
+			    qpn);
+	if (qp)
+		rcd = ((struct hfi1_qp_priv *)qp->priv)->rcd;
+	rcu_read_unlock();
+
+	/* kernel contexts live as long as the device */
+	if (!rcd || !rcd->busy_poll || !READ_ONCE(rcd->busy_poll_enabled))
+		return false;
+
+	local_bh_disable();
+	found = rcd_busy_poll(rcd);
+	local_bh_enable();
+
+	return found;
+}
+
+/**
+ * hfi1_init_rcd_busy_poll - set up busy poll state for a receive context
+ * @rcd: the receive context
+ *
+ * Only kernel contexts taking the receive_context_interrupt() path can be
+ * busy polled, and only when krcv_busy_poll is set and krcv_napi is not.
+ * Pollers stay off until the context is opted in through debugfs.
+ */
+void hfi1_init_rcd_busy_poll(struct hfi1_ctxtdata *rcd)
+{
+	hrtimer_init(&rcd->busy_poll_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	rcd->busy_poll_timer.function = rcd_busy_poll_timer;
+	rcd->busy_poll_flags = 0;
+	rcd->busy_poll_enabled = false;
+	rcd->busy_poll = krcv_busy_poll && !krcv_napi &&
+		rcd->ctxt < rcd->dd->first_dyn_alloc_ctxt;
+}
+
 /**
  * hfi1_netdev_rx_napi - napi poll function to move eoi inline
  * @napi - pointer to napi object
@@ -8530,6 +8752,9 @@ int hfi1_netdev_rx_napi(struct napi_struct *napi, int budget)
 
 	work_done = rcd->do_interrupt(rcd, budget);
 
+	if (rcd->egrbufs.zc)
+		hfi1_netdev_egr_refill(rcd);
+
 	if (work_done < budget) {
 		napi_complete_done(napi, work_done);
 		hfi1_rcd_eoi_intr(rcd);
@@ -8539,7 +8764,127 @@ int hfi1_netdev_rx_napi(struct napi_struct *napi, int budget)
 }
 
 /*
- * Receive packet napi handler for netdevs VNIC and AIP
+ * Packets taken off the rcvhdrq since head was @head.  A non-thread pass
+ * stops after MAX_PKT_RECV packets, so it never laps the queue.
+ */
+static int rcd_pkts_since(struct hfi1_ctxtdata *rcd, u32 head)
+{
+	u32 entsize = get_hdrqentsize(rcd);
+	u32 size = get_hdrq_cnt(rcd) * entsize;
+
+	return ((hfi1_rcd_head(rcd) + size - head) % size) / entsize;
+}
+
+/**
+ * hfi1_krcv_napi_poll - NAPI poll function for kernel receive contexts
+ * @napi: the context's NAPI instance
+ * @budget: packets this poll may process
+ *
+ * The budget is checked between passes of do_interrupt(), each of which
+ * stops after MAX_PKT_RECV packets.  A context that uses up its budget
+ * goes back on the poll list so that net_rx_action() can round robin it
+ * with the other contexts and softirq work on this CPU.
+ */
+static int hfi1_krcv_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct hfi1_ctxtdata *rcd =
+		container_of(napi, struct hfi1_krcv_napi, napi)->rcd;
+	int work_done = 0;
+	int last;
+	u32 head;
+
+	do {
+		head = hfi1_rcd_head(rcd);
+		last = rcd->do_interrupt(rcd, 0);
+		work_done += rcd_pkts_since(rcd, head);
+	} while (last == RCV_PKT_LIMIT && work_done < budget);
+
+	if (last == RCV_PKT_LIMIT || work_done >= budget)
+		return budget;
+
+	napi_complete_done(napi, work_done);
+	hfi1_rcd_eoi_intr(rcd);
+
+	return work_done;
+}
+
+/**
+ * hfi1_krcv_napi_init - set up NAPI polling of the kernel receive contexts
+ * @dd: the device, kernel contexts must have been created
+ *
+ * Does nothing unless krcv_napi is set.  The receive interrupts of the
+ * contexts then only schedule NAPI, see msix_request_rcd_irq().
+ */
+int hfi1_krcv_napi_init(struct hfi1_devdata *dd)
+{
+	struct hfi1_ctxtdata *rcd;
+	u16 i;
+
+	if (!krcv_napi)
+		return 0;
+
+	dd->krcv_napi_dev = kzalloc_node(sizeof(*dd->krcv_napi_dev),
+					 GFP_KERNEL, dd->node);
+	dd->krcv_napi = kcalloc_node(dd->n_krcv_queues,
+				     sizeof(*dd->krcv_napi), GFP_KERNEL,
+				     dd->node);
+	if (!dd->krcv_napi_dev || !dd->krcv_napi) {
+		kfree(dd->krcv_napi_dev);
+		kfree(dd->krcv_napi);
+		dd->krcv_napi_dev = NULL;
+		dd->krcv_napi = NULL;
+		return -ENOMEM;
+	}
+	init_dummy_netdev(dd->krcv_napi_dev);
+
+	for (i = 0; i < dd->n_krcv_queues; i++) {
+		struct hfi1_krcv_napi *kn = &dd->krcv_napi[i];
+
+		rcd = hfi1_rcd_get_by_index(dd, i);
+		if (!rcd)
+			continue;
+		/* kernel contexts live as long as the device */
+		kn->rcd = rcd;
+		netif_napi_add(dd->krcv_napi_dev, &kn->napi,
+			       hfi1_krcv_napi_poll,
+			       min_t(uint, krcv_napi, NAPI_POLL_WEIGHT));
+		napi_enable(&kn->napi);
+		rcd->napi = &kn->napi;
+		hfi1_rcd_put(rcd);
+	}
+
+	return 0;
+}
+
+/**
+ * hfi1_krcv_napi_free - tear down NAPI polling of the kernel contexts
+ * @dd: the device, the receive interrupts must have been freed
+ */
+void hfi1_krcv_napi_free(struct hfi1_devdata *dd)
+{
+	u16 i;
+
+	if (!dd->krcv_napi)
+		return;
+
+	for (i = 0; i < dd->n_krcv_queues; i++) {
+		struct hfi1_krcv_napi *kn = &dd->krcv_napi[i];
+
+		if (!kn->rcd)
+			continue;
+		napi_disable(&kn->napi);
+		netif_napi_del(&kn->napi);
+		kn->rcd->napi = NULL;
+	}
+	kfree(dd->krcv_napi);
+	kfree(dd->krcv_napi_dev);
+	dd->krcv_napi = NULL;
+	dd->krcv_napi_dev = NULL;
+}
+
+/*
+ * Receive packet napi handler for netdevs VNIC and AIP, and for kernel
+ * contexts when krcv_napi is set
  */
 irqreturn_t receive_context_interrupt_napi(int irq, void *data)
 {
@@ -8576,6 +8921,10 @@ irqreturn_t receive_context_interrupt(int irq, void *data)
 
 	receive_interrupt_common(rcd);
 
+	/* a busy poller owns the context, leave the interrupt blocked */
+	if (rcd->busy_poll && !rcd_busy_poll_irq_claim(rcd))
+		return IRQ_HANDLED;
+
 	/* receive interrupt remains blocked while processing packets */
 	disposition = rcd->do_interrupt(rcd, 0);
 
@@ -8588,6 +8937,8 @@ irqreturn_t receive_context_interrupt(int irq, void *data)
 		return IRQ_WAKE_THREAD;
 
 	__hfi1_rcd_eoi_intr(rcd);
+	if (rcd->busy_poll)
+		rcd_busy_poll_release(rcd);
 	return IRQ_HANDLED;
 }
 
@@ -8603,6 +8954,8 @@ irqreturn_t receive_context_thread(int irq, void *data)
 	(void)rcd->do_interrupt(rcd, 1);
 
 	hfi1_rcd_eoi_intr(rcd);
+	if (rcd->busy_poll)
+		rcd_busy_poll_release(rcd);
 
 	return IRQ_HANDLED;
 }
@@ -10230,7 +10583,7 @@ static void set_send_length(struct hfi1_pportdata *ppd)
 			    sc_mtu_to_threshold(dd->vld[i].sc,
 						dd->vld[i].mtu,
 						get_hdrqentsize(dd->rcd[0])));
-		for (j = 0; j < INIT_SC_PER_VL; j++)
+		for (j = 0; j < pio_sc_per_vl; j++)
 			sc_set_cr_threshold(
 					pio_select_send_context_vl(dd, j, i),
 					    thres);
@@ -11880,13 +12233,39 @@ u32 cclock_to_ns(struct hfi1_devdata *dd, u32 cclocks)
 	return ns;
 }
 
+/* weight of a new sample in the rate estimates is 1/8 */
+#define RCV_INTR_EWMA_SHIFT 3
+/* a gap between interrupts longer than this restarts the estimates */
+#define RCV_INTR_IDLE_NS NSEC_PER_MSEC
+
+static void write_rcv_timeout(struct hfi1_ctxtdata *rcd, u32 timeout)
+{
+	rcd->rcvavail_timeout = timeout;
+	/*
+	 * timeout cannot be larger than the CSR field, callers have already
+	 * verified it to be in range
+	 */
+	write_kctxt_csr(rcd->dd, rcd->ctxt, RCV_AVAIL_TIME_OUT,
+			(u64)timeout <<
+			RCV_AVAIL_TIME_OUT_TIME_OUT_RELOAD_SHIFT);
+}
+
+/* convert a timeout in ns to the 64 * cclocks used in the CSR */
+static u32 rcv_timeout_csr(struct hfi1_devdata *dd, u32 ns)
+{
+	u32 timeout = ns_to_cclock(dd, ns) / 64;
+
+	return clamp_t(u32, timeout, 1,
+		       RCV_AVAIL_TIME_OUT_TIME_OUT_RELOAD_MASK);
+}
+
 /*
- * Dynamically adjust the receive interrupt timeout for a context based on
+ * Double or halve the receive interrupt timeout for a context based on
  * incoming packet rate.
  *
  * NOTE: Dynamic adjustment does not allow rcv_intr_count to be zero.
  */
-static void adjust_rcv_timeout(struct hfi1_ctxtdata *rcd, u32 npkts)
+static void adjust_rcv_timeout_step(struct hfi1_ctxtdata *rcd, u32 npkts)
 {
 	struct hfi1_devdata *dd = rcd->dd;
 	u32 timeout = rcd->rcvavail_timeout;
@@ -11900,7 +12279,7 @@ static void adjust_rcv_timeout(struct hfi1_ctxtdata *rcd, u32 npkts)
 	 * Only at the endpoints it is possible to have an unchanging
 	 * timeout.
 	 */
-	if (npkts < rcv_intr_count) {
+	if (npkts < rcd->intr_mod.count) {
 		/*
 		 * Not enough packets arrived before the timeout, adjust
 		 * timeout downward.
@@ -11918,14 +12297,91 @@ static void adjust_rcv_timeout(struct hfi1_ctxtdata *rcd, u32 npkts)
 		timeout = min(timeout << 1, dd->rcv_intr_timeout_csr);
 	}
 
-	rcd->rcvavail_timeout = timeout;
-	/*
-	 * timeout cannot be larger than rcv_intr_timeout_csr which has already
-	 * been verified to be in range
-	 */
-	write_kctxt_csr(dd, rcd->ctxt, RCV_AVAIL_TIME_OUT,
-			(u64)timeout <<
-			RCV_AVAIL_TIME_OUT_TIME_OUT_RELOAD_SHIFT);
+	write_rcv_timeout(rcd, timeout);
+}
+
+/*
+ * Pick the timeout that lets target_pkts packets arrive at the estimated
+ * packet rate, capped by the latency target max_ns. A steady packet rate
+ * gives a steady timeout.
+ */
+static void adjust_rcv_timeout_rate(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_rcv_intr_mod *mod = &rcd->intr_mod;
+	u32 max_ns = READ_ONCE(mod->max_ns);
+	u64 ns = max_ns;
+	u32 timeout;
+
+	if (mod->pkt_rate)
+		ns = div64_u64((u64)READ_ONCE(mod->target_pkts) *
+			       NSEC_PER_SEC, mod->pkt_rate);
+	timeout = rcv_timeout_csr(rcd->dd, min_t(u64, ns, max_ns));
+	if (timeout != rcd->rcvavail_timeout)
+		write_rcv_timeout(rcd, timeout);
+}
+
+static inline void rcv_intr_ewma(u64 *avg, u64 sample)
+{
+	*avg = *avg - (*avg >> RCV_INTR_EWMA_SHIFT) +
+		(sample >> RCV_INTR_EWMA_SHIFT);
+}
+
+/*
+ * Update the packet and interrupt rate estimates of a context, then let
+ * the context's moderation engine pick the next receive timeout.
+ */
+static void adjust_rcv_timeout(struct hfi1_ctxtdata *rcd, u32 npkts)
+{
+	struct hfi1_rcv_intr_mod *mod = &rcd->intr_mod;
+	ktime_t now = ktime_get();
+	u64 delta = ktime_to_ns(ktime_sub(now, mod->last_intr));
+	u64 pkt_rate, intr_rate;
+	u32 timeout;
+
+	mod->last_intr = now;
+	if (delta) {
+		pkt_rate = div64_u64((u64)npkts * NSEC_PER_SEC, delta);
+		intr_rate = div64_u64(NSEC_PER_SEC, delta);
+		/* a burst after an idle period starts a fresh estimate */
+		if (delta > RCV_INTR_IDLE_NS) {
+			mod->pkt_rate = pkt_rate;
+			mod->intr_rate = intr_rate;
+		} else {
+			rcv_intr_ewma(&mod->pkt_rate, pkt_rate);
+			rcv_intr_ewma(&mod->intr_rate, intr_rate);
+		}
+	}
+
+	switch (READ_ONCE(mod->mode)) {
+	case HFI1_RCV_INTR_MOD_STEP:
+		adjust_rcv_timeout_step(rcd, npkts);
+		break;
+	case HFI1_RCV_INTR_MOD_RATE:
+		adjust_rcv_timeout_rate(rcd);
+		break;
+	default:
+		timeout = rcv_timeout_csr(rcd->dd, READ_ONCE(mod->max_ns));
+		if (timeout != rcd->rcvavail_timeout)
+			write_rcv_timeout(rcd, timeout);
+		break;
+	}
+}
+
+/**
+ * hfi1_init_rcv_intr_mod - set a context's moderation knobs to the defaults
+ * @rcd: the receive context
+ */
+void hfi1_init_rcv_intr_mod(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_rcv_intr_mod *mod = &rcd->intr_mod;
+
+	mod->mode = rcv_intr_mod;
+	mod->count = rcv_intr_count;
+	mod->target_pkts = rcv_intr_count;
+	mod->max_ns = rcv_intr_timeout;
+	mod->last_intr = ktime_get();
+	mod->pkt_rate = 0;
+	mod->intr_rate = 0;
 }
 
 void update_usrhead(struct hfi1_ctxtdata *rcd, u32 hd, u32 updegr, u32 egrhd,
@@ -11946,7 +12402,8 @@ void update_usrhead(struct hfi1_ctxtdata *rcd, u32 hd, u32 updegr, u32 egrhd,
 			<< RCV_EGR_INDEX_HEAD_HEAD_SHIFT;
 		write_uctxt_csr(dd, ctxt, RCV_EGR_INDEX_HEAD, reg);
 	}
-	reg = ((u64)rcv_intr_count << RCV_HDR_HEAD_COUNTER_SHIFT) |
+	reg = ((u64)READ_ONCE(rcd->intr_mod.count) <<
+	       RCV_HDR_HEAD_COUNTER_SHIFT) |
 		(((u64)hd & RCV_HDR_HEAD_HEAD_MASK)
 			<< RCV_HDR_HEAD_HEAD_SHIFT);
 	write_uctxt_csr(dd, ctxt, RCV_HDR_HEAD, reg);
@@ -12255,7 +12712,7 @@ void hfi1_rcvctrl(struct hfi1_devdata *dd, unsigned int op,
 				RCV_AVAIL_TIME_OUT_TIME_OUT_RELOAD_SHIFT);
 
 		/* set RcvHdrHead.Counter, zero RcvHdrHead.Head (again) */
-		reg = (u64)rcv_intr_count << RCV_HDR_HEAD_COUNTER_SHIFT;
+		reg = (u64)rcd->intr_mod.count << RCV_HDR_HEAD_COUNTER_SHIFT;
 		write_uctxt_csr(dd, ctxt, RCV_HDR_HEAD, reg);
 	}
 
@@ -14512,6 +14969,8 @@ static void init_qos(struct hfi1_devdata *dd, struct rsm_map_table *rmt)
 	/* add rule 0 */
 	add_rsm_rule(dd, RSM_INS_VERBS, &rrd);
 
+	dd->krcv_rmt_start = rmt->used;
+	dd->krcv_rmt_entries = rmt_entries;
 	/* mark RSM map entries as used */
 	rmt->used += rmt_entries;
 	/* map everything else to the mcast/err/vl15 context */
@@ -14520,9 +14979,121 @@ static void init_qos(struct hfi1_devdata *dd, struct rsm_map_table *rmt)
 	return;
 bail:
 	dd->qos_shift = 1;
+	dd->krcv_rmt_entries = 0;
 	init_qpmap_table(dd, FIRST_KERNEL_KCTXT, dd->n_krcv_queues - 1);
 }
 
+/*
+ * The QPN selected kernel receive context map: the QOS entries of the RSM
+ * map table when QOS is active, otherwise the QP map table.  Returns the
+ * map register holding the first entry.
+ */
+static u32 krcv_map_table(struct hfi1_devdata *dd, u32 *first, u32 *nentries)
+{
+	if (dd->krcv_rmt_entries) {
+		*first = dd->krcv_rmt_start;
+		*nentries = dd->krcv_rmt_entries;
+		return RCV_RSM_MAP_TABLE + (*first / 8) * 8;
+	}
+	*first = 0;
+	*nentries = 256;
+	return RCV_QP_MAP_TABLE;
+}
+
+/*
+ * Spread the kernel receive context map over ctxts, round robin.  The map
+ * registers are shared with the netdev RSM entries, so this is a
+ * read-modify-write under rmt_mutex.
+ */
+static void krcv_map_write(struct hfi1_devdata *dd, const u8 *ctxts, u32 n)
+{
+	u32 regoff, first, nentries, i, j;
+	u64 reg;
+
+	lockdep_assert_held(&dd->rmt_mutex);
+
+	regoff = krcv_map_table(dd, &first, &nentries);
+	reg = read_csr(dd, regoff);
+	for (i = 0; i < nentries; i++) {
+		j = (first + i) % 8;
+		reg &= ~(0xffull << (j * 8));
+		reg |= (u64)ctxts[i % n] << (j * 8);
+		/* write back the map register, keep entries not ours */
+		if (j == 7 || (i + 1) == nentries) {
+			write_csr(dd, regoff, reg);
+			regoff += 8;
+			if ((i + 1) < nentries)
+				reg = read_csr(dd, regoff);
+		}
+	}
+}
+
+/**
+ * hfi1_krcv_map_get - read the QPN to kernel receive context map
+ * @dd: the device
+ * @map: filled with the receive context of each map entry
+ * @max: size of @map
+ *
+ * Return: the number of map entries
+ */
+u32 hfi1_krcv_map_get(struct hfi1_devdata *dd, u8 *map, u32 max)
+{
+	u32 regoff, first, nentries, i, j;
+	u64 reg;
+
+	mutex_lock(&dd->rmt_mutex);
+	regoff = krcv_map_table(dd, &first, &nentries);
+	nentries = min(nentries, max);
+	reg = read_csr(dd, regoff);
+	for (i = 0; i < nentries; i++) {
+		j = (first + i) % 8;
+		map[i] = (reg >> (j * 8)) & 0xff;
+		if (j == 7 && (i + 1) < nentries) {
+			regoff += 8;
+			reg = read_csr(dd, regoff);
+		}
+	}
+	mutex_unlock(&dd->rmt_mutex);
+	return nentries;
+}
+
+/**
+ * hfi1_krcv_map_set - spread kernel verbs receive traffic over contexts
+ * @dd: the device
+ * @ctxts: kernel receive contexts, used round robin
+ * @n: number of entries in @ctxts
+ *
+ * Rewrite the QPN selected kernel receive context map of a live device.
+ * With QOS active every VL is spread over all of @ctxts.  A QP keeps the
+ * receive context it was given at creation for its TID RDMA state, so the
+ * map can only be changed while no such QP exists.
+ *
+ * Return: 0 on success, -EINVAL if @ctxts is empty, too long or holds
+ * anything other than a kernel verbs context, -EBUSY if QPs are using the
+ * current map.
+ */
+int hfi1_krcv_map_set(struct hfi1_devdata *dd, const u8 *ctxts, u32 n)
+{
+	u32 i;
+
+	if (!n || n > ARRAY_SIZE(dd->krcv_map))
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (ctxts[i] < FIRST_KERNEL_KCTXT ||
+		    ctxts[i] >= dd->first_dyn_alloc_ctxt)
+			return -EINVAL;
+
+	mutex_lock(&dd->rmt_mutex);
+	if (dd->krcv_map_qps) {
+		mutex_unlock(&dd->rmt_mutex);
+		return -EBUSY;
+	}
+	krcv_map_write(dd, ctxts, n);
+	mutex_unlock(&dd->rmt_mutex);
+
+	return 0;
+}
+
 static void init_fecn_handling(struct hfi1_devdata *dd,
 			       struct rsm_map_table *rmt)
 {
@@ -14656,12 +15227,16 @@ static bool hfi1_netdev_update_rmt(struct hfi1_devdata *dd)
 static void hfi1_enable_rsm_rule(struct hfi1_devdata *dd,
 		int rule, struct rsm_rule_data *rrd)
 {
+	/* the map registers are shared with the kernel receive context map */
+	mutex_lock(&dd->rmt_mutex);
 	if (!hfi1_netdev_update_rmt(dd)) {
+		mutex_unlock(&dd->rmt_mutex);
 		dd_dev_err(dd, "Failed to update RMT for RSM%d rule\n", rule);
 		return;
 	}
 
 	add_rsm_rule(dd, rule, rrd);
+	mutex_unlock(&dd->rmt_mutex);
 	add_rcvctrl(dd, RCV_CTRL_RCV_RSM_ENABLE_SMASK);
 }
 
@@ -15350,6 +15925,10 @@ int hfi1_init_dd(struct hfi1_devdata *dd)
 	if (ret)
 		goto bail_cleanup;
 
+	ret = hfi1_krcv_napi_init(dd);
+	if (ret)
+		goto bail_cleanup;
+
 	/*
 	 * Initialize aspm, to be done after gen3 transition and setting up
 	 * contexts and before enabling interrupts
@@ -15421,6 +16000,7 @@ bail_clear_intr:
 	hfi1_comp_vectors_clean_up(dd);
 	msix_clean_up_interrupts(dd);
 bail_cleanup:
+	hfi1_krcv_napi_free(dd);
 	hfi1_netdev_free(dd);
 	hfi1_pcie_ddcleanup(dd);
 bail_free:
@@ -802,6 +802,9 @@ int bringup_serdes(struct hfi1_pportdata *ppd);
 void set_intr_state(struct hfi1_devdata *dd, u32 enable);
 bool apply_link_downgrade_policy(struct hfi1_pportdata *ppd,
 				 bool refresh_widths);
+void hfi1_init_rcv_intr_mod(struct hfi1_ctxtdata *rcd);
+u32 hfi1_krcv_map_get(struct hfi1_devdata *dd, u8 *map, u32 max);
+int hfi1_krcv_map_set(struct hfi1_devdata *dd, const u8 *ctxts, u32 n);
 void update_usrhead(struct hfi1_ctxtdata *rcd, u32 hd, u32 updegr, u32 egrhd,
 		    u32 intr_adjust, u32 npkts);
 int stop_drain_data_vls(struct hfi1_devdata *dd);
@@ -944,6 +947,8 @@ enum {
 	C_SW_KMEM_WAIT,
 	C_SW_TID_WAIT,
 	C_SW_SEND_SCHED,
+	C_SW_CPU_RX_ZCOPY,
+	C_SW_CPU_RX_COPY,
 	C_SDMA_DESC_FETCHED_CNT,
 	C_SDMA_INT_CNT,
 	C_SDMA_ERR_CNT,
@@ -1453,6 +1458,10 @@ irqreturn_t sdma_interrupt(int irq, void *data);
 irqreturn_t receive_context_interrupt(int irq, void *data);
 irqreturn_t receive_context_thread(int irq, void *data);
 irqreturn_t receive_context_interrupt_napi(int irq, void *data);
+bool hfi1_busy_poll_cq(struct rvt_cq *cq);
+void hfi1_init_rcd_busy_poll(struct hfi1_ctxtdata *rcd);
+int hfi1_krcv_napi_init(struct hfi1_devdata *dd);
+void hfi1_krcv_napi_free(struct hfi1_devdata *dd);
 
 int set_intr_bits(struct hfi1_devdata *dd, u16 first, u16 last, bool set);
 void init_qsfp_int(struct hfi1_devdata *dd);
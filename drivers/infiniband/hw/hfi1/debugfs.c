@@ -61,6 +61,7 @@
 #include "qp.h"
 #include "sdma.h"
 #include "fault.h"
+#include "user_sdma.h"
 
 static struct dentry *hfi1_dbg_root;
 
@@ -393,6 +394,58 @@ DEBUGFS_SEQ_FILE_OPS(sdes);
 DEBUGFS_SEQ_FILE_OPEN(sdes)
 DEBUGFS_FILE_OPS(sdes);
 
+static void *_sdma_hist_seq_start(struct seq_file *s, loff_t *pos)
+{
+	return _sdes_seq_start(s, pos);
+}
+
+static void *_sdma_hist_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	return _sdes_seq_next(s, v, pos);
+}
+
+static void _sdma_hist_seq_stop(struct seq_file *s, void *v)
+{
+}
+
+static int _sdma_hist_seq_show(struct seq_file *s, void *v)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	loff_t *spos = v;
+	loff_t i = *spos;
+
+	sdma_seqfile_dump_hist(s, &dd->per_sdma[i]);
+	return 0;
+}
+
+DEBUGFS_SEQ_FILE_OPS(sdma_hist);
+DEBUGFS_SEQ_FILE_OPEN(sdma_hist)
+
+/* any write clears the histograms of all engines */
+static ssize_t _sdma_hist_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct hfi1_ibdev *ibd = file_inode(file)->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	int i;
+
+	if (!dd->per_sdma)
+		return -ENODEV;
+	for (i = 0; i < dd->num_sdma; i++)
+		sdma_hist_reset(&dd->per_sdma[i]);
+	return count;
+}
+
+static const struct file_operations _sdma_hist_file_ops = {
+	.owner   = THIS_MODULE,
+	.open    = _sdma_hist_open,
+	.read    = hfi1_seq_read,
+	.write   = _sdma_hist_write,
+	.llseek  = hfi1_seq_lseek,
+	.release = seq_release
+};
+
 static void *_rcds_seq_start(struct seq_file *s, loff_t *pos)
 {
 	struct hfi1_ibdev *ibd;
@@ -439,6 +492,420 @@ DEBUGFS_SEQ_FILE_OPS(rcds);
 DEBUGFS_SEQ_FILE_OPEN(rcds)
 DEBUGFS_FILE_OPS(rcds);
 
+static void *_rcv_intr_mod_seq_start(struct seq_file *s, loff_t *pos)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	if (!dd->rcd || *pos >= dd->num_rcv_contexts)
+		return NULL;
+	return pos;
+}
+
+static void *_rcv_intr_mod_seq_next(struct seq_file *s, void *v,
+				    loff_t *pos)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	++*pos;
+	if (!dd->rcd || *pos >= dd->num_rcv_contexts)
+		return NULL;
+	return pos;
+}
+
+static void _rcv_intr_mod_seq_stop(struct seq_file *s, void *v)
+{
+}
+
+static int _rcv_intr_mod_seq_show(struct seq_file *s, void *v)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_rcv_intr_mod *mod;
+	struct hfi1_ctxtdata *rcd;
+	loff_t *spos = v;
+	loff_t i = *spos;
+
+	if (i == 0)
+		seq_printf(s, "%-5s %-4s %-5s %-4s %-8s %-8s %-12s %-10s\n",
+			   "ctxt", "mode", "count", "pkts", "max_ns",
+			   "tmo_ns", "pkt_rate", "intr_rate");
+	rcd = hfi1_rcd_get_by_index_safe(dd, i);
+	if (rcd) {
+		mod = &rcd->intr_mod;
+		seq_printf(s, "%-5u %-4u %-5u %-4u %-8u %-8u %-12llu %-10llu\n",
+			   rcd->ctxt, mod->mode, mod->count, mod->target_pkts,
+			   mod->max_ns,
+			   cclock_to_ns(dd, (u32)rcd->rcvavail_timeout * 64),
+			   mod->pkt_rate, mod->intr_rate);
+	}
+	hfi1_rcd_put(rcd);
+	return 0;
+}
+
+DEBUGFS_SEQ_FILE_OPS(rcv_intr_mod);
+DEBUGFS_SEQ_FILE_OPEN(rcv_intr_mod)
+
+/*
+ * Change one receive interrupt moderation knob of a context:
+ *	<ctxt> mode|count|pkts|max_ns <value>
+ */
+static ssize_t _rcv_intr_mod_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct hfi1_ibdev *ibd = file_inode(file)->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_rcv_intr_mod *mod;
+	struct hfi1_ctxtdata *rcd;
+	char knob[8];
+	char *buff;
+	u32 ctxt;
+	u32 value;
+	int ret;
+
+	buff = memdup_user_nul(buf, count);
+	if (IS_ERR(buff))
+		return PTR_ERR(buff);
+
+	if (sscanf(buff, "%u %7s %u", &ctxt, knob, &value) != 3) {
+		ret = -EINVAL;
+		goto do_free;
+	}
+
+	rcd = hfi1_rcd_get_by_index_safe(dd, ctxt);
+	if (!rcd) {
+		ret = -EINVAL;
+		goto do_free;
+	}
+	mod = &rcd->intr_mod;
+
+	ret = count;
+	if (!strcmp(knob, "mode") && value <= HFI1_RCV_INTR_MOD_RATE)
+		WRITE_ONCE(mod->mode, value);
+	else if (!strcmp(knob, "count") && value &&
+		 value <= RCV_HDR_HEAD_COUNTER_MASK)
+		WRITE_ONCE(mod->count, value);
+	else if (!strcmp(knob, "pkts") && value && value <= U16_MAX)
+		WRITE_ONCE(mod->target_pkts, value);
+	else if (!strcmp(knob, "max_ns") && value)
+		WRITE_ONCE(mod->max_ns, value);
+	else
+		ret = -EINVAL;
+	hfi1_rcd_put(rcd);
+
+ do_free:
+	kfree(buff);
+	return ret;
+}
+
+static const struct file_operations _rcv_intr_mod_file_ops = {
+	.owner   = THIS_MODULE,
+	.open    = _rcv_intr_mod_open,
+	.read    = hfi1_seq_read,
+	.write   = _rcv_intr_mod_write,
+	.llseek  = hfi1_seq_lseek,
+	.release = seq_release
+};
+
+static void *_krcv_busy_poll_seq_start(struct seq_file *s, loff_t *pos)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	if (!dd->rcd || *pos >= dd->first_dyn_alloc_ctxt)
+		return NULL;
+	return pos;
+}
+
+static void *_krcv_busy_poll_seq_next(struct seq_file *s, void *v,
+				      loff_t *pos)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	++*pos;
+	if (!dd->rcd || *pos >= dd->first_dyn_alloc_ctxt)
+		return NULL;
+	return pos;
+}
+
+static void _krcv_busy_poll_seq_stop(struct seq_file *s, void *v)
+{
+}
+
+static int _krcv_busy_poll_seq_show(struct seq_file *s, void *v)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_ctxtdata *rcd;
+	loff_t *spos = v;
+	loff_t i = *spos;
+
+	if (i == 0)
+		seq_printf(s, "%-5s %-7s %-7s %-4s\n",
+			   "ctxt", "capable", "enabled", "held");
+	rcd = hfi1_rcd_get_by_index_safe(dd, i);
+	if (rcd)
+		seq_printf(s, "%-5u %-7u %-7u %-4u\n",
+			   rcd->ctxt, rcd->busy_poll,
+			   READ_ONCE(rcd->busy_poll_enabled),
+			   test_bit(HFI1_RCD_BP_HELD, &rcd->busy_poll_flags));
+	hfi1_rcd_put(rcd);
+	return 0;
+}
+
+DEBUGFS_SEQ_FILE_OPS(krcv_busy_poll);
+DEBUGFS_SEQ_FILE_OPEN(krcv_busy_poll)
+
+/*
+ * Opt a kernel receive context in or out of CQ busy polling:
+ *	<ctxt> 0|1
+ * A context that is turned off while held gets its interrupt back from
+ * busy_poll_timer once the pollers are gone.
+ */
+static ssize_t _krcv_busy_poll_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct hfi1_ibdev *ibd = file_inode(file)->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_ctxtdata *rcd;
+	char *buff;
+	u32 ctxt;
+	u32 value;
+	int ret;
+
+	buff = memdup_user_nul(buf, count);
+	if (IS_ERR(buff))
+		return PTR_ERR(buff);
+
+	if (sscanf(buff, "%u %u", &ctxt, &value) != 2 || value > 1) {
+		ret = -EINVAL;
+		goto do_free;
+	}
+
+	rcd = hfi1_rcd_get_by_index_safe(dd, ctxt);
+	if (!rcd) {
+		ret = -EINVAL;
+		goto do_free;
+	}
+
+	ret = count;
+	if (rcd->busy_poll)
+		WRITE_ONCE(rcd->busy_poll_enabled, value);
+	else
+		ret = -EINVAL;
+	hfi1_rcd_put(rcd);
+
+ do_free:
+	kfree(buff);
+	return ret;
+}
+
+static const struct file_operations _krcv_busy_poll_file_ops = {
+	.owner   = THIS_MODULE,
+	.open    = _krcv_busy_poll_open,
+	.read    = hfi1_seq_read,
+	.write   = _krcv_busy_poll_write,
+	.llseek  = hfi1_seq_lseek,
+	.release = seq_release
+};
+
+static void *_pio_crossover_seq_start(struct seq_file *s, loff_t *pos)
+{
+	if (*pos >= HFI1_MAX_VLS_SUPPORTED)
+		return NULL;
+	return pos;
+}
+
+static void *_pio_crossover_seq_next(struct seq_file *s, void *v,
+				     loff_t *pos)
+{
+	++*pos;
+	if (*pos >= HFI1_MAX_VLS_SUPPORTED)
+		return NULL;
+	return pos;
+}
+
+static void _pio_crossover_seq_stop(struct seq_file *s, void *v)
+{
+}
+
+static int _pio_crossover_seq_show(struct seq_file *s, void *v)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_pio_xover *x;
+	loff_t *spos = v;
+	loff_t i = *spos;
+
+	if (i == 0)
+		seq_printf(s, "%-3s %-6s %-6s %-10s %-10s\n",
+			   "vl", "thresh", "stalls", "sdma_ns", "floor_ns");
+	x = &dd->pio_xover[i];
+	seq_printf(s, "%-3lld %-6u %-6d %-10u %-10u\n", i,
+		   READ_ONCE(x->thresh), atomic_read(&x->stalls),
+		   READ_ONCE(x->sdma_lat_ns), READ_ONCE(x->sdma_lat_floor));
+	return 0;
+}
+
+DEBUGFS_SEQ_FILE_OPS(pio_crossover);
+DEBUGFS_SEQ_FILE_OPEN(pio_crossover)
+
+/*
+ * Set the crossover of a VL, e.g. from a calibration sweep:
+ *	<vl> <bytes>
+ */
+static ssize_t _pio_crossover_write(struct file *file,
+				    const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct hfi1_ibdev *ibd = file_inode(file)->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	char *buff;
+	u32 vl;
+	u16 thresh;
+	int ret;
+
+	buff = memdup_user_nul(buf, count);
+	if (IS_ERR(buff))
+		return PTR_ERR(buff);
+
+	ret = count;
+	if (sscanf(buff, "%u %hu", &vl, &thresh) != 2 ||
+	    vl >= HFI1_MAX_VLS_SUPPORTED)
+		ret = -EINVAL;
+	else
+		hfi1_pio_xover_set(dd, vl, thresh);
+
+	kfree(buff);
+	return ret;
+}
+
+static const struct file_operations _pio_crossover_file_ops = {
+	.owner   = THIS_MODULE,
+	.open    = _pio_crossover_open,
+	.read    = hfi1_seq_read,
+	.write   = _pio_crossover_write,
+	.llseek  = hfi1_seq_lseek,
+	.release = seq_release
+};
+
+struct rcv_occ_snapshot {
+	size_t len;
+	u8 data[];
+};
+
+static bool rcv_occ_ctxt(struct hfi1_ctxtdata *rcd)
+{
+	return rcd->ctxt < rcd->dd->first_dyn_alloc_ctxt || rcd->is_vnic;
+}
+
+/*
+ * Snapshot the occupancy histograms of all kernel and netdev receive
+ * contexts at open so that a collector gets a consistent image in one
+ * bulk read.
+ */
+static int _rcv_occupancy_open(struct inode *inode, struct file *file)
+{
+	struct hfi1_ibdev *ibd = inode->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_rcv_occ_header *hdr;
+	struct hfi1_rcv_occ_record *rec;
+	struct rcv_occ_snapshot *snap;
+	struct hfi1_ctxtdata *rcd;
+	u16 i;
+
+	snap = kvzalloc(struct_size(snap, data, sizeof(*hdr) +
+				    dd->num_rcv_contexts * sizeof(*rec)),
+			GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	hdr = (struct hfi1_rcv_occ_header *)snap->data;
+	hdr->version = HFI1_RCV_OCC_VERSION;
+	hdr->nbuckets = HFI1_RCV_OCC_BUCKETS;
+	hdr->record_size = sizeof(*rec);
+	rec = (struct hfi1_rcv_occ_record *)(hdr + 1);
+
+	for (i = 0; i < dd->num_rcv_contexts; i++) {
+		rcd = hfi1_rcd_get_by_index_safe(dd, i);
+		if (!rcd)
+			continue;
+		if (rcv_occ_ctxt(rcd)) {
+			rec->ctxt = rcd->ctxt;
+			rec->hdrq_cnt = get_hdrq_cnt(rcd);
+			rec->egr_cnt = rcd->egrbufs.alloced;
+			rec->max_burst = READ_ONCE(rcd->occ.max_burst);
+			rec->samples = READ_ONCE(rcd->occ.samples);
+			memcpy(rec->hdrq, rcd->occ.hdrq, sizeof(rec->hdrq));
+			memcpy(rec->egr_used, rcd->occ.egr_used,
+			       sizeof(rec->egr_used));
+			memcpy(rec->burst, rcd->occ.burst, sizeof(rec->burst));
+			hdr->nrecords++;
+			rec++;
+		}
+		hfi1_rcd_put(rcd);
+	}
+	snap->len = (u8 *)rec - snap->data;
+	file->private_data = snap;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t _rcv_occupancy_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct rcv_occ_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snap->data,
+				       snap->len);
+}
+
+/* any write clears the histograms of all contexts */
+static ssize_t _rcv_occupancy_write(struct file *file,
+				    const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct hfi1_ibdev *ibd = file_inode(file)->i_private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_ctxtdata *rcd;
+	u16 i;
+
+	for (i = 0; i < dd->num_rcv_contexts; i++) {
+		rcd = hfi1_rcd_get_by_index_safe(dd, i);
+		if (!rcd)
+			continue;
+		if (rcv_occ_ctxt(rcd)) {
+			memset(rcd->occ.hdrq, 0, sizeof(rcd->occ.hdrq));
+			memset(rcd->occ.egr_used, 0,
+			       sizeof(rcd->occ.egr_used));
+			memset(rcd->occ.burst, 0, sizeof(rcd->occ.burst));
+			WRITE_ONCE(rcd->occ.max_burst, 0);
+			WRITE_ONCE(rcd->occ.samples, 0);
+		}
+		hfi1_rcd_put(rcd);
+	}
+
+	return count;
+}
+
+static int _rcv_occupancy_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations _rcv_occupancy_file_ops = {
+	.owner   = THIS_MODULE,
+	.open    = _rcv_occupancy_open,
+	.read    = _rcv_occupancy_read,
+	.write   = _rcv_occupancy_write,
+	.llseek  = no_llseek,
+	.release = _rcv_occupancy_release
+};
+
 static void *_pios_seq_start(struct seq_file *s, loff_t *pos)
 {
 	struct hfi1_ibdev *ibd;
@@ -1280,6 +1747,58 @@ DEBUGFS_SEQ_FILE_OPS(sdma_cpu_list);
 DEBUGFS_SEQ_FILE_OPEN(sdma_cpu_list)
 DEBUGFS_FILE_OPS(sdma_cpu_list);
 
+static void *_sdma_cache_seq_start(struct seq_file *s, loff_t *pos)
+	__acquires(dd->user_sdma_pq_lock)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	spin_lock(&dd->user_sdma_pq_lock);
+	return seq_list_start_head(&dd->user_sdma_pqs, *pos);
+}
+
+static void *_sdma_cache_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	return seq_list_next(v, &dd->user_sdma_pqs, pos);
+}
+
+static void _sdma_cache_seq_stop(struct seq_file *s, void *v)
+	__releases(dd->user_sdma_pq_lock)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+
+	spin_unlock(&dd->user_sdma_pq_lock);
+}
+
+static int _sdma_cache_seq_show(struct seq_file *s, void *v)
+{
+	struct hfi1_ibdev *ibd = (struct hfi1_ibdev *)s->private;
+	struct hfi1_devdata *dd = dd_from_dev(ibd);
+	struct hfi1_user_sdma_pkt_q *pq;
+	struct mmu_rb_stats stats;
+
+	if (v == &dd->user_sdma_pqs) {
+		seq_puts(s, "# ctxt.subctxt pid hits misses rebuilds evictions invalidations cached_bytes pinned_bytes\n");
+		return 0;
+	}
+	pq = list_entry(v, struct hfi1_user_sdma_pkt_q, list);
+	hfi1_mmu_rb_get_stats(pq->handler, &stats);
+	seq_printf(s, "%u.%u %d %llu %llu %llu %llu %llu %llu %llu\n",
+		   pq->ctxt, pq->subctxt, pq->pid, stats.hits, stats.misses,
+		   stats.rebuilds, stats.evictions, stats.invalidations,
+		   stats.bytes,
+		   (u64)atomic_read(&pq->n_locked) << PAGE_SHIFT);
+	return 0;
+}
+
+DEBUGFS_SEQ_FILE_OPS(sdma_cache);
+DEBUGFS_SEQ_FILE_OPEN(sdma_cache)
+DEBUGFS_FILE_OPS(sdma_cache);
+
 void hfi1_dbg_ibdev_init(struct hfi1_ibdev *ibd)
 {
 	char name[sizeof("port0counters") + 1];
@@ -1307,10 +1826,22 @@ void hfi1_dbg_ibdev_init(struct hfi1_ibdev *ibd)
 	debugfs_create_file("ctx_stats", 0444, root, ibd, &_ctx_stats_file_ops);
 	debugfs_create_file("qp_stats", 0444, root, ibd, &_qp_stats_file_ops);
 	debugfs_create_file("sdes", 0444, root, ibd, &_sdes_file_ops);
+	debugfs_create_file("sdma_hist", 0644, root, ibd,
+			    &_sdma_hist_file_ops);
 	debugfs_create_file("rcds", 0444, root, ibd, &_rcds_file_ops);
+	debugfs_create_file("rcv_intr_mod", 0644, root, ibd,
+			    &_rcv_intr_mod_file_ops);
+	debugfs_create_file("krcv_busy_poll", 0644, root, ibd,
+			    &_krcv_busy_poll_file_ops);
+	debugfs_create_file("rcv_occupancy", 0644, root, ibd,
+			    &_rcv_occupancy_file_ops);
 	debugfs_create_file("pios", 0444, root, ibd, &_pios_file_ops);
+	debugfs_create_file("pio_crossover", 0644, root, ibd,
+			    &_pio_crossover_file_ops);
 	debugfs_create_file("sdma_cpu_list", 0444, root, ibd,
 			    &_sdma_cpu_list_file_ops);
+	debugfs_create_file("sdma_cache", 0444, root, ibd,
+			    &_sdma_cache_file_ops);
 
 	/* dev counter files */
 	for (i = 0; i < ARRAY_SIZE(cntr_ops); i++)
@@ -114,6 +114,25 @@ MODULE_VERSION(HFI1_DRIVER_VERSION);
  */
 #define MAX_PKT_RECV_THREAD (MAX_PKT_RECV * 4)
 #define EGR_HEAD_UPDATE_THRESHOLD 16
+/*
+ * MAX_RCV_PREFETCH is the furthest the receive loop looks ahead in the
+ * rcvhdrq.
+ */
+#define MAX_RCV_PREFETCH 16
+
+/*
+ * MAX_RCV_BATCH is the most packets delivered to a QP under a single
+ * r_lock acquisition.
+ */
+#define MAX_RCV_BATCH 64
+
+static uint rcv_batch;
+module_param(rcv_batch, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rcv_batch, "Max consecutive packets to a QP delivered under one r_lock, 0 - disabled (default), max " __stringify(MAX_RCV_BATCH));
+
+static uint rcv_prefetch;
+module_param(rcv_prefetch, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rcv_prefetch, "Number of rcvhdrq entries to prefetch ahead of the receive loop, 0 - disabled (default), max " __stringify(MAX_RCV_PREFETCH));
 
 struct hfi1_ib_stats hfi1_stats;
 
@@ -416,6 +435,21 @@ drop:
 	return;
 }
 
+/*
+ * Set up the receive loop lookahead.  The header of the entry rcv_prefetch
+ * entries ahead is prefetched, and the eager buffer of the entry half as
+ * far ahead, whose header was prefetched on an earlier pass.
+ */
+static inline void init_packet_prefetch(struct hfi1_ctxtdata *rcd,
+					struct hfi1_packet *packet)
+{
+	u32 n = min3(READ_ONCE(rcv_prefetch), (u32)MAX_RCV_PREFETCH,
+		     get_hdrq_cnt(rcd) / 2);
+
+	packet->pf_hdr = n * packet->rsize;
+	packet->pf_egr = DIV_ROUND_UP(n, 2) * packet->rsize;
+}
+
 static inline void init_packet(struct hfi1_ctxtdata *rcd,
 			       struct hfi1_packet *packet)
 {
@@ -429,6 +463,23 @@ static inline void init_packet(struct hfi1_ctxtdata *rcd,
 	packet->etype = rhf_rcv_type(packet->rhf);
 	packet->rhqoff = hfi1_rcd_head(rcd);
 	packet->numpkt = 0;
+	packet->hdrq_queued = U32_MAX;
+	if (hfi1_rcvhdrtail_kvaddr(rcd)) {
+		u32 tail = get_rcvhdrtail(rcd);
+
+		if (tail >= packet->rhqoff)
+			packet->hdrq_queued = tail - packet->rhqoff;
+		else
+			packet->hdrq_queued = packet->maxcnt -
+				packet->rhqoff + tail;
+		packet->hdrq_queued /= packet->rsize;
+	}
+	packet->rqp = NULL;
+	packet->rbatch = 0;
+	/* netdev contexts never deliver to verbs QPs */
+	packet->rbatch_max = rcd->is_vnic ? 0 :
+		min_t(u32, READ_ONCE(rcv_batch), MAX_RCV_BATCH);
+	init_packet_prefetch(rcd, packet);
 }
 
 /* We support only two types - 9B and 16B for now */
@@ -635,11 +686,20 @@ static void __prescan_rxq(struct hfi1_packet *packet)
 		struct rvt_dev_info *rdi = &rcd->dd->verbs_dev.rdi;
 		u64 rhf = rhf_to_cpu(rhf_addr);
 		u32 etype = rhf_rcv_type(rhf), qpn, bth1;
+		u32 pf_off;
 		u8 lnh;
 
 		if (ps_done(&mdata, rhf, rcd))
 			break;
 
+		if (packet->pf_hdr) {
+			pf_off = mdata.ps_head + packet->pf_hdr;
+			if (pf_off >= mdata.maxcnt)
+				pf_off -= mdata.maxcnt;
+			prefetch_range((__le32 *)rcd->rcvhdrq + pf_off,
+				       packet->rsize << 2);
+		}
+
 		if (ps_skip(&mdata, rhf, rcd))
 			goto next;
 
@@ -689,6 +749,8 @@ static void process_rcv_qp_work(struct hfi1_packet *packet)
 	struct rvt_qp *qp, *nqp;
 	struct hfi1_ctxtdata *rcd = packet->rcd;
 
+	hfi1_rcv_batch_flush(packet);
+
 	/*
 	 * Iterate over all QPs waiting to respond.
 	 * The list won't change since the IRQ is only run on one CPU.
@@ -720,6 +782,8 @@ static noinline int max_packet_exceeded(struct hfi1_packet *packet, int thread)
 		if ((packet->numpkt & (MAX_PKT_RECV_THREAD - 1)) == 0)
 			/* allow defered processing */
 			process_rcv_qp_work(packet);
+		/* never yield with a batched r_lock held */
+		hfi1_rcv_batch_flush(packet);
 		cond_resched();
 		return RCV_PKT_OK;
 	} else {
@@ -757,6 +821,38 @@ static noinline int skip_rcv_packet(struct hfi1_packet *packet, int thread)
 	return ret;
 }
 
+/*
+ * Prefetch ahead of the receive loop.  The entries ahead may not have
+ * been written by the chip yet, in which case the prefetches are wasted
+ * but harmless: the eager index is bounds checked before use.
+ */
+static inline void prefetch_rcv_ahead(struct hfi1_packet *packet)
+{
+	struct hfi1_ctxtdata *rcd = packet->rcd;
+	u32 off;
+	u32 idx;
+	u64 rhf;
+
+	if (likely(!packet->pf_hdr))
+		return;
+
+	off = packet->rhqoff + packet->pf_hdr;
+	if (off >= packet->maxcnt)
+		off -= packet->maxcnt;
+	prefetch_range((__le32 *)rcd->rcvhdrq + off, packet->rsize << 2);
+
+	off = packet->rhqoff + packet->pf_egr;
+	if (off >= packet->maxcnt)
+		off -= packet->maxcnt;
+	rhf = rhf_to_cpu((__le32 *)rcd->rcvhdrq + off + rcd->rhf_offset);
+	if (!rhf_use_egr_bfr(rhf))
+		return;
+	idx = rhf_egr_index(rhf);
+	if (idx < rcd->egrbufs.alloced)
+		prefetch((void *)rcd->egrbufs.rcvtids[idx].addr +
+			 rhf_egr_buf_offset(rhf) * RCV_BUF_BLOCK_SIZE);
+}
+
 static inline void process_rcv_packet_napi(struct hfi1_packet *packet)
 {
 	packet->etype = rhf_rcv_type(packet->rhf);
@@ -767,6 +863,8 @@ static inline void process_rcv_packet_napi(struct hfi1_packet *packet)
 	packet->etail = rhf_egr_index(packet->rhf);
 	packet->ebuf = get_egrbuf(packet->rcd, packet->rhf,
 				  &packet->updegr);
+	if (packet->rcd->egrbufs.zc)
+		hfi1_netdev_egr_track(packet);
 		/*
 		 * Prefetch the contents of the eager buffer.  It is
 		 * OK to send a negative length to prefetch_range().
@@ -776,6 +874,7 @@ static inline void process_rcv_packet_napi(struct hfi1_packet *packet)
 		       packet->tlen - ((packet->rcd->rcvhdrqentsize -
 				       (rhf_hdrq_offset(packet->rhf)
 					+ 2)) * 4));
+	prefetch_rcv_ahead(packet);
 
 	packet->rcd->rhf_rcv_function_map[packet->etype](packet);
 	packet->numpkt++;
@@ -814,6 +913,12 @@ static inline int process_rcv_packet(struct hfi1_packet *packet, int thread)
 					       (rhf_hdrq_offset(packet->rhf)
 						+ 2)) * 4));
 	}
+	prefetch_rcv_ahead(packet);
+
+	/* only error free IB packets may continue an r_lock batch */
+	if (packet->rqp && (packet->etype != RHF_RCV_TYPE_IB ||
+			    rhf_err_flags(packet->rhf)))
+		hfi1_rcv_batch_flush(packet);
 
 	/*
 	 * Call a type specific handler for the packet. We
@@ -856,6 +961,63 @@ static inline void process_rcv_update(int last, struct hfi1_packet *packet)
 	packet->grh = NULL; /* FIXME Why is this here? */
 }
 
+/*
+ * Account one receive call in the context's occupancy histograms.
+ *
+ * The hdrq sample is the number of entries queued when the call started,
+ * known when the tail is DMA'ed.  Otherwise it is the number of packets
+ * the call drained, which stands for the queue depth only while the call
+ * stops within MAX_PKT_RECV packets; a thread mode call that keeps going
+ * also drains what arrives meanwhile and is left out.
+ *
+ * The egr_used sample is the span of eager entries the call consumed.  A
+ * call that processed at least as many packets as there are eager entries
+ * may have lapped the ring and counts as having used all of it.
+ *
+ * No CSR is read.
+ */
+static inline void rcv_occupancy_sample(struct hfi1_packet *packet)
+{
+	struct hfi1_ctxtdata *rcd = packet->rcd;
+	struct hfi1_rcv_occupancy *occ = &rcd->occ;
+	u32 numpkt = packet->numpkt;
+	u32 used, idx;
+
+	if (!numpkt)
+		return;
+
+	used = packet->hdrq_queued;
+	if (used == U32_MAX && numpkt <= MAX_PKT_RECV)
+		used = numpkt;
+	if (used != U32_MAX) {
+		idx = min_t(u32, used * HFI1_RCV_OCC_BUCKETS /
+				 get_hdrq_cnt(rcd),
+			    HFI1_RCV_OCC_BUCKETS - 1);
+		occ->hdrq[idx]++;
+	}
+
+	if (packet->etail != -1 && rcd->egrbufs.alloced) {
+		u32 etail = packet->etail;
+		u32 egr_cnt = rcd->egrbufs.alloced;
+
+		if (numpkt >= egr_cnt)
+			used = egr_cnt;
+		else if (etail >= occ->last_etail)
+			used = etail - occ->last_etail;
+		else
+			used = egr_cnt - occ->last_etail + etail;
+		idx = min_t(u32, used * HFI1_RCV_OCC_BUCKETS / egr_cnt,
+			    HFI1_RCV_OCC_BUCKETS - 1);
+		occ->egr_used[idx]++;
+		occ->last_etail = etail;
+	}
+
+	occ->burst[min_t(u32, ilog2(numpkt), HFI1_RCV_OCC_BUCKETS - 1)]++;
+	if (numpkt > occ->max_burst)
+		occ->max_burst = numpkt;
+	occ->samples++;
+}
+
 static inline void finish_packet(struct hfi1_packet *packet)
 {
 	/*
@@ -864,6 +1026,8 @@ static inline void finish_packet(struct hfi1_packet *packet)
 	 * The only thing we need to do is a final update and call for an
 	 * interrupt
 	 */
+	hfi1_rcv_batch_flush(packet);
+	rcv_occupancy_sample(packet);
 	update_usrhead(packet->rcd, hfi1_rcd_head(packet->rcd), packet->updegr,
 		       packet->etail, rcv_intr_dynamic, packet->numpkt);
 }
@@ -1742,16 +1906,23 @@ static void hfi1_ipoib_ib_rcv(struct hfi1_packet *packet)
 
 	tlen -= extra_bytes;
 
-	skb = hfi1_ipoib_prepare_skb(rxq, tlen, packet->ebuf);
+	skb = hfi1_ipoib_prepare_skb(rxq, packet, tlen);
 	if (unlikely(!skb))
 		goto drop;
 
 	priv = hfi1_ipoib_priv(netdev);
 	hfi1_ipoib_update_rx_netstats(priv, 1, skb->len);
 
+	/*
+	 * The payload is covered by the ICRC the hardware already checked.
+	 * Let the stack skip software checksums if the admin asked for it.
+	 */
+	if (netdev->features & NETIF_F_RXCSUM)
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+
 	skb->dev = netdev;
 	skb->pkt_type = PACKET_HOST;
-	netif_receive_skb(skb);
+	napi_gro_receive(napi, skb);
 
 	return;
 
@@ -337,6 +337,10 @@ static long hfi1_file_ioctl(struct file *fp, unsigned int cmd,
 		ret = ctxt_reset(uctxt);
 		break;
 
+	case HFI1_IOCTL_SDMA_PREPIN:
+		ret = hfi1_user_sdma_prepin(fd, arg, _IOC_SIZE(cmd));
+		break;
+
 	case HFI1_IOCTL_GET_VERS:
 		uval = HFI1_USER_SWVERSION;
 		if (put_user(uval, (int __user *)arg))
@@ -355,9 +359,8 @@ static ssize_t hfi1_write_iter(struct kiocb *kiocb, struct iov_iter *from)
 	struct hfi1_filedata *fd = kiocb->ki_filp->private_data;
 	struct hfi1_user_sdma_pkt_q *pq;
 	struct hfi1_user_sdma_comp_q *cq = fd->cq;
-	int done = 0, reqs = 0;
 	unsigned long dim = from->nr_segs;
-	int idx;
+	int idx, reqs;
 
 	idx = srcu_read_lock(&fd->pq_srcu);
 	pq = srcu_dereference(fd->pq, &fd->pq_srcu);
@@ -378,21 +381,8 @@ static ssize_t hfi1_write_iter(struct kiocb *kiocb, struct iov_iter *from)
 		return -ENOSPC;
 	}
 
-	while (dim) {
-		int ret;
-		unsigned long count = 0;
-
-		ret = hfi1_user_sdma_process_request(
-			fd, (struct iovec *)(from->iov + done),
-			dim, &count);
-		if (ret) {
-			reqs = ret;
-			break;
-		}
-		dim -= count;
-		done += count;
-		reqs++;
-	}
+	reqs = hfi1_user_sdma_process_requests(fd, (struct iovec *)from->iov,
+					       dim);
 
 	srcu_read_unlock(&fd->pq_srcu, idx);
 	return reqs;
@@ -1708,7 +1698,7 @@ static void set_secure_jkey(struct hfi1_ctxtdata *uctxt, u16 pkey_idx)
 {
 	/*
 	 * Whatever we do to encode the JKey here for HW checks needs to be done
-	 * in software for SDMA. See hfi1_user_sdma_process_request and ensure
+	 * in software for SDMA. See hfi1_user_sdma_process_requests and ensure
 	 * it matches what we do here.
 	 */
 	uctxt->jkey &= JKEY_SEC_MASK; /* mask off the upper 16 bits */
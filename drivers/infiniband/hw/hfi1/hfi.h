@@ -71,6 +71,7 @@
 #include <linux/rhashtable.h>
 #include <linux/netdevice.h>
 #include <rdma/rdma_vt.h>
+#include <rdma/hfi/hfi1_rcv_occ.h>
 
 #include "chip_registers.h"
 #include "common.h"
@@ -175,11 +176,62 @@ extern int num_driver_cntrs;
 
 struct hfi1_opcode_stats_perctx;
 
+/* receive interrupt moderation engines */
+#define HFI1_RCV_INTR_MOD_STATIC 0	/* fixed timeout of max_ns */
+#define HFI1_RCV_INTR_MOD_STEP   1	/* double/halve the timeout */
+#define HFI1_RCV_INTR_MOD_RATE   2	/* track the packet rate */
+
+/*
+ * Per context receive interrupt moderation knobs and live state. The
+ * knobs may be changed at any time through debugfs. The engine is only
+ * run when rcv_intr_dynamic is set.
+ */
+struct hfi1_rcv_intr_mod {
+	/* time of the previous interrupt */
+	ktime_t last_intr;
+	/* EWMA of packets per second */
+	u64 pkt_rate;
+	/* EWMA of interrupts per second */
+	u64 intr_rate;
+	/* latency target: longest receive timeout in ns */
+	u32 max_ns;
+	/* throughput target: packets per interrupt for the rate engine */
+	u16 target_pkts;
+	/* HFI1_RCV_INTR_MOD_* */
+	u8 mode;
+	/* RcvHdrHead.Counter, packets before an immediate interrupt */
+	u8 count;
+};
+
+/* NAPI instance of a kernel receive context */
+struct hfi1_krcv_napi {
+	struct napi_struct napi;
+	struct hfi1_ctxtdata *rcd;
+};
+
+/*
+ * Per context receive queue occupancy, sampled once per receive call.
+ * The hdrq histogram counts calls by the entries queued when the call
+ * started and the egr_used histogram by the eager entries the call
+ * consumed, both in 1/16ths of the queue.  The burst histogram counts
+ * packets per call in log2 buckets.  See <rdma/hfi/hfi1_rcv_occ.h>.
+ */
+struct hfi1_rcv_occupancy {
+	u64 hdrq[HFI1_RCV_OCC_BUCKETS];
+	u64 egr_used[HFI1_RCV_OCC_BUCKETS];
+	u64 burst[HFI1_RCV_OCC_BUCKETS];
+	u64 samples;
+	u32 max_burst;
+	/* eager index at the end of the previous call */
+	u32 last_etail;
+};
+
 struct ctxt_eager_bufs {
 	struct eager_buffer {
 		void *addr;
 		dma_addr_t dma;
 		ssize_t len;
+		struct page *page;	/* set if page backed (zero-copy) */
 	} *buffers;
 	struct {
 		void *addr;
@@ -191,6 +243,45 @@ struct ctxt_eager_bufs {
 	u16 numbufs;             /* number of buffers allocated */
 	u16 alloced;             /* number of rcvarray entries used */
 	u16 threshold;           /* head update threshold */
+	/* zero-copy receive state, NULL when packets are copied out */
+	struct hfi1_egr_zcopy *zc;
+};
+
+/*
+ * Zero-copy eager buffer state.
+ *
+ * In zero-copy mode every eager RcvArray entry is backed by its own
+ * streaming-mapped compound page and buffers[i] maps 1:1 to rcvtids[i].
+ * Before a packet's payload is attached to an skb, a spare page is
+ * reserved for the entry.  When the hardware moves on to the next entry
+ * the page is either recycled in place (the stack has already released
+ * it) or replaced by the reserved spare.  The entry is never returned to
+ * the hardware while the stack can still see its page.
+ *
+ * Replaced pages stay mapped on the held ring.  Once the stack has freed
+ * them they go back to the spares without being reallocated or remapped.
+ * When the spares run low, refill_work allocates new pages on the
+ * context's NUMA node.
+ */
+struct hfi1_egr_zcopy {
+	/* protects spares and held */
+	spinlock_t lock;
+	/* pool of mapped pages ready to replace lent eager buffers */
+	struct eager_buffer *spares;
+	/* per eager entry spare reserved while the entry is lent */
+	struct eager_buffer *reserved;
+	/* FIFO of replaced pages the stack still holds */
+	struct eager_buffer *held;
+	struct hfi1_ctxtdata *rcd;
+	struct work_struct refill_work;
+	u16 nspares;		/* pages available in spares */
+	u16 maxspares;		/* size of the spares array */
+	u16 lowspares;		/* refill from the workqueue below this */
+	u16 held_head;		/* oldest held page */
+	u16 nheld;		/* pages on the held ring */
+	u16 maxheld;		/* size of the held ring */
+	u16 last_idx;		/* eager index of the last packet seen */
+	u16 order;		/* RcvArray encoded buffer size */
 };
 
 struct exp_tid_set {
@@ -253,6 +344,10 @@ struct hfi1_ctxtdata {
 	u8 rhf_offset;
 	/* dynamic receive available interrupt timeout */
 	u8 rcvavail_timeout;
+	/* receive interrupt moderation state */
+	struct hfi1_rcv_intr_mod intr_mod;
+	/* receive queue occupancy histograms */
+	struct hfi1_rcv_occupancy occ;
 	/* Indicates that this is vnic context */
 	bool is_vnic;
 	/* vnic queue index this context is mapped to */
@@ -273,6 +368,16 @@ struct hfi1_ctxtdata {
 
 	/* Timer for re-enabling ASPM if interrupt activity quiets down */
 	struct timer_list aspm_timer;
+	/*
+	 * kernel busy poll: IRQ path takes part, pollers opted in (debugfs),
+	 * HFI1_RCD_BP_* state, last busy poll
+	 */
+	bool busy_poll;
+	bool busy_poll_enabled;
+	unsigned long busy_poll_flags;
+	u64 busy_poll_last;
+	/* Timer for re-enabling the interrupt if a busy poller goes away */
+	struct hrtimer busy_poll_timer;
 	/* per-context configuration flags */
 	unsigned long flags;
 	/* array of tid_groups */
@@ -374,9 +479,15 @@ struct hfi1_packet {
 	struct ib_other_headers *ohdr;
 	struct ib_grh *grh;
 	struct opa_16b_mgmt *mgmt;
+	/* QP whose r_lock is held across packets, see hfi1_rcv_batch_flush */
+	struct rvt_qp *rqp;
+	unsigned long rflags;
 	u64 rhf;
 	u32 maxcnt;
 	u32 rhqoff;
+	u32 pf_hdr;	/* rcvhdrq header prefetch distance, in words */
+	u32 pf_egr;	/* rcvhdrq eager buffer prefetch distance, in words */
+	u32 hdrq_queued; /* rcvhdrq entries queued at entry, U32_MAX if unknown */
 	u32 dlid;
 	u32 slid;
 	int numpkt;
@@ -392,9 +503,29 @@ struct hfi1_packet {
 	u8 sc;
 	u8 sl;
 	u8 opcode;
+	u8 rbatch;	/* packets left in the current r_lock batch */
+	u8 rbatch_max;	/* packets per r_lock batch, 0 disables batching */
 	bool migrated;
 };
 
+/**
+ * hfi1_rcv_batch_flush - end a receive r_lock batch
+ * @packet: the receive loop packet
+ *
+ * Consecutive packets to the same QP may be delivered under a single
+ * r_lock and RCU read lock acquisition (see hfi1_handle_packet()).  This
+ * drops them.  It must be called before the receive loop does anything
+ * that may take an r_lock, sleep or send.
+ */
+static inline void hfi1_rcv_batch_flush(struct hfi1_packet *packet)
+{
+	if (!packet->rqp)
+		return;
+	spin_unlock_irqrestore(&packet->rqp->r_lock, packet->rflags);
+	rcu_read_unlock();
+	packet->rqp = NULL;
+}
+
 /* Packet types */
 #define HFI1_PKT_TYPE_9B  0
 #define HFI1_PKT_TYPE_16B 1
@@ -833,6 +964,8 @@ struct hfi1_pportdata {
 
 	struct workqueue_struct *hfi1_wq;
 	struct workqueue_struct *link_wq;
+	/* user SDMA buffer pre-pinning, kept off hfi1_wq */
+	struct workqueue_struct *prepin_wq;
 
 	/* move out of interrupt context */
 	struct work_struct link_vc_work;
@@ -1081,6 +1214,16 @@ struct sdma_vl_map;
 #define SERIAL_MAX 16 /* length of the serial number */
 
 typedef int (*send_routine)(struct rvt_qp *, struct hfi1_pkt_state *, u64);
+/* PIO vs SDMA crossover of one VL, see get_send_routine() */
+struct hfi1_pio_xover {
+	u16 thresh;		/* largest RC/UC packet sent by PIO */
+	atomic_t stalls;	/* PIO credit stalls since last adjust */
+	atomic_t samples;	/* SDMA latency samples since last adjust */
+	u32 sdma_lat_ns;	/* EWMA of verbs SDMA completion latency */
+	u32 sdma_lat_floor;	/* lowest recent latency, decays upward */
+	unsigned long next;	/* jiffies of the next adjustment */
+};
+
 struct hfi1_devdata {
 	struct hfi1_ibdev verbs_dev;     /* must be first */
 	struct list_head list;
@@ -1119,6 +1262,8 @@ struct hfi1_devdata {
 	spinlock_t                          sde_map_lock;
 	/* array of kernel send contexts */
 	struct send_context **kernel_send_context;
+	/* per CPU kernel send context overrides */
+	struct pio_cpu_map __percpu *pio_cpu_map;
 	/* array of vl maps */
 	struct pio_vl_map __rcu *pio_map;
 	/* default flags to last descriptor */
@@ -1138,6 +1283,8 @@ struct hfi1_devdata {
 	struct sdma_engine                 *per_sdma;
 	/* array of vl maps */
 	struct sdma_vl_map __rcu           *sdma_map;
+	/* per VL PIO vs SDMA crossover */
+	struct hfi1_pio_xover pio_xover[HFI1_MAX_VLS_SUPPORTED];
 	/* SPC freeze waitqueue and variable */
 	wait_queue_head_t		  sdma_unfreeze_wq;
 	atomic_t			  sdma_unfreeze_count;
@@ -1171,8 +1318,13 @@ struct hfi1_devdata {
 	u64 z_int_counter;
 	u64 z_rcv_limit;
 	u64 z_send_schedule;
+	u64 z_rx_zcopy;
+	u64 z_rx_copy;
 
 	u64 __percpu *send_schedule;
+	/* netdev packets received zero-copy vs. copied out of eager buffers */
+	u64 __percpu *rx_zcopy;
+	u64 __percpu *rx_copy;
 	/* number of reserved contexts for netdev usage */
 	u16 num_netdev_contexts;
 	/* number of receive contexts in use by the driver */
@@ -1191,7 +1343,14 @@ struct hfi1_devdata {
 	spinlock_t sendctrl_lock; /* protect changes to SendCtrl */
 	spinlock_t rcvctrl_lock; /* protect changes to RcvCtrl */
 	spinlock_t uctxt_lock; /* protect rcd changes */
+	spinlock_t user_sdma_pq_lock; /* protect user_sdma_pqs */
+	/* open user SDMA packet queues, for debugfs */
+	struct list_head user_sdma_pqs;
 	struct mutex dc8051_lock; /* exclusive access to 8051 */
+	/* serialize RSM and QP map table updates, protects krcv_map_qps */
+	struct mutex rmt_mutex;
+	/* QPs whose receive context was picked from the QPN map */
+	u32 krcv_map_qps;
 	struct workqueue_struct *update_cntr_wq;
 	struct work_struct update_cntr_work;
 	/* exclusive access to 8051 memory */
@@ -1271,6 +1430,9 @@ struct hfi1_devdata {
 	/* Misc small ints */
 	u8 n_krcv_queues;
 	u8 qos_shift;
+	/* first RSM map entry used by QOS and the number of them */
+	u8 krcv_rmt_start;
+	u16 krcv_rmt_entries;	/* 0 if the QP map table is used */
 
 	u16 irev;	/* implementation revision */
 	u32 dc8051_ver; /* 8051 firmware version */
@@ -1429,6 +1591,9 @@ struct hfi1_devdata {
 	spinlock_t irq_src_lock;
 	int vnic_num_vports;
 	struct net_device *dummy_netdev;
+	/* NAPI polling of the kernel receive contexts, see krcv_napi */
+	struct net_device *krcv_napi_dev;
+	struct hfi1_krcv_napi *krcv_napi;
 
 	/* Keeps track of IPoIB RSM rule users */
 	atomic_t ipoib_rsm_usr_num;
@@ -1502,6 +1667,11 @@ void handle_user_interrupt(struct hfi1_ctxtdata *rcd);
 
 int hfi1_create_rcvhdrq(struct hfi1_devdata *dd, struct hfi1_ctxtdata *rcd);
 int hfi1_setup_eagerbufs(struct hfi1_ctxtdata *rcd);
+int hfi1_alloc_eager_buffer(struct hfi1_ctxtdata *rcd,
+			    struct eager_buffer *buf, u32 size, gfp_t gfp);
+void hfi1_free_eager_buffer(struct hfi1_devdata *dd, struct eager_buffer *buf);
+int hfi1_alloc_egr_zcopy(struct hfi1_ctxtdata *rcd, work_func_t refill);
+void hfi1_free_egr_zcopy(struct hfi1_ctxtdata *rcd);
 int hfi1_create_kctxts(struct hfi1_devdata *dd);
 int hfi1_create_ctxtdata(struct hfi1_pportdata *ppd, int numa,
 			 struct hfi1_ctxtdata **rcd);
@@ -1530,6 +1700,11 @@ void hfi1_make_ud_req_16B(struct rvt_qp *qp,
 			  struct hfi1_pkt_state *ps,
 			  struct rvt_swqe *wqe);
 
+/* hfi1_ctxtdata.busy_poll_flags bits */
+#define HFI1_RCD_BP_OWNED   0 /* a poller or the IRQ handler is processing */
+#define HFI1_RCD_BP_HELD    1 /* receive interrupt held off for pollers */
+#define HFI1_RCD_BP_PENDING 2 /* interrupt arrived while owned or held */
+
 /* receive packet handler dispositions */
 #define RCV_PKT_OK      0x0 /* keep going */
 #define RCV_PKT_LIMIT   0x1 /* stop, hit limit, start thread */
@@ -2194,6 +2369,9 @@ void shutdown_led_override(struct hfi1_pportdata *ppd);
  */
 #define DEFAULT_RCVHDR_ENTSIZE 32
 
+bool hfi1_can_pin_pages_limit(struct hfi1_devdata *dd, struct mm_struct *mm,
+			      u32 nlocked, u32 npages, unsigned long ulimit,
+			      bool can_lock);
 bool hfi1_can_pin_pages(struct hfi1_devdata *dd, struct mm_struct *mm,
 			u32 nlocked, u32 npages);
 int hfi1_acquire_user_pages(struct mm_struct *mm, unsigned long vaddr,
@@ -2304,6 +2482,9 @@ extern uint quick_linkup;
 extern uint rcv_intr_timeout;
 extern uint rcv_intr_count;
 extern uint rcv_intr_dynamic;
+extern uint rcv_intr_mod;
+extern uint krcv_busy_poll;
+extern uint krcv_napi;
 extern uint ipoib_accel;
 extern ushort link_crc_mask;
 
@@ -2484,6 +2665,8 @@ static inline void hfi1_reset_cpu_counters(struct hfi1_devdata *dd)
 	dd->z_int_counter = get_all_cpu_total(dd->int_counter);
 	dd->z_rcv_limit = get_all_cpu_total(dd->rcv_limit);
 	dd->z_send_schedule = get_all_cpu_total(dd->send_schedule);
+	dd->z_rx_zcopy = get_all_cpu_total(dd->rx_zcopy);
+	dd->z_rx_copy = get_all_cpu_total(dd->rx_copy);
 
 	ppd = (struct hfi1_pportdata *)(dd + 1);
 	for (i = 0; i < dd->num_pports; i++, ppd++) {
@@ -409,6 +409,7 @@ int hfi1_create_ctxtdata(struct hfi1_pportdata *ppd, int numa,
 		spin_lock_init(&rcd->exp_lock);
 		INIT_LIST_HEAD(&rcd->flow_queue.queue_head);
 		INIT_LIST_HEAD(&rcd->rarr_queue.queue_head);
+		hfi1_init_rcd_busy_poll(rcd);
 
 		hfi1_cdbg(PROC, "setting up context %u\n", rcd->ctxt);
 
@@ -443,6 +444,7 @@ int hfi1_create_ctxtdata(struct hfi1_pportdata *ppd, int numa,
 		rcd->eager_base = base * dd->rcv_entries.group_size;
 
 		rcd->rcvhdrq_cnt = rcvhdrcnt;
+		hfi1_init_rcv_intr_mod(rcd);
 		rcd->rcvhdrqentsize = hfi1_hdrq_entsize;
 		rcd->rhf_offset =
 			rcd->rcvhdrqentsize - sizeof(u64) / sizeof(u32);
@@ -842,6 +844,20 @@ static int create_workqueues(struct hfi1_devdata *dd)
 			if (!ppd->link_wq)
 				goto wq_error;
 		}
+		if (!ppd->prepin_wq) {
+			/*
+			 * Pinning user buffers can take long, keep it away
+			 * from the port workqueue.
+			 */
+			ppd->prepin_wq =
+				alloc_workqueue(
+				    "hfi_prepin_%d_%d",
+				    WQ_SYSFS | WQ_UNBOUND,
+				    0, /* max_active */
+				    dd->unit, pidx);
+			if (!ppd->prepin_wq)
+				goto wq_error;
+		}
 	}
 	return 0;
 wq_error:
@@ -856,6 +872,10 @@ wq_error:
 			destroy_workqueue(ppd->link_wq);
 			ppd->link_wq = NULL;
 		}
+		if (ppd->prepin_wq) {
+			destroy_workqueue(ppd->prepin_wq);
+			ppd->prepin_wq = NULL;
+		}
 	}
 	return -ENOMEM;
 }
@@ -880,6 +900,10 @@ static void destroy_workqueues(struct hfi1_devdata *dd)
 			destroy_workqueue(ppd->link_wq);
 			ppd->link_wq = NULL;
 		}
+		if (ppd->prepin_wq) {
+			destroy_workqueue(ppd->prepin_wq);
+			ppd->prepin_wq = NULL;
+		}
 	}
 }
 
@@ -1126,6 +1150,7 @@ static void shutdown_device(struct hfi1_devdata *dd)
 	/* mask and clean up interrupts */
 	set_intr_bits(dd, IS_FIRST_SOURCE, IS_LAST_SOURCE, false);
 	msix_clean_up_interrupts(dd);
+	hfi1_krcv_napi_free(dd);
 
 	for (pidx = 0; pidx < dd->num_pports; ++pidx) {
 		ppd = dd->pport + pidx;
@@ -1191,6 +1216,8 @@ void hfi1_free_ctxtdata(struct hfi1_devdata *dd, struct hfi1_ctxtdata *rcd)
 	if (!rcd)
 		return;
 
+	hrtimer_cancel(&rcd->busy_poll_timer);
+
 	if (rcd->rcvhdrq) {
 		dma_free_coherent(&dd->pcidev->dev, rcvhdrq_size(rcd),
 				  rcd->rcvhdrq, rcd->rcvhdrq_dma);
@@ -1207,14 +1234,10 @@ void hfi1_free_ctxtdata(struct hfi1_devdata *dd, struct hfi1_ctxtdata *rcd)
 	kfree(rcd->egrbufs.rcvtids);
 	rcd->egrbufs.rcvtids = NULL;
 
-	for (e = 0; e < rcd->egrbufs.alloced; e++) {
-		if (rcd->egrbufs.buffers[e].dma)
-			dma_free_coherent(&dd->pcidev->dev,
-					  rcd->egrbufs.buffers[e].len,
-					  rcd->egrbufs.buffers[e].addr,
-					  rcd->egrbufs.buffers[e].dma);
-	}
+	for (e = 0; e < rcd->egrbufs.alloced; e++)
+		hfi1_free_eager_buffer(dd, &rcd->egrbufs.buffers[e]);
 	kfree(rcd->egrbufs.buffers);
+	hfi1_free_egr_zcopy(rcd);
 	rcd->egrbufs.alloced = 0;
 	rcd->egrbufs.buffers = NULL;
 
@@ -1285,10 +1308,14 @@ static void hfi1_clean_devdata(struct hfi1_devdata *dd)
 	free_percpu(dd->int_counter);
 	free_percpu(dd->rcv_limit);
 	free_percpu(dd->send_schedule);
+	free_percpu(dd->rx_zcopy);
+	free_percpu(dd->rx_copy);
 	free_percpu(dd->tx_opstats);
 	dd->int_counter   = NULL;
 	dd->rcv_limit     = NULL;
 	dd->send_schedule = NULL;
+	dd->rx_zcopy      = NULL;
+	dd->rx_copy       = NULL;
 	dd->tx_opstats    = NULL;
 	kfree(dd->comp_vect);
 	dd->comp_vect = NULL;
@@ -1373,6 +1400,8 @@ static struct hfi1_devdata *hfi1_alloc_devdata(struct pci_dev *pdev,
 	spin_lock_init(&dd->sendctrl_lock);
 	spin_lock_init(&dd->rcvctrl_lock);
 	spin_lock_init(&dd->uctxt_lock);
+	spin_lock_init(&dd->user_sdma_pq_lock);
+	INIT_LIST_HEAD(&dd->user_sdma_pqs);
 	spin_lock_init(&dd->hfi1_diag_trans_lock);
 	spin_lock_init(&dd->sc_init_lock);
 	spin_lock_init(&dd->dc8051_memlock);
@@ -1380,6 +1409,7 @@ static struct hfi1_devdata *hfi1_alloc_devdata(struct pci_dev *pdev,
 	spin_lock_init(&dd->sde_map_lock);
 	spin_lock_init(&dd->pio_map_lock);
 	mutex_init(&dd->dc8051_lock);
+	mutex_init(&dd->rmt_mutex);
 	init_waitqueue_head(&dd->event_queue);
 	spin_lock_init(&dd->irq_src_lock);
 
@@ -1401,6 +1431,18 @@ static struct hfi1_devdata *hfi1_alloc_devdata(struct pci_dev *pdev,
 		goto bail;
 	}
 
+	dd->rx_zcopy = alloc_percpu(u64);
+	if (!dd->rx_zcopy) {
+		ret = -ENOMEM;
+		goto bail;
+	}
+
+	dd->rx_copy = alloc_percpu(u64);
+	if (!dd->rx_copy) {
+		ret = -ENOMEM;
+		goto bail;
+	}
+
 	dd->tx_opstats = alloc_percpu(struct hfi1_opcode_stats_perctx);
 	if (!dd->tx_opstats) {
 		ret = -ENOMEM;
@@ -1544,6 +1586,7 @@ static int __init hfi1_mod_init(void)
 		user_credit_return_threshold = 100;
 
 	compute_krcvqs();
+	pio_copy_init();
 	/*
 	 * sanitize receive interrupt count, time must wait until after
 	 * the hardware type is known
@@ -1571,6 +1614,11 @@ static int __init hfi1_mod_init(void)
 		pr_err("Invalid mode: dynamic receive interrupt mitigation with invalid count and timeout - turning dynamic off\n");
 		rcv_intr_dynamic = 0;
 	}
+	if (rcv_intr_mod > HFI1_RCV_INTR_MOD_RATE) {
+		pr_err("Invalid receive interrupt moderation engine %u - using double/halve\n",
+		       rcv_intr_mod);
+		rcv_intr_mod = HFI1_RCV_INTR_MOD_STEP;
+	}
 
 	/* sanitize link CRC options */
 	link_crc_mask &= SUPPORTED_CRCS;
@@ -1847,6 +1895,10 @@ static int do_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 				destroy_workqueue(ppd->link_wq);
 				ppd->link_wq = NULL;
 			}
+			if (ppd->prepin_wq) {
+				destroy_workqueue(ppd->prepin_wq);
+				ppd->prepin_wq = NULL;
+			}
 		}
 		if (!j)
 			hfi1_device_remove(dd);
@@ -2104,6 +2156,137 @@ bail:
 	return -ENOMEM;
 }
 
+/**
+ * hfi1_alloc_eager_buffer - allocate a single eager buffer
+ * @rcd: the context the buffer belongs to
+ * @buf: the buffer to fill in
+ * @size: buffer size in bytes
+ * @gfp: allocation flags
+ *
+ * Zero-copy contexts get a streaming-mapped compound page that can be
+ * attached to an skb. All other contexts get coherent memory.
+ */
+int hfi1_alloc_eager_buffer(struct hfi1_ctxtdata *rcd,
+			    struct eager_buffer *buf, u32 size, gfp_t gfp)
+{
+	struct device *dev = &rcd->dd->pcidev->dev;
+
+	if (!rcd->egrbufs.zc) {
+		buf->addr = dma_alloc_coherent(dev, size, &buf->dma, gfp);
+		if (!buf->addr)
+			return -ENOMEM;
+		buf->len = size;
+		return 0;
+	}
+
+	buf->page = alloc_pages_node(rcd->numa_id, gfp | __GFP_COMP |
+				     __GFP_NOWARN, get_order(size));
+	if (!buf->page)
+		return -ENOMEM;
+
+	buf->dma = dma_map_page(dev, buf->page, 0, size, DMA_FROM_DEVICE);
+	if (dma_mapping_error(dev, buf->dma)) {
+		put_page(buf->page);
+		buf->page = NULL;
+		buf->dma = 0;
+		return -ENOMEM;
+	}
+	buf->addr = page_address(buf->page);
+	buf->len = size;
+
+	return 0;
+}
+
+/**
+ * hfi1_free_eager_buffer - free a buffer from hfi1_alloc_eager_buffer()
+ * @dd: the device
+ * @buf: the buffer
+ *
+ * A page backed buffer only drops the driver's reference, the page stays
+ * alive for as long as the network stack holds on to it.
+ */
+void hfi1_free_eager_buffer(struct hfi1_devdata *dd, struct eager_buffer *buf)
+{
+	if (buf->page) {
+		dma_unmap_page(&dd->pcidev->dev, buf->dma, buf->len,
+			       DMA_FROM_DEVICE);
+		put_page(buf->page);
+	} else if (buf->dma) {
+		dma_free_coherent(&dd->pcidev->dev, buf->len, buf->addr,
+				  buf->dma);
+	}
+	buf->addr = NULL;
+	buf->dma = 0;
+	buf->len = 0;
+	buf->page = NULL;
+}
+
+/**
+ * hfi1_alloc_egr_zcopy - switch a context's eager buffers to zero-copy
+ * @rcd: the context, eager buffers must not be allocated yet
+ * @refill: work function that tops up the spare pool
+ *
+ * The spare pool is sized to a quarter of the eager entries and the held
+ * ring to all of them; the spares are filled once hfi1_setup_eagerbufs()
+ * has settled the buffer size.
+ */
+int hfi1_alloc_egr_zcopy(struct hfi1_ctxtdata *rcd, work_func_t refill)
+{
+	struct hfi1_egr_zcopy *zc;
+
+	zc = kzalloc_node(sizeof(*zc), GFP_KERNEL, rcd->numa_id);
+	if (!zc)
+		return -ENOMEM;
+
+	zc->maxspares = max_t(u16, rcd->egrbufs.count / 4, 8);
+	zc->lowspares = zc->maxspares / 2;
+	zc->maxheld = rcd->egrbufs.count;
+	zc->spares = kcalloc_node(zc->maxspares, sizeof(*zc->spares),
+				  GFP_KERNEL, rcd->numa_id);
+	zc->reserved = kcalloc_node(rcd->egrbufs.count,
+				    sizeof(*zc->reserved),
+				    GFP_KERNEL, rcd->numa_id);
+	zc->held = kcalloc_node(zc->maxheld, sizeof(*zc->held),
+				GFP_KERNEL, rcd->numa_id);
+	if (!zc->spares || !zc->reserved || !zc->held) {
+		kfree(zc->spares);
+		kfree(zc->reserved);
+		kfree(zc->held);
+		kfree(zc);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&zc->lock);
+	INIT_WORK(&zc->refill_work, refill);
+	zc->rcd = rcd;
+	rcd->egrbufs.zc = zc;
+	return 0;
+}
+
+void hfi1_free_egr_zcopy(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	u32 i;
+
+	if (!zc)
+		return;
+
+	cancel_work_sync(&zc->refill_work);
+	for (i = 0; i < zc->nspares; i++)
+		hfi1_free_eager_buffer(rcd->dd, &zc->spares[i]);
+	for (i = 0; i < rcd->egrbufs.count; i++)
+		hfi1_free_eager_buffer(rcd->dd, &zc->reserved[i]);
+	for (i = 0; i < zc->nheld; i++)
+		hfi1_free_eager_buffer(rcd->dd,
+				       &zc->held[(zc->held_head + i) %
+						 zc->maxheld]);
+	kfree(zc->spares);
+	kfree(zc->reserved);
+	kfree(zc->held);
+	kfree(zc);
+	rcd->egrbufs.zc = NULL;
+}
+
 /**
  * allocate eager buffers, both kernel and user contexts.
  * @rcd: the context we are setting up.
@@ -2154,16 +2337,18 @@ int hfi1_setup_eagerbufs(struct hfi1_ctxtdata *rcd)
 		rcd->egrbufs.rcvtid_size = max((unsigned long)round_mtu,
 			rounddown_pow_of_two(rcd->egrbufs.size / 8));
 
+	/*
+	 * Zero-copy buffers are lent to the stack one entry at a time, keep
+	 * them MTU sized to bound how much memory a lent entry pins.
+	 */
+	if (rcd->egrbufs.zc)
+		rcd->egrbufs.rcvtid_size = round_mtu;
+
 	while (alloced_bytes < rcd->egrbufs.size &&
 	       rcd->egrbufs.alloced < rcd->egrbufs.count) {
-		rcd->egrbufs.buffers[idx].addr =
-			dma_alloc_coherent(&dd->pcidev->dev,
-					   rcd->egrbufs.rcvtid_size,
-					   &rcd->egrbufs.buffers[idx].dma,
-					   gfp_flags);
-		if (rcd->egrbufs.buffers[idx].addr) {
-			rcd->egrbufs.buffers[idx].len =
-				rcd->egrbufs.rcvtid_size;
+		if (!hfi1_alloc_eager_buffer(rcd, &rcd->egrbufs.buffers[idx],
+					     rcd->egrbufs.rcvtid_size,
+					     gfp_flags)) {
 			rcd->egrbufs.rcvtids[rcd->egrbufs.alloced].addr =
 				rcd->egrbufs.buffers[idx].addr;
 			rcd->egrbufs.rcvtids[rcd->egrbufs.alloced].dma =
@@ -2180,9 +2365,12 @@ int hfi1_setup_eagerbufs(struct hfi1_ctxtdata *rcd)
 			 *   - we are already using the lowest acceptable size
 			 *   - we are using one-pkt-per-egr-buffer (this implies
 			 *     that we are accepting only one size)
+			 *   - the buffers are zero-copy pages, which must map
+			 *     1:1 to RcvArray entries
 			 */
 			if (rcd->egrbufs.rcvtid_size == round_mtu ||
-			    !HFI1_CAP_KGET_MASK(rcd->flags, MULTI_PKT_EGR)) {
+			    !HFI1_CAP_KGET_MASK(rcd->flags, MULTI_PKT_EGR) ||
+			    rcd->egrbufs.zc) {
 				dd_dev_err(dd, "ctxt%u: Failed to allocate eager buffers\n",
 					   rcd->ctxt);
 				ret = -ENOMEM;
@@ -2265,6 +2453,8 @@ int hfi1_setup_eagerbufs(struct hfi1_ctxtdata *rcd)
 		ret = -EINVAL;
 		goto bail_rcvegrbuf_phys;
 	}
+	if (rcd->egrbufs.zc)
+		rcd->egrbufs.zc->order = order;
 
 	for (idx = 0; idx < rcd->egrbufs.alloced; idx++) {
 		hfi1_put_tid(dd, rcd->eager_base + idx, PT_EAGER,
@@ -2277,15 +2467,8 @@ int hfi1_setup_eagerbufs(struct hfi1_ctxtdata *rcd)
 bail_rcvegrbuf_phys:
 	for (idx = 0; idx < rcd->egrbufs.alloced &&
 	     rcd->egrbufs.buffers[idx].addr;
-	     idx++) {
-		dma_free_coherent(&dd->pcidev->dev,
-				  rcd->egrbufs.buffers[idx].len,
-				  rcd->egrbufs.buffers[idx].addr,
-				  rcd->egrbufs.buffers[idx].dma);
-		rcd->egrbufs.buffers[idx].addr = NULL;
-		rcd->egrbufs.buffers[idx].dma = 0;
-		rcd->egrbufs.buffers[idx].len = 0;
-	}
+	     idx++)
+		hfi1_free_eager_buffer(dd, &rcd->egrbufs.buffers[idx]);
 
 	return ret;
 }
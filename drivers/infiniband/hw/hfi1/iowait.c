@@ -105,6 +105,7 @@ void iowait_init(struct iowait *wait, u32 tx_limit,
 	wait->sdma_drained = sdma_drained;
 	wait->init_priority = init_priority;
 	wait->flags = 0;
+	wait->sleep_ns = 0;
 	for (i = 0; i < IOWAIT_SES; i++) {
 		wait->wait[i].iow = wait;
 		INIT_LIST_HEAD(&wait->wait[i].tx_head);
@@ -159,6 +159,7 @@ struct iowait {
 	u8 starved_cnt;
 	u8 priority;
 	unsigned long flags;
+	u64 sleep_ns;	/* queued for descriptors, for sdma_hist */
 	struct iowait_work wait[IOWAIT_SES];
 };
 
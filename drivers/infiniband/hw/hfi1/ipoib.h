@@ -75,6 +75,19 @@
 
 struct hfi1_ipoib_dev_priv;
 
+/*
+ * Receive pseudo header, placed ahead of the encapsulation header.
+ * The stack treats both as the link layer header and GRO only merges
+ * packets whose link layer headers match, so the pseudo header carries
+ * the flow's source to keep flows from different senders apart.
+ */
+struct hfi1_ipoib_rx_pseudo {
+	__be32 sqpn;
+	__be32 slid;
+	__be32 dlid;
+	u8 reserved[8];
+} __packed;
+
 union hfi1_ipoib_flow {
 	u16 as_int;
 	struct {
@@ -215,7 +228,7 @@ struct net_device *hfi1_ipoib_alloc_rn(struct ib_device *device,
 				       void (*setup)(struct net_device *));
 
 struct sk_buff *hfi1_ipoib_prepare_skb(struct hfi1_netdev_rxq *rxq,
-				       int size, void *data);
+				       struct hfi1_packet *packet, int size);
 
 #ifdef HAVE_RDMA_NETDEV_GET_PARAMS
 int hfi1_ipoib_rn_get_params(struct ib_device *device,
@@ -332,6 +332,8 @@ struct net_device *hfi1_ipoib_alloc_rn(struct ib_device *device,
 	priv->netdev_ops = dev->netdev_ops;
 
 	dev->netdev_ops = &hfi1_ipoib_netdev_ops;
+	/* receive checksum trust is off by default, see hfi1_ipoib_ib_rcv() */
+	dev->hw_features |= NETIF_F_RXCSUM;
 
 	ib_query_pkey(device, port_num, priv->pkey_index, &priv->pkey);
 
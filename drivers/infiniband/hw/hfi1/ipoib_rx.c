@@ -51,17 +51,38 @@
 
 #define HFI1_IPOIB_SKB_PAD NET_SKB_PAD + NET_IP_ALIGN
 
-static void copy_ipoib_buf(struct sk_buff *skb, void *data, int size)
+/*
+ * Packets up to the copybreak are always copied. Larger packets in a
+ * zero-copy context get their headers copied into the skb and the rest of
+ * the payload attached as a fragment of the eager buffer page.
+ */
+#define HFI1_IPOIB_RX_COPYBREAK 256
+#define HFI1_IPOIB_RX_HDR_LEN 128
+
+static void copy_ipoib_buf(struct sk_buff *skb, struct hfi1_packet *packet,
+			   int size)
 {
+	struct ib_header *hdr = packet->hdr;
+	struct hfi1_ipoib_rx_pseudo *pseudo;
+	void *data = packet->ebuf;
 	void *dst_data;
 
+	BUILD_BUG_ON(sizeof(*pseudo) != HFI1_IPOIB_PSEUDO_LEN);
+
 	skb_checksum_none_assert(skb);
 	skb->protocol = *((__be16 *)data);
 
 	dst_data = skb_put(skb, size);
 	memcpy(dst_data, data, size);
-	skb->mac_header = HFI1_IPOIB_PSEUDO_LEN;
-	skb_pull(skb, HFI1_IPOIB_ENCAP_LEN);
+
+	pseudo = (struct hfi1_ipoib_rx_pseudo *)skb_push(skb,
+							  HFI1_IPOIB_PSEUDO_LEN);
+	pseudo->sqpn = cpu_to_be32(ib_get_sqpn(packet->ohdr));
+	pseudo->slid = cpu_to_be32(ib_get_slid(hdr));
+	pseudo->dlid = cpu_to_be32(ib_get_dlid(hdr));
+	memset(pseudo->reserved, 0, sizeof(pseudo->reserved));
+	skb_reset_mac_header(skb);
+	skb_pull(skb, HFI1_IPOIB_PSEUDO_LEN + HFI1_IPOIB_ENCAP_LEN);
 }
 
 static struct sk_buff *prepare_frag_skb(struct napi_struct *napi, int size)
@@ -88,13 +109,51 @@ static struct sk_buff *prepare_frag_skb(struct napi_struct *napi, int size)
 	return skb;
 }
 
+static struct sk_buff *prepare_zcopy_skb(struct hfi1_netdev_rxq *rxq,
+					 struct hfi1_packet *packet, int size)
+{
+	int frag_size = size - HFI1_IPOIB_RX_HDR_LEN;
+	struct eager_buffer *buf;
+	struct sk_buff *skb;
+
+	buf = hfi1_netdev_egr_lend(rxq->rcd, packet->etail);
+	if (!buf)
+		return NULL;
+
+	skb = napi_alloc_skb(&rxq->napi, HFI1_IPOIB_RX_HDR_LEN);
+	if (unlikely(!skb))
+		return NULL;
+
+	copy_ipoib_buf(skb, packet, HFI1_IPOIB_RX_HDR_LEN);
+
+	/*
+	 * The skb pins the whole eager page until the stack frees it, so
+	 * charge the socket for all of it rather than for the payload.
+	 */
+	get_page(buf->page);
+	skb_add_rx_frag(skb, 0, buf->page,
+			packet->ebuf + HFI1_IPOIB_RX_HDR_LEN - buf->addr,
+			frag_size, PAGE_SIZE << get_order(buf->len));
+
+	return skb;
+}
+
 struct sk_buff *hfi1_ipoib_prepare_skb(struct hfi1_netdev_rxq *rxq,
-				       int size, void *data)
+				       struct hfi1_packet *packet, int size)
 {
+	struct hfi1_devdata *dd = rxq->rcd->dd;
 	struct napi_struct *napi = &rxq->napi;
 	int skb_size = size + HFI1_IPOIB_ENCAP_LEN;
 	struct sk_buff *skb;
 
+	if (size > HFI1_IPOIB_RX_COPYBREAK) {
+		skb = prepare_zcopy_skb(rxq, packet, size);
+		if (skb) {
+			this_cpu_inc(*dd->rx_zcopy);
+			return skb;
+		}
+	}
+
 	/*
 	 * For smaller(4k + skb overhead) allocations we will go using
 	 * napi cache. Otherwise we will try to use napi frag cache.
@@ -107,7 +166,8 @@ struct sk_buff *hfi1_ipoib_prepare_skb(struct hfi1_netdev_rxq *rxq,
 	if (unlikely(!skb))
 		return NULL;
 
-	copy_ipoib_buf(skb, data, size);
+	copy_ipoib_buf(skb, packet, size);
+	this_cpu_inc(*dd->rx_copy);
 
 	return skb;
 }
@@ -46,27 +46,53 @@
  */
 #include <linux/list.h>
 #include <linux/rculist.h>
+#include <linux/hash.h>
 #include <linux/mmu_notifier.h>
 #include <linux/interval_tree_generic.h>
 
 #include "mmu_rb.h"
 #include "trace.h"
 
-struct mmu_rb_handler {
-	struct mmu_notifier mn;
+/*
+ * Handlers whose ops provide both filter and get are split into
+ * MMU_RB_SHARDS shards by address range, each with its own lock, tree
+ * and LRU list, and use lockless exact-address lookups.  Everything else
+ * keeps a single shard.
+ */
+#define MMU_RB_SHARDS		16
+#define MMU_RB_SHARD_SHIFT	21	/* 2MB of address space per range */
+#define MMU_RB_HASH_BITS	6
+
+struct mmu_rb_shard {
+	spinlock_t lock;        /* protect the RB tree, hash and LRU list */
 #ifdef NO_RB_ROOT_CACHE
 	struct rb_root root;
 #else
 	struct rb_root_cached root;
 #endif
+	struct list_head lru_list;
+	/* MMU_RB_POLICY_2Q: new nodes wait here until hit */
+	struct list_head probation;
+	u32 nr_nodes;
+	unsigned long bytes;
+	/* RCU lookups by exact start address */
+	struct hlist_head hash[1 << MMU_RB_HASH_BITS];
+} ____cacheline_aligned_in_smp;
+
+struct mmu_rb_handler {
+	struct mmu_notifier mn;
 	void *ops_arg;
-	spinlock_t lock;        /* protect the RB tree */
 	struct mmu_rb_ops *ops;
 	struct mm_struct *mm;
-	struct list_head lru_list;
 	struct work_struct del_work;
+	spinlock_t del_lock;    /* protect del_list */
 	struct list_head del_list;
 	struct workqueue_struct *wq;
+	atomic_t evict_next;	/* shard to start the next eviction at */
+	enum mmu_rb_policy policy;
+	struct mmu_rb_stats __percpu *stats;
+	u32 nshards;
+	struct mmu_rb_shard shard[0];
 };
 
 static unsigned long mmu_node_start(struct mmu_rb_node *);
@@ -89,6 +115,7 @@ static void compat_mmu_notifier_range_start(struct mmu_notifier *mn,
 }
 #endif
 static struct mmu_rb_node *__mmu_rb_search(struct mmu_rb_handler *,
+					   struct mmu_rb_shard *,
 					   unsigned long, unsigned long);
 static void do_remove(struct mmu_rb_handler *handler,
 		      struct list_head *del_list);
@@ -115,37 +142,106 @@ static unsigned long mmu_node_last(struct mmu_rb_node *node)
 	return PAGE_ALIGN(node->addr + node->len) - 1;
 }
 
+static inline struct mmu_rb_shard *mmu_rb_shard(struct mmu_rb_handler *handler,
+						unsigned long addr)
+{
+	if (handler->nshards == 1)
+		return &handler->shard[0];
+	return &handler->shard[hash_long(addr >> MMU_RB_SHARD_SHIFT,
+					 ilog2(MMU_RB_SHARDS))];
+}
+
+static inline struct hlist_head *mmu_rb_bucket(struct mmu_rb_shard *shard,
+					       unsigned long addr)
+{
+	return &shard->hash[hash_long(addr, MMU_RB_HASH_BITS)];
+}
+
+/*
+ * The LRU lists are maintained lazily: a hit only sets the referenced
+ * bit, and eviction gives referenced nodes a second pass (CLOCK) rather
+ * than every hit moving the node under the shard lock.
+ */
+static inline void mmu_rb_touch(struct mmu_rb_node *node)
+{
+	if (!READ_ONCE(node->referenced))
+		WRITE_ONCE(node->referenced, 1);
+}
+
+/* Caller must hold shard lock */
+static void __mmu_rb_add(struct mmu_rb_handler *handler,
+			 struct mmu_rb_shard *shard, struct mmu_rb_node *node)
+{
+	__mmu_int_rb_insert(node, &shard->root);
+	hlist_add_head_rcu(&node->hnode, mmu_rb_bucket(shard, node->addr));
+	node->referenced = 0;
+	list_add(&node->list, handler->policy == MMU_RB_POLICY_2Q ?
+		 &shard->probation : &shard->lru_list);
+	shard->nr_nodes++;
+	shard->bytes += node->len;
+}
+
+/* Caller must hold shard lock, node->list is left to the caller */
+static void __mmu_rb_del(struct mmu_rb_shard *shard, struct mmu_rb_node *node)
+{
+	__mmu_int_rb_remove(node, &shard->root);
+	hlist_del_rcu(&node->hnode);
+	shard->nr_nodes--;
+	shard->bytes -= node->len;
+}
+
 int hfi1_mmu_rb_register(void *ops_arg, struct mm_struct *mm,
 			 struct mmu_rb_ops *ops,
 			 struct workqueue_struct *wq,
 			 struct mmu_rb_handler **handler)
 {
 	struct mmu_rb_handler *handlr;
-	int ret;
+	u32 nshards = ops->filter && ops->get ? MMU_RB_SHARDS : 1;
+	int ret, i, j;
 
-	handlr = kmalloc(sizeof(*handlr), GFP_KERNEL);
+	handlr = kmalloc(sizeof(*handlr) + nshards * sizeof(handlr->shard[0]),
+			 GFP_KERNEL);
 	if (!handlr)
 		return -ENOMEM;
+	handlr->stats = alloc_percpu(struct mmu_rb_stats);
+	if (!handlr->stats) {
+		kfree(handlr);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nshards; i++) {
+		struct mmu_rb_shard *shard = &handlr->shard[i];
+
+		spin_lock_init(&shard->lock);
 #ifdef NO_RB_ROOT_CACHE
-	handlr->root = RB_ROOT;
+		shard->root = RB_ROOT;
 #else
-	handlr->root = RB_ROOT_CACHED;
+		shard->root = RB_ROOT_CACHED;
 #endif
+		INIT_LIST_HEAD(&shard->lru_list);
+		INIT_LIST_HEAD(&shard->probation);
+		shard->nr_nodes = 0;
+		shard->bytes = 0;
+		for (j = 0; j < ARRAY_SIZE(shard->hash); j++)
+			INIT_HLIST_HEAD(&shard->hash[j]);
+	}
+	handlr->nshards = nshards;
+	atomic_set(&handlr->evict_next, 0);
+	handlr->policy = MMU_RB_POLICY_LRU;
 	handlr->ops = ops;
 	handlr->ops_arg = ops_arg;
 	INIT_HLIST_NODE(&handlr->mn.hlist);
-	spin_lock_init(&handlr->lock);
 	handlr->mn.ops = &mn_opts;
 	handlr->mm = mm;
 	INIT_WORK(&handlr->del_work, handle_remove);
+	spin_lock_init(&handlr->del_lock);
 	INIT_LIST_HEAD(&handlr->del_list);
-	INIT_LIST_HEAD(&handlr->lru_list);
 	handlr->wq = wq;
 
 	/* Some callers don't need the MMU notifier */
 	if (mm) {
 		ret = mmu_notifier_register(&handlr->mn, handlr->mm);
 		if (ret) {
+			free_percpu(handlr->stats);
 			kfree(handlr);
 			return ret;
 		}
@@ -161,6 +257,7 @@ void hfi1_mmu_rb_unregister(struct mmu_rb_handler *handler)
 	struct rb_node *node;
 	unsigned long flags;
 	struct list_head del_list;
+	int i;
 
 	/* Unregister first so we don't get any more notifications. */
 	if (handler->mm)
@@ -174,57 +271,59 @@ void hfi1_mmu_rb_unregister(struct mmu_rb_handler *handler)
 
 	INIT_LIST_HEAD(&del_list);
 
-	spin_lock_irqsave(&handler->lock, flags);
-#ifdef NO_RB_ROOT_CACHE
-	while ((node = rb_first(&handler->root))) {
-#else
-	while ((node = rb_first_cached(&handler->root))) {
-#endif
-		rbnode = rb_entry(node, struct mmu_rb_node, node);
+	for (i = 0; i < handler->nshards; i++) {
+		struct mmu_rb_shard *shard = &handler->shard[i];
+
+		spin_lock_irqsave(&shard->lock, flags);
 #ifdef NO_RB_ROOT_CACHE
-		rb_erase(node, &handler->root);
+		while ((node = rb_first(&shard->root))) {
 #else
-		rb_erase_cached(node, &handler->root);
+		while ((node = rb_first_cached(&shard->root))) {
 #endif
-		/* move from LRU list to delete list */
-		list_move(&rbnode->list, &del_list);
+			rbnode = rb_entry(node, struct mmu_rb_node, node);
+			__mmu_rb_del(shard, rbnode);
+			/* move from LRU list to delete list */
+			list_move(&rbnode->list, &del_list);
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
 	}
-	spin_unlock_irqrestore(&handler->lock, flags);
 
 	do_remove(handler, &del_list);
 
+	free_percpu(handler->stats);
 	kfree(handler);
 }
 
 int hfi1_mmu_rb_insert(struct mmu_rb_handler *handler,
 		       struct mmu_rb_node *mnode)
 {
+	struct mmu_rb_shard *shard = mmu_rb_shard(handler, mnode->addr);
 	struct mmu_rb_node *node;
 	unsigned long flags;
 	int ret = 0;
 
 	trace_hfi1_mmu_rb_insert(mnode->addr, mnode->len);
-	spin_lock_irqsave(&handler->lock, flags);
-	node = __mmu_rb_search(handler, mnode->addr, mnode->len);
+	spin_lock_irqsave(&shard->lock, flags);
+	node = __mmu_rb_search(handler, shard, mnode->addr, mnode->len);
 	if (node) {
 		ret = -EINVAL;
 		goto unlock;
 	}
-	__mmu_int_rb_insert(mnode, &handler->root);
-	list_add(&mnode->list, &handler->lru_list);
+	__mmu_rb_add(handler, shard, mnode);
 
 	ret = handler->ops->insert(handler->ops_arg, mnode);
 	if (ret) {
-		__mmu_int_rb_remove(mnode, &handler->root);
+		__mmu_rb_del(shard, mnode);
 		list_del(&mnode->list); /* remove from LRU list */
 	}
 unlock:
-	spin_unlock_irqrestore(&handler->lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 	return ret;
 }
 
-/* Caller must hold handler lock */
+/* Caller must hold shard lock */
 static struct mmu_rb_node *__mmu_rb_search(struct mmu_rb_handler *handler,
+					   struct mmu_rb_shard *shard,
 					   unsigned long addr,
 					   unsigned long len)
 {
@@ -232,10 +331,10 @@ static struct mmu_rb_node *__mmu_rb_search(struct mmu_rb_handler *handler,
 
 	trace_hfi1_mmu_rb_search(addr, len);
 	if (!handler->ops->filter) {
-		node = __mmu_int_rb_iter_first(&handler->root, addr,
+		node = __mmu_int_rb_iter_first(&shard->root, addr,
 					       (addr + len) - 1);
 	} else {
-		for (node = __mmu_int_rb_iter_first(&handler->root, addr,
+		for (node = __mmu_int_rb_iter_first(&shard->root, addr,
 						    (addr + len) - 1);
 		     node;
 		     node = __mmu_int_rb_iter_next(node, addr,
@@ -247,51 +346,187 @@ static struct mmu_rb_node *__mmu_rb_search(struct mmu_rb_handler *handler,
 	return node;
 }
 
+/*
+ * Lockless lookup of a node that exactly matches addr and len.  The
+ * filter of a sharded handler matches on start address, so there is at
+ * most one candidate.  The get op takes a reference unless the node is
+ * already on its way out.
+ */
+static struct mmu_rb_node *mmu_rb_get_exact(struct mmu_rb_handler *handler,
+					    unsigned long addr,
+					    unsigned long len)
+{
+	struct mmu_rb_shard *shard = mmu_rb_shard(handler, addr);
+	struct mmu_rb_node *node;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(node, mmu_rb_bucket(shard, addr), hnode) {
+		if (node->addr != addr)
+			continue;
+		if (READ_ONCE(node->len) == len &&
+		    handler->ops->get(handler->ops_arg, node)) {
+			mmu_rb_touch(node);
+			this_cpu_inc(handler->stats->hits);
+			rcu_read_unlock();
+			return node;
+		}
+		break;
+	}
+	rcu_read_unlock();
+	return NULL;
+}
+
+/*
+ * Look up the node for addr.  An exact match is left in the cache and,
+ * when the handler has a get op, returned with a reference held.  A
+ * partial match is removed from the cache and returned to the caller,
+ * which is expected to grow and re-insert it.  A node that get or
+ * extract fail on has been claimed by a remover that has yet to take the
+ * shard lock, so wait for it to go away.  With a get op this may sleep.
+ */
 bool hfi1_mmu_rb_remove_unless_exact(struct mmu_rb_handler *handler,
 				     unsigned long addr, unsigned long len,
 				     struct mmu_rb_node **rb_node)
 {
+	struct mmu_rb_shard *shard;
 	struct mmu_rb_node *node;
 	unsigned long flags;
 	bool ret = false;
 
-	spin_lock_irqsave(&handler->lock, flags);
-	node = __mmu_rb_search(handler, addr, len);
+	if (handler->ops->get) {
+		node = mmu_rb_get_exact(handler, addr, len);
+		if (node) {
+			*rb_node = node;
+			return false;
+		}
+	}
+
+	shard = mmu_rb_shard(handler, addr);
+retry:
+	spin_lock_irqsave(&shard->lock, flags);
+	node = __mmu_rb_search(handler, shard, addr, len);
 	if (node) {
-		if (node->addr == addr && node->len == len)
+		if (node->addr == addr && node->len == len) {
+			if (handler->ops->get &&
+			    !handler->ops->get(handler->ops_arg, node))
+				goto busy;
+			mmu_rb_touch(node);
+			this_cpu_inc(handler->stats->hits);
 			goto unlock;
-		__mmu_int_rb_remove(node, &handler->root);
+		}
+		if (handler->ops->extract &&
+		    !handler->ops->extract(handler->ops_arg, node))
+			goto busy;
+		__mmu_rb_del(shard, node);
 		list_del(&node->list); /* remove from LRU list */
+		this_cpu_inc(handler->stats->rebuilds);
 		ret = true;
+	} else {
+		this_cpu_inc(handler->stats->misses);
 	}
 unlock:
-	spin_unlock_irqrestore(&handler->lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 	*rb_node = node;
 	return ret;
+busy:
+	spin_unlock_irqrestore(&shard->lock, flags);
+	cond_resched();
+	goto retry;
 }
 
-void hfi1_mmu_rb_evict(struct mmu_rb_handler *handler, void *evict_arg)
+/*
+ * Walk one list of a shard from its cold end, offering nodes of at least
+ * min_len to the evict op.  Referenced nodes are moved to the head of
+ * the main LRU list instead: a rotation for the LRU list, a promotion
+ * for the 2Q probation list.  Returns true once the evict op asked to
+ * stop.  Caller must hold the shard lock.
+ */
+static bool mmu_rb_scan(struct mmu_rb_handler *handler,
+			struct mmu_rb_shard *shard, struct list_head *list,
+			unsigned long min_len, void *evict_arg,
+			struct list_head *del_list)
 {
 	struct mmu_rb_node *rbnode, *ptr;
-	struct list_head del_list;
-	unsigned long flags;
 	bool stop = false;
-
-	INIT_LIST_HEAD(&del_list);
-
-	spin_lock_irqsave(&handler->lock, flags);
-	list_for_each_entry_safe_reverse(rbnode, ptr, &handler->lru_list,
-					 list) {
+	/* one rotation per node, even if hits keep setting the bit */
+	u32 budget = shard->nr_nodes;
+
+	list_for_each_entry_safe_reverse(rbnode, ptr, list, list) {
+		if (rbnode->len < min_len)
+			continue;
+		/* recently used, give it another trip around the list */
+		if (budget && READ_ONCE(rbnode->referenced)) {
+			budget--;
+			WRITE_ONCE(rbnode->referenced, 0);
+			list_move(&rbnode->list, &shard->lru_list);
+			continue;
+		}
 		if (handler->ops->evict(handler->ops_arg, rbnode, evict_arg,
 					&stop)) {
-			__mmu_int_rb_remove(rbnode, &handler->root);
+			__mmu_rb_del(shard, rbnode);
 			/* move from LRU list to delete list */
-			list_move(&rbnode->list, &del_list);
+			list_move(&rbnode->list, del_list);
+			this_cpu_inc(handler->stats->evictions);
 		}
 		if (stop)
 			break;
 	}
-	spin_unlock_irqrestore(&handler->lock, flags);
+	return stop;
+}
+
+/*
+ * LRU evicts from the cold end of the list.  Size-aware LRU first takes
+ * nodes at least as large as the shard average, so a page target is met
+ * by unpinning fewer, bigger buffers.  2Q evicts nodes that were never
+ * hit after insertion before touching the main list.
+ */
+static bool mmu_rb_evict_shard(struct mmu_rb_handler *handler,
+			       struct mmu_rb_shard *shard, void *evict_arg,
+			       struct list_head *del_list)
+{
+	unsigned long flags;
+	bool stop = false;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	switch (handler->policy) {
+	case MMU_RB_POLICY_SIZE:
+		if (shard->nr_nodes)
+			stop = mmu_rb_scan(handler, shard, &shard->lru_list,
+					   shard->bytes / shard->nr_nodes,
+					   evict_arg, del_list);
+		break;
+	case MMU_RB_POLICY_2Q:
+		stop = mmu_rb_scan(handler, shard, &shard->probation, 0,
+				   evict_arg, del_list);
+		break;
+	default:
+		break;
+	}
+	if (!stop)
+		stop = mmu_rb_scan(handler, shard, &shard->lru_list, 0,
+				   evict_arg, del_list);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	return stop;
+}
+
+void hfi1_mmu_rb_evict(struct mmu_rb_handler *handler, void *evict_arg)
+{
+	struct mmu_rb_node *rbnode;
+	struct list_head del_list;
+	u32 first, i;
+
+	INIT_LIST_HEAD(&del_list);
+
+	/* rotate the starting shard so no one range is always evicted first */
+	first = handler->nshards == 1 ? 0 :
+		(u32)atomic_inc_return(&handler->evict_next) % handler->nshards;
+	for (i = 0; i < handler->nshards; i++)
+		if (mmu_rb_evict_shard(handler,
+				       &handler->shard[(first + i) %
+						       handler->nshards],
+				       evict_arg, &del_list))
+			break;
 
 	while (!list_empty(&del_list)) {
 		rbnode = list_first_entry(&del_list, struct mmu_rb_node, list);
@@ -308,14 +543,15 @@ void hfi1_mmu_rb_evict(struct mmu_rb_handler *handler, void *evict_arg)
 void hfi1_mmu_rb_remove(struct mmu_rb_handler *handler,
 			struct mmu_rb_node *node)
 {
+	struct mmu_rb_shard *shard = mmu_rb_shard(handler, node->addr);
 	unsigned long flags;
 
 	/* Validity of handler and node pointers has been checked by caller. */
 	trace_hfi1_mmu_rb_remove(node->addr, node->len);
-	spin_lock_irqsave(&handler->lock, flags);
-	__mmu_int_rb_remove(node, &handler->root);
+	spin_lock_irqsave(&shard->lock, flags);
+	__mmu_rb_del(shard, node);
 	list_del(&node->list); /* remove from LRU list */
-	spin_unlock_irqrestore(&handler->lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 
 	handler->ops->remove(handler->ops_arg, node);
 }
@@ -325,41 +561,88 @@ static int mmu_notifier_range_start(struct mmu_notifier *mn,
 {
 	struct mmu_rb_handler *handler =
 		container_of(mn, struct mmu_rb_handler, mn);
-#ifdef NO_RB_ROOT_CACHE
-	struct rb_root *root = &handler->root;
-#else
-	struct rb_root_cached *root = &handler->root;
-#endif
 	struct mmu_rb_node *node, *ptr = NULL;
+	struct list_head del_list;
 	unsigned long flags;
-	bool added = false;
-
-	spin_lock_irqsave(&handler->lock, flags);
-	for (node = __mmu_int_rb_iter_first(root, range->start, range->end-1);
-	     node; node = ptr) {
-		/* Guard against node removal. */
-		ptr = __mmu_int_rb_iter_next(node, range->start,
-					     range->end - 1);
-		trace_hfi1_mmu_mem_invalidate(node->addr, node->len);
-		if (handler->ops->invalidate(handler->ops_arg, node)) {
-			__mmu_int_rb_remove(node, root);
-			/* move from LRU list to delete list */
-			list_move(&node->list, &handler->del_list);
-			added = true;
+	int i;
+
+	INIT_LIST_HEAD(&del_list);
+
+	for (i = 0; i < handler->nshards; i++) {
+		struct mmu_rb_shard *shard = &handler->shard[i];
+
+		spin_lock_irqsave(&shard->lock, flags);
+		for (node = __mmu_int_rb_iter_first(&shard->root, range->start,
+						    range->end - 1);
+		     node; node = ptr) {
+			/* Guard against node removal. */
+			ptr = __mmu_int_rb_iter_next(node, range->start,
+						     range->end - 1);
+			trace_hfi1_mmu_mem_invalidate(node->addr, node->len);
+			if (handler->ops->invalidate(handler->ops_arg, node)) {
+				__mmu_rb_del(shard, node);
+				/* move from LRU list to delete list */
+				list_move(&node->list, &del_list);
+				this_cpu_inc(handler->stats->invalidations);
+			}
 		}
+		spin_unlock_irqrestore(&shard->lock, flags);
 	}
-	spin_unlock_irqrestore(&handler->lock, flags);
 
-	if (added)
+	if (!list_empty(&del_list)) {
+		spin_lock_irqsave(&handler->del_lock, flags);
+		list_splice_tail(&del_list, &handler->del_list);
+		spin_unlock_irqrestore(&handler->del_lock, flags);
 		queue_work(handler->wq, &handler->del_work);
+	}
 
 	return 0;
 }
 
+/*
+ * Select the eviction policy.  Nodes already cached stay where they are;
+ * with 2Q they are treated as already promoted.
+ */
+void hfi1_mmu_rb_set_policy(struct mmu_rb_handler *handler,
+			    enum mmu_rb_policy policy)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < handler->nshards; i++) {
+		struct mmu_rb_shard *shard = &handler->shard[i];
+
+		spin_lock_irqsave(&shard->lock, flags);
+		list_splice_init(&shard->probation, &shard->lru_list);
+		handler->policy = policy;
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+}
+
+/* Sum the per CPU counters and the cached byte count */
+void hfi1_mmu_rb_get_stats(struct mmu_rb_handler *handler,
+			   struct mmu_rb_stats *stats)
+{
+	int cpu, i;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		struct mmu_rb_stats *s = per_cpu_ptr(handler->stats, cpu);
+
+		stats->hits += s->hits;
+		stats->misses += s->misses;
+		stats->rebuilds += s->rebuilds;
+		stats->evictions += s->evictions;
+		stats->invalidations += s->invalidations;
+	}
+	for (i = 0; i < handler->nshards; i++)
+		stats->bytes += READ_ONCE(handler->shard[i].bytes);
+}
+
 /*
  * Call the remove function for the given handler and the list.  This
  * is expected to be called with a delete list extracted from handler.
- * The caller should not be holding the handler lock.
+ * The caller should not be holding a shard lock.
  */
 static void do_remove(struct mmu_rb_handler *handler,
 		      struct list_head *del_list)
@@ -387,9 +670,9 @@ static void handle_remove(struct work_struct *work)
 	unsigned long flags;
 
 	/* remove anything that is queued to get removed */
-	spin_lock_irqsave(&handler->lock, flags);
+	spin_lock_irqsave(&handler->del_lock, flags);
 	list_replace_init(&handler->del_list, &del_list);
-	spin_unlock_irqrestore(&handler->lock, flags);
+	spin_unlock_irqrestore(&handler->del_lock, flags);
 
 	do_remove(handler, &del_list);
 }
@@ -412,16 +695,21 @@ struct mmu_rb_node *hfi1_mmu_rb_first_cached(struct mmu_rb_handler *handler)
 	struct mmu_rb_node *rbnode = NULL;
 	struct rb_node *node;
 	unsigned long flags;
+	int i;
+
+	for (i = 0; !rbnode && i < handler->nshards; i++) {
+		struct mmu_rb_shard *shard = &handler->shard[i];
 
-	spin_lock_irqsave(&handler->lock, flags);
+		spin_lock_irqsave(&shard->lock, flags);
 #ifdef NO_RB_ROOT_CACHE
-	node = rb_first(&handler->root);
+		node = rb_first(&shard->root);
 #else
-	node = rb_first_cached(&handler->root);
+		node = rb_first_cached(&shard->root);
 #endif
-	if (node)
-		rbnode = rb_entry(node, struct mmu_rb_node, node);
-	spin_unlock_irqrestore(&handler->lock, flags);
+		if (node)
+			rbnode = rb_entry(node, struct mmu_rb_node, node);
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
 
 	return rbnode;
 }
@@ -445,12 +733,13 @@ struct mmu_rb_node *hfi1_mmu_rb_search_addr(struct mmu_rb_handler *handler,
 					    unsigned long addr,
 					    unsigned long len)
 {
+	struct mmu_rb_shard *shard = mmu_rb_shard(handler, addr);
 	struct mmu_rb_node *ret_node = NULL;
 	unsigned long flags;
 
-	spin_lock_irqsave(&handler->lock, flags);
-	ret_node = __mmu_rb_search(handler, addr, len);
-	spin_unlock_irqrestore(&handler->lock, flags);
+	spin_lock_irqsave(&shard->lock, flags);
+	ret_node = __mmu_rb_search(handler, shard, addr, len);
+	spin_unlock_irqrestore(&shard->lock, flags);
 
 	return ret_node;
 }
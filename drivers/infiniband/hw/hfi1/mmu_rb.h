@@ -55,15 +55,32 @@ struct mmu_rb_node {
 	unsigned long __last;
 	struct rb_node node;
 	struct list_head list;
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	u8 referenced;
 };
 
 /*
- * NOTE: filter, insert, invalidate, and evict must not sleep.  Only remove is
- * allowed to sleep.
+ * NOTE: filter, get, insert, invalidate, and evict must not sleep.  Only
+ * remove is allowed to sleep.
+ *
+ * get is optional.  It takes a reference on a node found without the tree
+ * lock and returns false if the node is being evicted or invalidated.
+ * Providing it, together with a filter that matches on the exact start
+ * address, gives lockless lookups and a tree sharded by address range.
+ * Such users must not free a node until an RCU grace period after it is
+ * passed to remove.  They must also provide extract, which claims a
+ * partially matching node before hfi1_mmu_rb_remove_unless_exact() takes
+ * it out of the cache so that get fails on it until it is inserted
+ * again.  extract returns false if the node is already being removed.
+ * Nodes that get or extract fail on are waited for, so the remover must
+ * take them out of the tree promptly.
  */
 struct mmu_rb_ops {
 	bool (*filter)(struct mmu_rb_node *node, unsigned long addr,
 		       unsigned long len);
+	bool (*get)(void *ops_arg, struct mmu_rb_node *mnode);
+	bool (*extract)(void *ops_arg, struct mmu_rb_node *mnode);
 	int (*insert)(void *ops_arg, struct mmu_rb_node *mnode);
 	void (*remove)(void *ops_arg, struct mmu_rb_node *mnode);
 	int (*invalidate)(void *ops_arg, struct mmu_rb_node *node);
@@ -71,6 +88,22 @@ struct mmu_rb_ops {
 		     void *evict_arg, bool *stop);
 };
 
+enum mmu_rb_policy {
+	MMU_RB_POLICY_LRU,	/* least recently used, with second chance */
+	MMU_RB_POLICY_SIZE,	/* LRU, larger than average nodes first */
+	MMU_RB_POLICY_2Q,	/* never hit nodes first, then LRU */
+};
+
+/* per handler cache statistics, see hfi1_mmu_rb_get_stats() */
+struct mmu_rb_stats {
+	u64 hits;		/* exact matches */
+	u64 misses;		/* no node for the address */
+	u64 rebuilds;		/* partial matches pulled out to be re-pinned */
+	u64 evictions;
+	u64 invalidations;	/* nodes dropped by the MMU notifier */
+	u64 bytes;		/* bytes currently cached */
+};
+
 int hfi1_mmu_rb_register(void *ops_arg, struct mm_struct *mm,
 			 struct mmu_rb_ops *ops,
 			 struct workqueue_struct *wq,
@@ -84,6 +117,10 @@ void hfi1_mmu_rb_remove(struct mmu_rb_handler *handler,
 bool hfi1_mmu_rb_remove_unless_exact(struct mmu_rb_handler *handler,
 				     unsigned long addr, unsigned long len,
 				     struct mmu_rb_node **rb_node);
+void hfi1_mmu_rb_set_policy(struct mmu_rb_handler *handler,
+			    enum mmu_rb_policy policy);
+void hfi1_mmu_rb_get_stats(struct mmu_rb_handler *handler,
+			   struct mmu_rb_stats *stats);
 
 
 #ifdef NVIDIA_GPU_DIRECT
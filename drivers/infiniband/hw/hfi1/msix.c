@@ -201,6 +201,12 @@ int msix_request_rcd_irq(struct hfi1_ctxtdata *rcd)
 	snprintf(name, sizeof(name), DRIVER_NAME "_%d kctxt%d",
 		 rcd->dd->unit, rcd->ctxt);
 
+	/* see hfi1_krcv_napi_init() */
+	if (rcd->napi)
+		return msix_request_rcd_irq_common(rcd,
+						   receive_context_interrupt_napi,
+						   NULL, name);
+
 	return msix_request_rcd_irq_common(rcd, receive_context_interrupt,
 					   receive_context_thread, name);
 }
@@ -221,6 +221,10 @@ void *hfi1_netdev_get_data(struct hfi1_devdata *dd, int id);
  */
 void *hfi1_netdev_get_first_data(struct hfi1_devdata *dd, int *start_id);
 
+void hfi1_netdev_egr_track(struct hfi1_packet *packet);
+struct eager_buffer *hfi1_netdev_egr_lend(struct hfi1_ctxtdata *rcd, u16 idx);
+void hfi1_netdev_egr_refill(struct hfi1_ctxtdata *rcd);
+
 /* chip.c  */
 /**
  * hfi1_netdev_rx_napi - NAPI poll function
@@ -61,6 +61,265 @@
 #include <linux/etherdevice.h>
 #include <rdma/ib_verbs.h>
 
+static bool netdev_rx_zcopy;
+module_param(netdev_rx_zcopy, bool, 0444);
+MODULE_PARM_DESC(netdev_rx_zcopy, "Attach netdev eager buffers to received skbs instead of copying");
+
+/*
+ * Park a replaced page the stack still holds.  It stays mapped and goes
+ * back to the spares once the stack has freed it.  If the ring is full
+ * the oldest page is left to the stack.  Called with zc->lock held.
+ */
+static void hfi1_netdev_egr_hold(struct hfi1_ctxtdata *rcd,
+				 struct eager_buffer *buf)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+
+	if (zc->nheld == zc->maxheld) {
+		hfi1_free_eager_buffer(rcd->dd, &zc->held[zc->held_head]);
+		zc->held_head = (zc->held_head + 1) % zc->maxheld;
+		zc->nheld--;
+	}
+	zc->held[(zc->held_head + zc->nheld) % zc->maxheld] = *buf;
+	zc->nheld++;
+}
+
+/*
+ * Move held pages the stack has freed back to the spares, oldest first.
+ * Called with zc->lock held.
+ */
+static void hfi1_netdev_egr_recycle(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	struct eager_buffer *buf;
+
+	while (zc->nheld && zc->nspares < zc->maxspares) {
+		buf = &zc->held[zc->held_head];
+		if (page_count(buf->page) != 1)
+			break;
+		dma_sync_single_for_device(&rcd->dd->pcidev->dev, buf->dma,
+					   buf->len, DMA_FROM_DEVICE);
+		zc->spares[zc->nspares++] = *buf;
+		memset(buf, 0, sizeof(*buf));
+		zc->held_head = (zc->held_head + 1) % zc->maxheld;
+		zc->nheld--;
+	}
+}
+
+/*
+ * Return an eager entry the hardware has moved past. If the stack still
+ * holds the entry's page, swap in the spare reserved for it so that the
+ * hardware can never overwrite data an skb points at.  Called with
+ * zc->lock held.
+ */
+static void hfi1_netdev_egr_release(struct hfi1_ctxtdata *rcd, u16 idx)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	struct eager_buffer *buf = &rcd->egrbufs.buffers[idx];
+	struct eager_buffer *spare = &zc->reserved[idx];
+
+	if (spare->page && page_count(buf->page) > 1) {
+		hfi1_netdev_egr_hold(rcd, buf);
+		*buf = *spare;
+		memset(spare, 0, sizeof(*spare));
+		rcd->egrbufs.rcvtids[idx].addr = buf->addr;
+		rcd->egrbufs.rcvtids[idx].dma = buf->dma;
+		hfi1_put_tid(rcd->dd, rcd->eager_base + idx, PT_EAGER,
+			     buf->dma, zc->order);
+		return;
+	}
+
+	/* recycle in place, the reserved spare was not needed */
+	if (spare->page) {
+		zc->spares[zc->nspares++] = *spare;
+		memset(spare, 0, sizeof(*spare));
+	}
+	dma_sync_single_for_device(&rcd->dd->pcidev->dev, buf->dma, buf->len,
+				   DMA_FROM_DEVICE);
+}
+
+/**
+ * hfi1_netdev_egr_track - account for a packet in a zero-copy context
+ * @packet: the packet about to be dispatched
+ *
+ * Entries are filled in order, so reaching a new eager index means every
+ * entry before it has been completely consumed.
+ */
+void hfi1_netdev_egr_track(struct hfi1_packet *packet)
+{
+	struct hfi1_ctxtdata *rcd = packet->rcd;
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	struct eager_buffer *buf;
+	u32 offset;
+	u16 idx;
+
+	if (!rhf_use_egr_bfr(packet->rhf))
+		return;
+
+	idx = packet->etail;
+	if (zc->last_idx != idx) {
+		spin_lock(&zc->lock);
+		while (zc->last_idx != idx) {
+			hfi1_netdev_egr_release(rcd, zc->last_idx);
+			if (++zc->last_idx >= rcd->egrbufs.alloced)
+				zc->last_idx = 0;
+		}
+		spin_unlock(&zc->lock);
+	}
+
+	buf = &rcd->egrbufs.buffers[idx];
+	offset = rhf_egr_buf_offset(packet->rhf) * RCV_BUF_BLOCK_SIZE;
+	dma_sync_single_range_for_cpu(&rcd->dd->pcidev->dev, buf->dma, offset,
+				      min_t(u32, packet->tlen,
+					    buf->len - offset),
+				      DMA_FROM_DEVICE);
+}
+
+/**
+ * hfi1_netdev_egr_lend - get the page backing an eager entry
+ * @rcd: the receive context
+ * @idx: eager index of the packet
+ *
+ * Reserve a replacement page for the entry so its page can be attached to
+ * an skb. The caller must take its own page reference.
+ *
+ * Return: the eager buffer, or NULL if the packet has to be copied because
+ * the context is not zero-copy or no spare pages are left.
+ */
+struct eager_buffer *hfi1_netdev_egr_lend(struct hfi1_ctxtdata *rcd, u16 idx)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	struct eager_buffer *buf = NULL;
+
+	if (!zc)
+		return NULL;
+
+	spin_lock(&zc->lock);
+	if (!zc->reserved[idx].page) {
+		if (!zc->nspares)
+			goto unlock;
+		zc->reserved[idx] = zc->spares[--zc->nspares];
+	}
+	buf = &rcd->egrbufs.buffers[idx];
+unlock:
+	spin_unlock(&zc->lock);
+	return buf;
+}
+
+/*
+ * Fill the spares up with pages the stack has freed and then with new
+ * pages from the context's NUMA node.
+ */
+static void hfi1_netdev_egr_refill_work(struct work_struct *work)
+{
+	struct hfi1_egr_zcopy *zc = container_of(work, struct hfi1_egr_zcopy,
+						 refill_work);
+	struct hfi1_ctxtdata *rcd = zc->rcd;
+	struct eager_buffer buf;
+	bool full;
+
+	for (;;) {
+		spin_lock_bh(&zc->lock);
+		hfi1_netdev_egr_recycle(rcd);
+		full = zc->nspares >= zc->maxspares;
+		spin_unlock_bh(&zc->lock);
+		if (full)
+			break;
+
+		memset(&buf, 0, sizeof(buf));
+		if (hfi1_alloc_eager_buffer(rcd, &buf,
+					    rcd->egrbufs.rcvtid_size,
+					    GFP_KERNEL))
+			break;
+
+		spin_lock_bh(&zc->lock);
+		if (zc->nspares < zc->maxspares) {
+			zc->spares[zc->nspares++] = buf;
+			buf.page = NULL;
+		}
+		spin_unlock_bh(&zc->lock);
+		if (buf.page) {
+			hfi1_free_eager_buffer(rcd->dd, &buf);
+			break;
+		}
+	}
+}
+
+/**
+ * hfi1_netdev_egr_refill - top up the spare page pool of a context
+ * @rcd: the receive context
+ *
+ * Called at the end of a NAPI poll.  Recycles the pages the stack has
+ * freed and, if the spares are still low, kicks the refill work on a CPU
+ * of the context's NUMA node.
+ */
+void hfi1_netdev_egr_refill(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	unsigned int cpu;
+	bool low;
+
+	spin_lock(&zc->lock);
+	hfi1_netdev_egr_recycle(rcd);
+	low = zc->nspares < zc->lowspares;
+	spin_unlock(&zc->lock);
+
+	if (!low || work_pending(&zc->refill_work))
+		return;
+
+	cpu = cpumask_any_and(cpumask_of_node(rcd->numa_id), cpu_online_mask);
+	if (cpu < nr_cpu_ids)
+		queue_work_on(cpu, rcd->ppd->hfi1_wq, &zc->refill_work);
+	else
+		queue_work(rcd->ppd->hfi1_wq, &zc->refill_work);
+}
+
+/*
+ * The hardware restarts at eager index 0 when the context is enabled.
+ * Settle any lent entries and start tracking from the beginning.
+ */
+static void hfi1_netdev_egr_reset(struct hfi1_ctxtdata *rcd)
+{
+	struct hfi1_egr_zcopy *zc = rcd->egrbufs.zc;
+	u16 i;
+
+	if (!zc)
+		return;
+
+	spin_lock_bh(&zc->lock);
+	for (i = 0; i < rcd->egrbufs.alloced; i++)
+		hfi1_netdev_egr_release(rcd, i);
+	zc->last_idx = 0;
+	spin_unlock_bh(&zc->lock);
+}
+
+static int hfi1_netdev_setup_eagerbufs(struct hfi1_ctxtdata *uctxt)
+{
+	u32 size = uctxt->egrbufs.size;
+	u32 rcvtid_size = uctxt->egrbufs.rcvtid_size;
+	int ret;
+
+	if (netdev_rx_zcopy &&
+	    !hfi1_alloc_egr_zcopy(uctxt, hfi1_netdev_egr_refill_work)) {
+		ret = hfi1_setup_eagerbufs(uctxt);
+		if (!ret) {
+			hfi1_netdev_egr_refill_work(
+				&uctxt->egrbufs.zc->refill_work);
+			return 0;
+		}
+
+		dd_dev_info(uctxt->dd,
+			    "ctxt%u: no zero-copy eager buffers, copying\n",
+			    uctxt->ctxt);
+		hfi1_free_egr_zcopy(uctxt);
+		uctxt->egrbufs.alloced = 0;
+		uctxt->egrbufs.size = size;
+		uctxt->egrbufs.rcvtid_size = rcvtid_size;
+	}
+
+	return hfi1_setup_eagerbufs(uctxt);
+}
+
 static int hfi1_netdev_setup_ctxt(struct hfi1_netdev_priv *priv,
 				  struct hfi1_ctxtdata *uctxt)
 {
@@ -77,7 +336,7 @@ static int hfi1_netdev_setup_ctxt(struct hfi1_netdev_priv *priv,
 	if (ret)
 		goto done;
 
-	ret = hfi1_setup_eagerbufs(uctxt);
+	ret = hfi1_netdev_setup_eagerbufs(uctxt);
 	if (ret)
 		goto done;
 
@@ -269,6 +528,7 @@ static void enable_queues(struct hfi1_netdev_priv *priv)
 
 		dd_dev_info(priv->dd, "enabling queue %d on context %d\n", i,
 			    rxq->rcd->ctxt);
+		hfi1_netdev_egr_reset(rxq->rcd);
 		napi_enable(&rxq->napi);
 		hfi1_rcvctrl(priv->dd,
 			     HFI1_RCVCTRL_CTXT_ENB | HFI1_RCVCTRL_INTRAVAIL_ENB,
@@ -148,6 +148,18 @@ void pio_send_control(struct hfi1_devdata *dd, int op)
 
 #define PIO_WAIT_BATCH_SIZE 5
 
+static bool pio_credit_predict = true;
+module_param(pio_credit_predict, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pio_credit_predict,
+		 "Pick up returned PIO credits before a send context runs out");
+
+uint pio_sc_per_vl = INIT_SC_PER_VL;
+module_param(pio_sc_per_vl, uint, S_IRUGO);
+MODULE_PARM_DESC(pio_sc_per_vl, "Kernel PIO send contexts per VL (1-8)");
+
+/* protects the per CPU send context map and the sc cpu masks */
+static DEFINE_MUTEX(pio_cpu_map_mutex);
+
 /* default send context sizes */
 static struct sc_config_sizes sc_config_sizes[SC_MAX] = {
 	[SC_KERNEL] = { .size  = SCS_POOL_0,	/* even divide, pool 0 */
@@ -330,7 +342,13 @@ int init_sc_pools_and_sizes(struct hfi1_devdata *dd)
 		if (i == SC_ACK) {
 			count = dd->n_krcv_queues;
 		} else if (i == SC_KERNEL) {
-			count = INIT_SC_PER_VL * num_vls;
+			if (!pio_sc_per_vl || pio_sc_per_vl > MAX_SC_PER_VL) {
+				dd_dev_err(dd,
+					   "Invalid pio_sc_per_vl %u, using %u\n",
+					   pio_sc_per_vl, INIT_SC_PER_VL);
+				pio_sc_per_vl = INIT_SC_PER_VL;
+			}
+			count = pio_sc_per_vl * num_vls;
 		} else if (count == SCC_PER_CPU) {
 			count = dd->num_rcv_contexts - dd->n_krcv_queues;
 		} else if (count < 0) {
@@ -1308,6 +1326,7 @@ int sc_enable(struct send_context *sc)
 	*sc->hw_free = 0;
 	sc->free = 0;
 	sc->alloc_free = 0;
+	sc->alloc_ret_batch = 0;
 	sc->fill = 0;
 	sc->fill_wrap = 0;
 	sc->sr_head = 0;
@@ -1435,6 +1454,43 @@ void sc_stop(struct send_context *sc, int flag)
 #define BLOCK_DWORDS (PIO_BLOCK_SIZE / sizeof(u32))
 #define dwords_to_blocks(x) DIV_ROUND_UP(x, BLOCK_DWORDS)
 
+/*
+ * Copy the releaser's free count and return batch estimate into the
+ * allocator cacheline.  Called with alloc_lock held.
+ */
+static inline void sc_alloc_refresh(struct send_context *sc)
+{
+	sc->alloc_free = READ_ONCE(sc->free);
+	sc->alloc_ret_batch = READ_ONCE(sc->ret_batch);
+}
+
+/*
+ * Credit return prediction
+ *
+ * The hardware returns credits in batches whose size follows the recent
+ * egress rate; ret_batch tracks it.  Once an allocation leaves fewer
+ * credits than one such batch, the next allocations would stall unless
+ * a return already written to hw_free is picked up, so look at it early
+ * instead of waiting for hard exhaustion or the credit interrupt.
+ *
+ * Called with alloc_lock held.
+ */
+static void sc_credit_predict(struct send_context *sc)
+{
+	u64 hw_free = le64_to_cpu(*sc->hw_free);	/* volatile read */
+	unsigned long extra;
+
+	sc->credit_polls++;
+	extra = (((hw_free & CR_COUNTER_SMASK) >> CR_COUNTER_SHIFT)
+			- (READ_ONCE(sc->free) & CR_COUNTER_MASK))
+				& CR_COUNTER_MASK;
+	if (!extra)
+		return;
+	sc->credit_poll_hits++;
+	sc_release_update(sc);
+	sc_alloc_refresh(sc);
+}
+
 /*
  * The send context buffer "allocator".
  *
@@ -1472,17 +1528,21 @@ retry:
 			goto done;
 		}
 		/* copy from receiver cache line and recalculate */
-		sc->alloc_free = READ_ONCE(sc->free);
+		sc_alloc_refresh(sc);
 		avail =
 			(unsigned long)sc->credits -
 			(sc->fill - sc->alloc_free);
 		if (blocks > avail) {
 			/* still no room, actively update */
+			sc->credit_stalls++;
 			sc_release_update(sc);
-			sc->alloc_free = READ_ONCE(sc->free);
+			sc_alloc_refresh(sc);
 			trycount++;
 			goto retry;
 		}
+	} else if (pio_credit_predict &&
+		   avail - blocks < sc->alloc_ret_batch) {
+		sc_credit_predict(sc);
 	}
 
 	/* there is enough room */
@@ -1716,6 +1776,8 @@ void sc_release_update(struct send_context *sc)
 				& CR_COUNTER_MASK;
 	free = old_free + extra;
 	trace_hfi1_piofree(sc, extra);
+	if (extra)
+		WRITE_ONCE(sc->ret_batch, (3 * sc->ret_batch + extra) / 4);
 
 	/* call sent buffer callbacks */
 	code = -1;				/* code not yet set */
@@ -1845,6 +1907,160 @@ struct send_context *pio_select_send_context_sc(struct hfi1_devdata *dd,
 	return pio_select_send_context_vl(dd, selector, vl);
 }
 
+/*
+ * pio_cpu_send_context() - send context for the sending CPU
+ * @sc: send context the packet was given from the pio_vl_map
+ * @sc5: the 5 bit sc
+ *
+ * Called at send time.  Returns the send context mapped to the current
+ * CPU through the cpu_list sysfs file, if any, else @sc.  The sender may
+ * migrate right after the lookup; that only costs some sharing.
+ */
+struct send_context *pio_cpu_send_context(struct send_context *sc, u8 sc5)
+{
+	struct hfi1_devdata *dd = sc->dd;
+	struct send_context *csc;
+	u8 vl = sc_to_vlt(dd, sc5);
+
+	if (!dd->pio_cpu_map || vl >= num_vls)
+		return sc;
+	csc = this_cpu_read(dd->pio_cpu_map->ksc[vl]);
+	return csc ? csc : sc;
+}
+
+/*
+ * Return the data vl a kernel send context is mapped to by the
+ * pio_vl_map, or -EINVAL if it is not in the map.
+ */
+int pio_sc_get_vl(struct send_context *sc)
+{
+	struct hfi1_devdata *dd = sc->dd;
+	struct pio_vl_map *m;
+	int i, j, vl = -EINVAL;
+
+	rcu_read_lock();
+	m = rcu_dereference(dd->pio_map);
+	for (i = 0; m && vl < 0 && i < m->actual_vls; i++)
+		for (j = 0; j <= m->map[i]->mask; j++)
+			if (m->map[i]->ksc[j] == sc) {
+				vl = i;
+				break;
+			}
+	rcu_read_unlock();
+
+	return vl;
+}
+
+/*
+ * Rebuild the per CPU map from the kernel send context cpu masks after
+ * the pio_vl_map changed.  Contexts that moved keep their CPUs under the
+ * new vl; contexts that dropped out of the map lose them.
+ */
+static void pio_cpu_map_rebuild(struct hfi1_devdata *dd)
+{
+	struct send_context *sc;
+	unsigned long cpu;
+	int i, vl;
+
+	if (!dd->pio_cpu_map)
+		return;
+
+	mutex_lock(&pio_cpu_map_mutex);
+	for_each_possible_cpu(cpu) {
+		struct pio_cpu_map *m = per_cpu_ptr(dd->pio_cpu_map, cpu);
+
+		for (vl = 0; vl < ARRAY_SIZE(m->ksc); vl++)
+			WRITE_ONCE(m->ksc[vl], NULL);
+	}
+	for (i = 1; i < dd->num_send_contexts; i++) {
+		sc = dd->kernel_send_context[i];
+		if (!sc)
+			break;
+		vl = pio_sc_get_vl(sc);
+		if (vl < 0) {
+			cpumask_clear(&sc->cpu_mask);
+			continue;
+		}
+		for_each_cpu(cpu, &sc->cpu_mask)
+			WRITE_ONCE(per_cpu_ptr(dd->pio_cpu_map, cpu)->ksc[vl],
+				   sc);
+	}
+	mutex_unlock(&pio_cpu_map_mutex);
+}
+
+/*
+ * Steer the CPUs in buf to this kernel send context for its vl.  Unlike
+ * the SDMA map a CPU is given a single context per vl, so a CPU taken
+ * by this context is dropped from the one that had it before.
+ */
+ssize_t pio_set_cpu_to_sc_map(struct send_context *sc, const char *buf,
+			      size_t count)
+{
+	struct hfi1_devdata *dd = sc->dd;
+	cpumask_var_t mask;
+	unsigned long cpu;
+	int ret, vl;
+
+	if (!dd->pio_cpu_map)
+		return -EINVAL;
+
+	ret = zalloc_cpumask_var(&mask, GFP_KERNEL);
+	if (!ret)
+		return -ENOMEM;
+
+	ret = cpulist_parse(buf, mask);
+	if (ret)
+		goto out_free;
+
+	if (!cpumask_subset(mask, cpu_online_mask)) {
+		dd_dev_warn(dd, "Invalid CPU mask\n");
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	mutex_lock(&pio_cpu_map_mutex);
+
+	vl = pio_sc_get_vl(sc);
+	if (vl < 0) {
+		ret = vl;
+		goto out;
+	}
+
+	/* Clean up old mappings */
+	for_each_cpu(cpu, &sc->cpu_mask) {
+		struct pio_cpu_map *m = per_cpu_ptr(dd->pio_cpu_map, cpu);
+
+		if (!cpumask_test_cpu(cpu, mask) && m->ksc[vl] == sc)
+			WRITE_ONCE(m->ksc[vl], NULL);
+	}
+
+	for_each_cpu(cpu, mask) {
+		struct pio_cpu_map *m = per_cpu_ptr(dd->pio_cpu_map, cpu);
+
+		if (m->ksc[vl] && m->ksc[vl] != sc)
+			cpumask_clear_cpu(cpu, &m->ksc[vl]->cpu_mask);
+		WRITE_ONCE(m->ksc[vl], sc);
+	}
+
+	cpumask_copy(&sc->cpu_mask, mask);
+out:
+	mutex_unlock(&pio_cpu_map_mutex);
+out_free:
+	free_cpumask_var(mask);
+	return ret ? : strnlen(buf, PAGE_SIZE);
+}
+
+ssize_t pio_get_cpu_to_sc_map(struct send_context *sc, char *buf)
+{
+	mutex_lock(&pio_cpu_map_mutex);
+	if (cpumask_empty(&sc->cpu_mask))
+		snprintf(buf, PAGE_SIZE, "%s\n", "empty");
+	else
+		cpumap_print_to_pagebuf(true, buf, &sc->cpu_mask);
+	mutex_unlock(&pio_cpu_map_mutex);
+	return strnlen(buf, PAGE_SIZE);
+}
+
 /*
  * Free the indicated map struct
  */
@@ -1990,6 +2206,7 @@ int pio_map_init(struct hfi1_devdata *dd, u8 port, u8 num_vls, u8 *vl_scontexts)
 	/* success, free any old map after grace period */
 	if (oldmap)
 		call_rcu(&oldmap->list, pio_map_rcu_callback);
+	pio_cpu_map_rebuild(dd);
 	return 0;
 bail:
 	/* free any partial allocation */
@@ -2007,6 +2224,8 @@ void free_pio_map(struct hfi1_devdata *dd)
 		spin_unlock_irq(&dd->pio_map_lock);
 		synchronize_rcu();
 	}
+	free_percpu(dd->pio_cpu_map);
+	dd->pio_cpu_map = NULL;
 	kfree(dd->kernel_send_context);
 	dd->kernel_send_context = NULL;
 }
@@ -2052,7 +2271,7 @@ int init_pervl_scs(struct hfi1_devdata *dd)
 		/* non VL15 start with the max MTU */
 		dd->vld[i].mtu = hfi1_max_mtu;
 	}
-	for (i = num_vls; i < INIT_SC_PER_VL * num_vls; i++) {
+	for (i = num_vls; i < pio_sc_per_vl * num_vls; i++) {
 		dd->kernel_send_context[i + 1] =
 		sc_alloc(dd, SC_KERNEL, dd->rcd[0]->rcvhdrqentsize, dd->node);
 		if (!dd->kernel_send_context[i + 1])
@@ -2074,13 +2293,17 @@ int init_pervl_scs(struct hfi1_devdata *dd)
 		mask = all_vl_mask & ~(data_vls_mask);
 		write_kctxt_csr(dd, ctxt, SC(CHECK_VL), mask);
 	}
-	for (i = num_vls; i < INIT_SC_PER_VL * num_vls; i++) {
+	for (i = num_vls; i < pio_sc_per_vl * num_vls; i++) {
 		sc_enable(dd->kernel_send_context[i + 1]);
 		ctxt = dd->kernel_send_context[i + 1]->hw_context;
 		mask = all_vl_mask & ~(data_vls_mask);
 		write_kctxt_csr(dd, ctxt, SC(CHECK_VL), mask);
 	}
 
+	dd->pio_cpu_map = alloc_percpu(struct pio_cpu_map);
+	if (!dd->pio_cpu_map)
+		goto nomem;
+
 	if (pio_map_init(dd, ppd->port - 1, num_vls, NULL))
 		goto nomem;
 	return 0;
@@ -2091,9 +2314,11 @@ nomem:
 		dd->vld[i].sc = NULL;
 	}
 
-	for (i = num_vls; i < INIT_SC_PER_VL * num_vls; i++)
+	for (i = num_vls; i < pio_sc_per_vl * num_vls; i++)
 		sc_free(dd->kernel_send_context[i + 1]);
 
+	free_percpu(dd->pio_cpu_map);
+	dd->pio_cpu_map = NULL;
 	kfree(dd->kernel_send_context);
 	dd->kernel_send_context = NULL;
 
@@ -2174,6 +2399,9 @@ void seqfile_dump_sci(struct seq_file *s, u32 i,
 		   sc->fill, sc->free, sc->fill_wrap, sc->alloc_free);
 	seq_printf(s, "  credit_intr_count %u credit_ctrl 0x%llx\n",
 		   sc->credit_intr_count, sc->credit_ctrl);
+	seq_printf(s, "  credit_stalls %u credit_polls %u credit_poll_hits %u ret_batch %u\n",
+		   sc->credit_stalls, sc->credit_polls, sc->credit_poll_hits,
+		   sc->ret_batch);
 	reg = read_kctxt_csr(sc->dd, sc->hw_context, SC(CREDIT_STATUS));
 	seq_printf(s, "  *hw_free %llu CurrentFree %llu LastReturned %llu\n",
 		   (le64_to_cpu(*sc->hw_free) & CR_COUNTER_SMASK) >>
@@ -116,13 +116,18 @@ struct send_context {
 	u32 sr_head;			/* shadow ring head */
 	unsigned long fill;		/* official alloc count */
 	unsigned long alloc_free;	/* copy of free (less cache thrash) */
+	u32 alloc_ret_batch;		/* copy of ret_batch, with alloc_free */
 	u32 fill_wrap;			/* tracks fill within ring */
 	u32 credits;			/* number of blocks in context */
+	u32 credit_stalls;		/* allocs that ran out of credits */
+	u32 credit_polls;		/* early looks at hw_free */
+	u32 credit_poll_hits;		/* ... that found returned credits */
 	/* adding a new field here would make it part of this cacheline */
 
 	/* releaser fields */
 	spinlock_t release_lock ____cacheline_aligned_in_smp;
 	u32 sr_tail;			/* shadow ring tail */
+	u32 ret_batch;			/* EWMA of credits per return */
 	unsigned long free;		/* official free count */
 	volatile __le64 *hw_free;	/* HW free counter */
 	/* list for PIO waiters */
@@ -134,6 +139,10 @@ struct send_context {
 	u64 credit_ctrl;		/* cache for credit control */
 	wait_queue_head_t halt_wait;    /* wait until kernel sees interrupt */
 	struct work_struct halt_work;	/* halted context work queue entry */
+
+	/* CPUs steered to this kernel context, see pio_cpu_map */
+	struct cpumask cpu_mask;
+	struct kobject kobj;
 };
 
 /* send context flags */
@@ -231,6 +240,9 @@ struct sc_config_sizes {
 
 /* Initial number of send contexts per VL */
 #define INIT_SC_PER_VL 2
+#define MAX_SC_PER_VL 8
+
+extern uint pio_sc_per_vl;
 
 /*
  * struct pio_map_elem - mapping for a vl
@@ -266,6 +278,19 @@ struct pio_vl_map {
 	struct pio_map_elem *map[0];
 };
 
+/*
+ * struct pio_cpu_map - per CPU kernel send context override
+ * @ksc - send context for each data vl, NULL to use the pio_vl_map
+ *
+ * Filled from the cpu_list sysfs file of each kernel send context so
+ * that senders on different CPUs use different contexts and
+ * never share an alloc_lock.  Entries are read without locking; the
+ * send contexts they point to live as long as the device.
+ */
+struct pio_cpu_map {
+	struct send_context *ksc[OPA_MAX_VLS];
+};
+
 int pio_map_init(struct hfi1_devdata *dd, u8 port, u8 num_vls,
 		 u8 *vl_scontexts);
 void free_pio_map(struct hfi1_devdata *dd);
@@ -273,6 +298,11 @@ struct send_context *pio_select_send_context_vl(struct hfi1_devdata *dd,
 						u32 selector, u8 vl);
 struct send_context *pio_select_send_context_sc(struct hfi1_devdata *dd,
 						u32 selector, u8 sc5);
+struct send_context *pio_cpu_send_context(struct send_context *sc, u8 sc5);
+int pio_sc_get_vl(struct send_context *sc);
+ssize_t pio_get_cpu_to_sc_map(struct send_context *sc, char *buf);
+ssize_t pio_set_cpu_to_sc_map(struct send_context *sc, const char *buf,
+			      size_t count);
 
 /* send context functions */
 int init_credit_return(struct hfi1_devdata *dd);
@@ -324,6 +354,7 @@ void __cm_reset(struct hfi1_devdata *dd, u64 sendctrl);
 void pio_send_control(struct hfi1_devdata *dd, int op);
 
 /* PIO copy routines */
+void pio_copy_init(void);
 void pio_copy(struct hfi1_devdata *dd, struct pio_buf *pbuf, u64 pbc,
 	      const void *from, size_t count);
 void seg_pio_copy_start(struct pio_buf *pbuf, u64 pbc,
@@ -45,6 +45,12 @@
  *
  */
 
+#include <linux/module.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
 #include "hfi.h"
 
 /* additive distance between non-SOP and SOP space */
@@ -53,6 +59,103 @@
 /* number of QUADWORDs in a block */
 #define PIO_BLOCK_QWS (PIO_BLOCK_SIZE / sizeof(u64))
 
+static bool pio_wide_copy;
+module_param(pio_wide_copy, bool, S_IRUGO);
+MODULE_PARM_DESC(pio_wide_copy, "Write whole PIO blocks with AVX2/AVX-512 stores if the CPU has them, default: off");
+
+/* block store flavors, picked by pio_copy_init() */
+#define PIO_WIDE_NONE   0
+#define PIO_WIDE_AVX2   1
+#define PIO_WIDE_AVX512 2
+
+#ifdef CONFIG_X86_64
+static int pio_wide __read_mostly;
+
+/**
+ * pio_copy_init - pick the PIO block store flavor
+ *
+ * Whole 64 byte blocks are written with one AVX-512 or two AVX2
+ * non-temporal stores so each block leaves the write-combining buffer as
+ * a single full line.  The writeq() loops stay as the fallback.
+ */
+void pio_copy_init(void)
+{
+	if (!pio_wide_copy)
+		return;
+
+	if (boot_cpu_has(X86_FEATURE_AVX512F) &&
+	    cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+			      XFEATURE_MASK_AVX512, NULL))
+		pio_wide = PIO_WIDE_AVX512;
+	else if (boot_cpu_has(X86_FEATURE_AVX2) &&
+		 cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM,
+				   NULL))
+		pio_wide = PIO_WIDE_AVX2;
+}
+
+/*
+ * Write one block from @from to the block aligned @dest.  Must be called
+ * between pio_wide_begin() and pio_wide_end().
+ */
+static inline void pio_wide_block(void __iomem *dest, const void *from)
+{
+	if (pio_wide == PIO_WIDE_AVX512)
+		asm volatile("vmovdqu64 (%1), %%zmm0\n\t"
+			     "vmovntdq %%zmm0, (%0)\n\t"
+			     : : "r" (dest), "r" (from) : "memory");
+	else
+		asm volatile("vmovdqu (%1), %%ymm0\n\t"
+			     "vmovdqu 32(%1), %%ymm1\n\t"
+			     "vmovntdq %%ymm0, (%0)\n\t"
+			     "vmovntdq %%ymm1, 32(%0)\n\t"
+			     : : "r" (dest), "r" (from) : "memory");
+}
+
+static inline bool pio_wide_usable(void)
+{
+	return pio_wide != PIO_WIDE_NONE && irq_fpu_usable();
+}
+
+static inline void pio_wide_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static inline void pio_wide_end(void)
+{
+	kernel_fpu_end();
+}
+
+static void pio_copy_wide(struct pio_buf *pbuf, u64 pbc,
+			  const void *from, size_t count);
+#else
+void pio_copy_init(void)
+{
+}
+
+static inline void pio_wide_block(void __iomem *dest, const void *from)
+{
+}
+
+static inline bool pio_wide_usable(void)
+{
+	return false;
+}
+
+static inline void pio_copy_wide(struct pio_buf *pbuf, u64 pbc,
+				 const void *from, size_t count)
+{
+}
+
+static inline void pio_wide_begin(void)
+{
+}
+
+static inline void pio_wide_end(void)
+{
+}
+#endif /* CONFIG_X86_64 */
+
 /**
  * pio_copy - copy data block to MMIO space
  * @pbuf: a number of blocks allocated within a PIO send context
@@ -60,7 +163,8 @@
  * @from: source, must be 8 byte aligned
  * @count: number of DWORD (32-bit) quantities to copy from source
  *
- * Copy data from source to PIO Send Buffer memory, 8 bytes at a time.
+ * Copy data from source to PIO Send Buffer memory, 8 bytes at a time,
+ * or a block at a time if pio_copy_init() found wide stores.
  * Must always write full BLOCK_SIZE bytes blocks.  The first block must
  * be written to the corresponding SOP=1 address.
  *
@@ -75,6 +179,11 @@ void pio_copy(struct hfi1_devdata *dd, struct pio_buf *pbuf, u64 pbc,
 	void __iomem *send = dest + PIO_BLOCK_SIZE;
 	void __iomem *dend;			/* 8-byte data end */
 
+	if (pio_wide_usable()) {
+		pio_copy_wide(pbuf, pbc, from, count);
+		goto done;
+	}
+
 	/* write the PBC */
 	writeq(pbc, dest);
 	dest += sizeof(u64);
@@ -160,11 +269,61 @@ void pio_copy(struct hfi1_devdata *dd, struct pio_buf *pbuf, u64 pbc,
 		dest += sizeof(u64);
 	}
 
+done:
 	/* finished with this buffer */
 	this_cpu_dec(*pbuf->sc->buffers_allocated);
 	preempt_enable();
 }
 
+#ifdef CONFIG_X86_64
+/*
+ * pio_copy() with whole block stores.  The packet is the PBC followed by
+ * count DWORDs, zero padded to the end of its last block, so partial
+ * blocks are staged on the stack and full blocks stored straight from
+ * the source.
+ */
+static void pio_copy_wide(struct pio_buf *pbuf, u64 pbc,
+			  const void *from, size_t count)
+{
+	u64 blk[PIO_BLOCK_QWS] __aligned(PIO_BLOCK_SIZE);
+	void __iomem *dest;
+	size_t nbytes = count << 2;
+	size_t n;
+
+	pio_wide_begin();
+
+	/* SOP block: the PBC and the first 56 bytes */
+	n = min_t(size_t, nbytes, PIO_BLOCK_SIZE - sizeof(u64));
+	blk[0] = pbc;
+	memcpy(&blk[1], from, n);
+	memset((u8 *)&blk[1] + n, 0, PIO_BLOCK_SIZE - sizeof(u64) - n);
+	pio_wide_block(pbuf->start + SOP_DISTANCE, blk);
+	from += n;
+	nbytes -= n;
+
+	/* the rest is in SOP=0 space and can only wrap at a block */
+	dest = pbuf->start + PIO_BLOCK_SIZE;
+	while (nbytes) {
+		if (dest >= pbuf->end)
+			dest -= pbuf->sc->size;
+		if (nbytes >= PIO_BLOCK_SIZE) {
+			pio_wide_block(dest, from);
+			n = PIO_BLOCK_SIZE;
+		} else {
+			n = nbytes;
+			memcpy(blk, from, n);
+			memset((u8 *)blk + n, 0, PIO_BLOCK_SIZE - n);
+			pio_wide_block(dest, blk);
+		}
+		from += n;
+		nbytes -= n;
+		dest += PIO_BLOCK_SIZE;
+	}
+
+	pio_wide_end();
+}
+#endif /* CONFIG_X86_64 */
+
 /*
  * Handle carry bytes using shifts and masks.
  *
@@ -589,6 +748,21 @@ static void mid_copy_straight(struct pio_buf *pbuf,
 	}
 
 	/* write 8-byte non-SOP, non-wrap chunk data */
+	if (dend - dest >= 2 * PIO_BLOCK_SIZE && pio_wide_usable()) {
+		/* up to a block boundary, then whole blocks */
+		while (((unsigned long)dest & PIO_BLOCK_MASK) != 0) {
+			writeq(*(u64 *)from, dest);
+			from += sizeof(u64);
+			dest += sizeof(u64);
+		}
+		pio_wide_begin();
+		while (dend - dest >= PIO_BLOCK_SIZE) {
+			pio_wide_block(dest, from);
+			from += PIO_BLOCK_SIZE;
+			dest += PIO_BLOCK_SIZE;
+		}
+		pio_wide_end();
+	}
 	while (dest < dend) {
 		writeq(*(u64 *)from, dest);
 		from += sizeof(u64);
@@ -271,7 +271,7 @@ void hfi1_modify_qp(struct rvt_qp *qp, struct ib_qp_attr *attr,
 
 	if (attr_mask & IB_QP_AV) {
 		priv->s_sc = ah_to_sc(ibqp->device, &qp->remote_ah_attr);
-		priv->s_sde = qp_to_sdma_engine(qp, priv->s_sc);
+		priv->s_sde = qp_pick_sdma_engine(qp, priv->s_sc);
 		priv->s_sendcontext = qp_to_send_context(qp, priv->s_sc);
 		qp_set_16b(qp);
 	}
@@ -281,7 +281,7 @@ void hfi1_modify_qp(struct rvt_qp *qp, struct ib_qp_attr *attr,
 	    qp->s_mig_state == IB_MIG_ARMED) {
 		qp->s_flags |= HFI1_S_AHG_CLEAR;
 		priv->s_sc = ah_to_sc(ibqp->device, &qp->remote_ah_attr);
-		priv->s_sde = qp_to_sdma_engine(qp, priv->s_sc);
+		priv->s_sde = qp_pick_sdma_engine(qp, priv->s_sc);
 		priv->s_sendcontext = qp_to_send_context(qp, priv->s_sc);
 		qp_set_16b(qp);
 	}
@@ -541,18 +541,46 @@ static void iowait_wakeup(struct iowait *wait, int reason)
 	hfi1_qp_wakeup(qp, RVT_S_WAIT_DMA_DESC);
 }
 
+/*
+ * A connected QP with nothing outstanding on its send engine can move to
+ * a less loaded one without reordering its packets, unless the send
+ * engine is building packets for the current one right now.  The QP
+ * s_lock must be held.
+ */
+static void qp_rebalance_sdma_engine(struct rvt_qp *qp)
+{
+	struct hfi1_qp_priv *priv = qp->priv;
+	struct sdma_engine *sde;
+
+	if ((qp->ibqp.qp_type != IB_QPT_RC &&
+	     qp->ibqp.qp_type != IB_QPT_UC) ||
+	    !priv->s_sde ||
+	    (qp->s_flags & RVT_S_BUSY) || (priv->s_flags & RVT_S_BUSY) ||
+	    iowait_sdma_pending(&priv->s_iowait))
+		return;
+
+	sde = qp_pick_sdma_engine(qp, priv->s_sc);
+	if (sde && sde != priv->s_sde) {
+		/* the AHG entry belongs to the old engine */
+		clear_ahg(qp);
+		priv->s_sde = sde;
+	}
+}
+
 static void iowait_sdma_drained(struct iowait *wait)
 {
 	struct rvt_qp *qp = iowait_to_qp(wait);
 	unsigned long flags;
 
+	spin_lock_irqsave(&qp->s_lock, flags);
+	if (sdma_load_balance)
+		qp_rebalance_sdma_engine(qp);
 	/*
 	 * This happens when the send engine notes
 	 * a QP in the error state and cannot
 	 * do the flush work until that QP's
 	 * sdma work has finished.
 	 */
-	spin_lock_irqsave(&qp->s_lock, flags);
 	if (qp->s_flags & RVT_S_WAIT_DMA) {
 		qp->s_flags &= ~RVT_S_WAIT_DMA;
 		hfi1_schedule_send(qp);
@@ -596,6 +624,30 @@ struct sdma_engine *qp_to_sdma_engine(struct rvt_qp *qp, u8 sc5)
 	return sde;
 }
 
+/*
+ * qp_pick_sdma_engine - (re)select the send engine a qp sends on
+ * @qp: the QP
+ * @sc5: the 5 bit sc
+ *
+ * Like qp_to_sdma_engine(), but lets sdma_select_engine_lb() move the
+ * qp to a less loaded engine once it has no SDMA outstanding.
+ *
+ * Return:
+ * A send engine for the qp or NULL for SMI type qp.
+ */
+struct sdma_engine *qp_pick_sdma_engine(struct rvt_qp *qp, u8 sc5)
+{
+	struct hfi1_devdata *dd = dd_from_ibdev(qp->ibqp.device);
+	struct hfi1_qp_priv *priv = qp->priv;
+
+	if (!(dd->flags & HFI1_HAS_SEND_DMA) ||
+	    qp->ibqp.qp_type == IB_QPT_SMI)
+		return NULL;
+	return sdma_select_engine_lb(dd, qp->ibqp.qp_num >> dd->qos_shift,
+				     sc_to_vlt(dd, sc5), priv->s_sde,
+				     !iowait_sdma_pending(&priv->s_iowait));
+}
+
 /*
  * qp_to_send_context - map a qp to a send context
  * @qp: the QP
@@ -766,6 +818,14 @@ void qp_priv_free(struct rvt_dev_info *rdi, struct rvt_qp *qp)
 {
 	struct hfi1_qp_priv *priv = qp->priv;
 
+	/* rcd is only set once hfi1_qp_priv_init() counted the QP */
+	if (priv->rcd && hfi1_qp_uses_krcv_map(qp)) {
+		struct hfi1_devdata *dd = dd_from_ibdev(qp->ibqp.device);
+
+		mutex_lock(&dd->rmt_mutex);
+		dd->krcv_map_qps--;
+		mutex_unlock(&dd->rmt_mutex);
+	}
 	hfi1_qp_priv_tid_free(rdi, qp);
 	kfree(priv->s_ahg);
 	kfree(priv);
@@ -849,7 +909,7 @@ void hfi1_migrate_qp(struct rvt_qp *qp)
 	qp->s_pkey_index = qp->s_alt_pkey_index;
 	qp->s_flags |= HFI1_S_AHG_CLEAR;
 	priv->s_sc = ah_to_sc(qp->ibqp.device, &qp->remote_ah_attr);
-	priv->s_sde = qp_to_sdma_engine(qp, priv->s_sc);
+	priv->s_sde = qp_pick_sdma_engine(qp, priv->s_sc);
 	qp_set_16b(qp);
 
 	ev.device = qp->ibqp.device;
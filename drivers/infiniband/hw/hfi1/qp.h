@@ -98,6 +98,17 @@ static inline int hfi1_send_ok(struct rvt_qp *qp)
 		 !(qp->s_flags & RVT_S_ANY_WAIT_SEND));
 }
 
+/*
+ * True for the QPs whose receive context, picked from the QPN map at
+ * creation, backs their TID RDMA and busy poll state.  QP0, QP1 and the
+ * netdev (AIP) QPs don't use it that way.
+ */
+static inline bool hfi1_qp_uses_krcv_map(struct rvt_qp *qp)
+{
+	return qp->ibqp.qp_num > 1 &&
+		(qp->ibqp.qp_num & RVT_AIP_QP_PREFIX_MASK) != RVT_AIP_QP_BASE;
+}
+
 /*
  * Driver specific s_flags starting at bit 31 down to HFI1_S_MIN_BIT_MASK
  *
@@ -154,6 +165,7 @@ struct ib_qp *hfi1_create_qp(struct ib_pd *ibpd,
 void hfi1_qp_wakeup(struct rvt_qp *qp, u32 flag);
 
 struct sdma_engine *qp_to_sdma_engine(struct rvt_qp *qp, u8 sc5);
+struct sdma_engine *qp_pick_sdma_engine(struct rvt_qp *qp, u8 sc5);
 struct send_context *qp_to_send_context(struct rvt_qp *qp, u8 sc5);
 
 void qp_iter_print(struct seq_file *s, struct rvt_qp_iter *iter);
@@ -472,6 +472,8 @@ bool hfi1_schedule_send_yield(struct rvt_qp *qp, struct hfi1_pkt_state *ps,
 	ps->pkts_sent = true;
 
 	if (unlikely(time_after(jiffies, ps->timeout))) {
+		/* don't sit on a doorbell across a yield */
+		sdma_batch_commit(&ps->batch);
 		if (!ps->in_thread ||
 		    workqueue_congested(ps->cpu, ps->ppd->hfi1_wq)) {
 			spin_lock_irqsave(&qp->s_lock, ps->flags);
@@ -586,6 +588,7 @@ void hfi1_do_send(struct rvt_qp *qp, bool in_thread)
 	ps.cpu = priv->s_sde ? priv->s_sde->cpu :
 			cpumask_first(cpumask_of_node(ps.ppd->dd->node));
 	ps.pkts_sent = false;
+	sdma_batch_begin(&ps.batch);
 
 	/* insure a pre-built packet is handled  */
 	ps.s_txreq = get_waiting_verbs_txreq(ps.wait);
@@ -600,8 +603,10 @@ void hfi1_do_send(struct rvt_qp *qp, bool in_thread)
 			 * If the packet cannot be sent now, return and
 			 * the send engine will be woken up later.
 			 */
-			if (hfi1_verbs_send(qp, &ps))
+			if (hfi1_verbs_send(qp, &ps)) {
+				sdma_batch_commit(&ps.batch);
 				return;
+			}
 
 			/* allow other tasks to run */
 			if (hfi1_schedule_send_yield(qp, &ps, false))
@@ -612,4 +617,5 @@ void hfi1_do_send(struct rvt_qp *qp, bool in_thread)
 	} while (make_req(qp, &ps));
 	iowait_starve_clear(ps.pkts_sent, &priv->s_iowait);
 	spin_unlock_irqrestore(&qp->s_lock, ps.flags);
+	sdma_batch_commit(&ps.batch);
 }
@@ -65,7 +65,6 @@
 /* must be a power of 2 >= 64 <= 32768 */
 #define SDMA_DESCQ_CNT 2048
 #define SDMA_DESC_INTR 64
-#define INVALID_TAIL 0xffff
 #define SDMA_PAD max_t(size_t, MAX_16B_PADDING, sizeof(u32))
 
 static uint sdma_descq_cnt = SDMA_DESCQ_CNT;
@@ -84,6 +83,19 @@ static uint sdma_desct_intr = SDMA_DESC_INTR;
 module_param_named(desct_intr, sdma_desct_intr, uint, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(desct_intr, "Number of SDMA descriptor before interrupt");
 
+bool sdma_load_balance;
+module_param(sdma_load_balance, bool, S_IRUGO);
+MODULE_PARM_DESC(sdma_load_balance,
+		 "Pick the least loaded SDMA engine of a VL when a flow drains");
+
+static bool sdma_hist;
+module_param(sdma_hist, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sdma_hist,
+		 "Collect SDMA latency, depth and sleep histograms");
+
+/* keep a per-engine idle delay well inside the reload count CSR */
+#define SDMA_IDLE_NS_MAX (64 * NSEC_PER_USEC)
+
 #define SDMA_WAIT_BATCH_SIZE 20
 /* max wait time for a SDMA engine to indicate it has halted */
 #define SDMA_ERR_HALT_TIMEOUT 10 /* ms */
@@ -362,6 +374,11 @@ static inline void sdma_set_desc_cnt(struct sdma_engine *sde, unsigned cnt)
 	write_sde_csr(sde, SD(DESC_CNT), reg);
 }
 
+static inline u32 sdma_hist_bucket(u64 val)
+{
+	return val ? min_t(u32, ilog2(val), SDMA_HIST_BUCKETS - 1) : 0;
+}
+
 static inline void complete_tx(struct sdma_engine *sde,
 			       struct sdma_txreq *tx,
 			       int res)
@@ -370,6 +387,10 @@ static inline void complete_tx(struct sdma_engine *sde,
 	struct iowait *wait = tx->wait;
 	callback_t complete = tx->complete;
 
+	if (sdma_hist && tx->submit_ns && res == SDMA_TXREQ_S_OK)
+		sde->hist.lat[sdma_hist_bucket(ktime_get_ns() -
+					       tx->submit_ns)]++;
+
 #ifdef CONFIG_HFI1_DEBUG_SDMA_ORDER
 	trace_hfi1_sdma_out_sn(sde, tx->sn);
 	if (WARN_ON_ONCE(sde->head_sn != tx->sn))
@@ -384,6 +405,19 @@ static inline void complete_tx(struct sdma_engine *sde,
 		iowait_drain_wakeup(wait);
 }
 
+/*
+ * Producers fill the descriptors they reserved outside tail_lock.
+ * Anyone taking tail_lock to change the engine state or walk the ring
+ * must let those reservations commit first.  No new ones can be made
+ * while tail_lock is held and fillers run with interrupts off, so the
+ * wait is short.
+ */
+static inline void sdma_wait_reservations(struct sdma_engine *sde)
+{
+	while (smp_load_acquire(&sde->descq_committed) != sde->descq_tail)
+		cpu_relax();
+}
+
 /*
  * Complete all the sdma requests with a SDMA_TXREQ_S_ABORTED status
  *
@@ -526,6 +560,7 @@ static void sdma_err_progress_check(struct timer_list *t)
 		 * the same lock on same CPU
 		 */
 		spin_lock_irqsave(&curr_sde->tail_lock, flags);
+		sdma_wait_reservations(curr_sde);
 		write_seqlock(&curr_sde->head_lock);
 
 		/* skip non-running queues */
@@ -611,6 +646,7 @@ static void sdma_sw_clean_up_task(unsigned long opaque)
 	unsigned long flags;
 
 	spin_lock_irqsave(&sde->tail_lock, flags);
+	sdma_wait_reservations(sde);
 	write_seqlock(&sde->head_lock);
 
 	/*
@@ -642,6 +678,7 @@ static void sdma_sw_clean_up_task(unsigned long opaque)
 	 * clean up.
 	 */
 	sde->descq_tail = 0;
+	sde->descq_committed = 0;
 	sde->descq_head = 0;
 	sde->desc_avail = sdma_descq_freecnt(sde);
 	*sde->head_dma = 0;
@@ -831,6 +868,105 @@ struct sdma_engine *sdma_select_engine_sc(
 	return sdma_select_engine_vl(dd, selector, vl);
 }
 
+/*
+ * sdma_lb_less() - true if engine @a is expected to drain before @b
+ *
+ * The estimate is the number of descriptors in flight divided by the
+ * recent retire rate, compared by cross multiplying.  Engines that are
+ * not running are never preferred.
+ */
+static bool sdma_lb_less(struct sdma_engine *a, struct sdma_engine *b)
+{
+	u64 load_a, load_b;
+
+	if (!__sdma_running(a))
+		return false;
+	if (!__sdma_running(b))
+		return true;
+	load_a = (u64)sdma_descq_inprocess(a) * (READ_ONCE(b->lb_rate) + 1);
+	load_b = (u64)sdma_descq_inprocess(b) * (READ_ONCE(a->lb_rate) + 1);
+	return load_a < load_b;
+}
+
+/**
+ * sdma_select_engine_lb() - select sdma engine by load
+ * @dd: devdata
+ * @selector: a spreading factor
+ * @vl: this vl
+ * @cur: engine the flow is currently using, or NULL
+ * @drained: the flow has nothing outstanding on @cur
+ *
+ * Without the sdma_load_balance module parameter this is
+ * sdma_select_engine_vl().  Otherwise a drained flow is moved to the
+ * engine of the vl map element with the shortest expected drain time,
+ * preferring the static choice on ties.  A flow that still has work
+ * outstanding stays on @cur so its packets are not reordered; if @cur
+ * serves a different vl the static mapping is used, just as it would
+ * be without load balancing.
+ */
+struct sdma_engine *sdma_select_engine_lb(struct hfi1_devdata *dd,
+					  u32 selector, u8 vl,
+					  struct sdma_engine *cur,
+					  bool drained)
+{
+	struct sdma_vl_map *m;
+	struct sdma_map_elem *e;
+	struct sdma_engine *rval, *sde;
+	u32 i;
+
+	if (!sdma_load_balance || vl >= num_vls)
+		return sdma_select_engine_vl(dd, selector, vl);
+
+	rcu_read_lock();
+	m = rcu_dereference(dd->sdma_map);
+	if (unlikely(!m)) {
+		rcu_read_unlock();
+		return &dd->per_sdma[0];
+	}
+	if (cur && !drained && m->engine_to_vl[cur->this_idx] == vl) {
+		rcu_read_unlock();
+		return cur;
+	}
+	e = m->map[vl & m->mask];
+	rval = e->sde[selector & e->mask];
+	if (drained) {
+		for (i = 1; i <= e->mask; i++) {
+			sde = e->sde[(selector + i) & e->mask];
+			if (sdma_lb_less(sde, rval))
+				rval = sde;
+		}
+	}
+	rcu_read_unlock();
+
+	trace_hfi1_sdma_engine_select(dd, selector, vl, rval->this_idx);
+	return rval;
+}
+
+/*
+ * sdma_lb_sample() - fold retired descriptors into the engine's rate
+ *
+ * Called with head_lock held.  The rate is sampled at most once per
+ * jiffy and smoothed with a 1/4 weight EWMA.
+ */
+static void sdma_lb_sample(struct sdma_engine *sde, int progress)
+{
+	unsigned long elapsed = jiffies - sde->lb_stamp;
+
+	sde->lb_retired += progress;
+	if (!elapsed)
+		return;
+	if (elapsed > HZ) {
+		/* idle for a while, start over */
+		WRITE_ONCE(sde->lb_rate, sde->lb_retired);
+	} else {
+		u32 sample = sde->lb_retired / elapsed;
+
+		WRITE_ONCE(sde->lb_rate, (3 * sde->lb_rate + sample) / 4);
+	}
+	sde->lb_retired = 0;
+	sde->lb_stamp = jiffies;
+}
+
 struct sdma_rht_map_elem {
 	u32 mask;
 	u8 ctr;
@@ -860,14 +996,19 @@ static const struct rhashtable_params sdma_rht_params = {
  * @dd: devdata
  * @selector: a spreading factor
  * @vl: this vl
+ * @cur: engine the queue last used for @vl, or NULL
+ * @drained: the queue has no other requests outstanding
  *
  * This function returns an sdma engine for a user sdma request.
  * User defined sdma engine affinity setting is honored when applicable,
  * otherwise system default sdma engine mapping is used. To ensure correct
- * ordering, the mapping from <selector, vl> to sde must remain unchanged.
+ * ordering, the mapping from <selector, vl> to sde must remain unchanged
+ * while requests are outstanding; see sdma_select_engine_lb().
  */
 struct sdma_engine *sdma_select_user_engine(struct hfi1_devdata *dd,
-					    u32 selector, u8 vl)
+					    u32 selector, u8 vl,
+					    struct sdma_engine *cur,
+					    bool drained)
 {
 	struct sdma_rht_node *rht_node;
 	struct sdma_engine *sde = NULL;
@@ -896,7 +1037,7 @@ struct sdma_engine *sdma_select_user_engine(struct hfi1_devdata *dd,
 		return sde;
 
 out:
-	return sdma_select_engine_vl(dd, selector, vl);
+	return sdma_select_engine_lb(dd, selector, vl, cur, drained);
 }
 
 static void sdma_populate_sde_map(struct sdma_rht_map_elem *map)
@@ -1100,6 +1241,75 @@ ssize_t sdma_get_cpu_to_sde_map(struct sdma_engine *sde, char *buf)
 	return strnlen(buf, PAGE_SIZE);
 }
 
+/*
+ * Completion interrupt coalescing.  With the SDMA idle timeout enabled,
+ * descriptors only ask for the head to be written back and interrupts
+ * come from the descriptor count (every desct_intr descriptors
+ * retired) and from the idle timer (idle_ns after the engine goes
+ * idle).  Both are tunable per engine; raising them trades completion
+ * latency for fewer interrupts on bulk streams.  Without the idle
+ * timeout every txreq requests its own interrupt and there is nothing
+ * to coalesce.
+ */
+ssize_t sdma_get_desct_intr(struct sdma_engine *sde, char *buf)
+{
+	u16 cnt = READ_ONCE(sde->desct_intr);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", cnt ?: sdma_desct_intr);
+}
+
+/*
+ * A value of 0 returns the engine to the desct_intr module parameter.
+ * The new count takes effect when the engine next interrupts.
+ */
+ssize_t sdma_set_desct_intr(struct sdma_engine *sde, const char *buf,
+			    size_t count)
+{
+	unsigned long flags;
+	u16 cnt;
+	int ret;
+
+	if (!(sde->dd->flags & HFI1_HAS_SDMA_TIMEOUT))
+		return -EOPNOTSUPP;
+	ret = kstrtou16(buf, 0, &cnt);
+	if (ret)
+		return ret;
+
+	write_seqlock_irqsave(&sde->head_lock, flags);
+	sde->desct_intr = cnt;
+	write_sequnlock_irqrestore(&sde->head_lock, flags);
+	return count;
+}
+
+ssize_t sdma_get_idle_ns(struct sdma_engine *sde, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			cclock_to_ns(sde->dd, READ_ONCE(sde->idle_cnt)));
+}
+
+ssize_t sdma_set_idle_ns(struct sdma_engine *sde, const char *buf,
+			 size_t count)
+{
+	unsigned long flags;
+	u32 ns;
+	int ret;
+
+	if (!(sde->dd->flags & HFI1_HAS_SDMA_TIMEOUT))
+		return -EOPNOTSUPP;
+	ret = kstrtou32(buf, 0, &ns);
+	if (ret)
+		return ret;
+	/* zero would stop the idle interrupt and strand completions */
+	if (!ns || ns > SDMA_IDLE_NS_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&sde->tail_lock, flags);
+	sde->idle_cnt = ns_to_cclock(sde->dd, ns);
+	write_sde_csr(sde, SD(RELOAD_CNT), sde->idle_cnt);
+	spin_unlock_irqrestore(&sde->tail_lock, flags);
+	return count;
+}
+
 static void sdma_rht_free(void *ptr, void *arg)
 {
 	struct sdma_rht_node *rht_node = ptr;
@@ -1441,6 +1651,7 @@ int sdma_init(struct hfi1_devdata *dd, u8 port)
 			     sde->idle_mask;
 
 		spin_lock_init(&sde->tail_lock);
+		spin_lock_init(&sde->commit_lock);
 		seqlock_init(&sde->head_lock);
 		spin_lock_init(&sde->senddmactrl_lock);
 		spin_lock_init(&sde->flushlist_lock);
@@ -1773,6 +1984,7 @@ static void sdma_desc_avail(struct sdma_engine *sde, uint avail)
 	struct iowait *wait, *nw, *twait;
 	struct iowait *waits[SDMA_WAIT_BATCH_SIZE];
 	uint i, n = 0, seq, tidx = 0;
+	u64 now = 0;
 
 #ifdef CONFIG_SDMA_VERBOSITY
 	dd_dev_err(sde->dd, "CONFIG SDMA(%u) %s:%d %s()\n", sde->this_idx,
@@ -1780,6 +1992,9 @@ static void sdma_desc_avail(struct sdma_engine *sde, uint avail)
 	dd_dev_err(sde->dd, "avail: %u\n", avail);
 #endif
 
+	if (sdma_hist)
+		now = ktime_get_ns();
+
 	do {
 		seq = read_seqbegin(&sde->waitlock);
 		if (!list_empty(&sde->dmawait)) {
@@ -1812,6 +2027,10 @@ static void sdma_desc_avail(struct sdma_engine *sde, uint avail)
 								       tidx);
 				}
 				list_del_init(&wait->list);
+				if (wait->sleep_ns && now)
+					sde->hist.sleep[sdma_hist_bucket(
+						now - wait->sleep_ns)]++;
+				wait->sleep_ns = 0;
 				waits[n++] = wait;
 			}
 			write_sequnlock(&sde->waitlock);
@@ -1885,8 +2104,11 @@ retry:
 	}
 
 	sde->last_status = status;
-	if (progress)
+	if (progress) {
+		if (sdma_load_balance)
+			sdma_lb_sample(sde, progress);
 		sdma_desc_avail(sde, sdma_descq_freecnt(sde));
+	}
 }
 
 /*
@@ -1902,7 +2124,7 @@ void sdma_engine_interrupt(struct sdma_engine *sde, u64 status)
 {
 	trace_hfi1_sdma_engine_interrupt(sde, status);
 	write_seqlock(&sde->head_lock);
-	sdma_set_desc_cnt(sde, sdma_desct_intr);
+	sdma_set_desc_cnt(sde, sde->desct_intr ?: sdma_desct_intr);
 	if (status & sde->idle_mask)
 		sde->idle_int_cnt++;
 	else if (status & sde->progress_mask)
@@ -1929,6 +2151,7 @@ void sdma_engine_error(struct sdma_engine *sde, u64 status)
 		   sdma_state_names[sde->state.current_state]);
 #endif
 	spin_lock_irqsave(&sde->tail_lock, flags);
+	sdma_wait_reservations(sde);
 	write_seqlock(&sde->head_lock);
 	if (status & ALL_SDMA_ENG_HALT_ERRS)
 		__sdma_process_event(sde, sdma_event_e60_hw_halted);
@@ -2017,6 +2240,17 @@ static inline void sdma_update_tail(struct sdma_engine *sde, u16 tail)
 	/* Commit writes to memory and advance the tail on the chip */
 	smp_wmb(); /* see get_txhead() */
 	writeq(tail, sde->tail_csr);
+	/* this covers any deferred submissions */
+	sde->tail_deferred = 0;
+}
+
+/* ring the doorbell for deferred submissions, tail_lock must be held */
+static inline void sdma_flush_deferred_tail(struct sdma_engine *sde)
+{
+	spin_lock(&sde->commit_lock);
+	if (sde->tail_deferred)
+		sdma_update_tail(sde, sde->descq_committed & sde->sdma_mask);
+	spin_unlock(&sde->commit_lock);
 }
 
 /*
@@ -2070,6 +2304,7 @@ static void init_sdma_regs(
 	write_sde_csr(sde, SD(BASE_ADDR), sde->descq_phys);
 	sdma_setlengen(sde);
 	sdma_update_tail(sde, 0); /* Set SendDmaTail */
+	sde->idle_cnt = idle_cnt;
 	write_sde_csr(sde, SD(RELOAD_CNT), idle_cnt);
 	write_sde_csr(sde, SD(DESC_CNT), 0);
 	write_sde_csr(sde, SD(HEAD_ADDR), sde->head_phys);
@@ -2205,6 +2440,46 @@ static void dump_sdma_state(struct sdma_engine *sde)
 	}
 }
 
+static void sdma_seqfile_dump_buckets(struct seq_file *s,
+				      struct sdma_engine *sde,
+				      const char *name, u64 *buckets)
+{
+	int i;
+
+	seq_printf(s, "SDE %u %-5s", sde->this_idx, name);
+	for (i = 0; i < SDMA_HIST_BUCKETS; i++)
+		seq_printf(s, " %llu", buckets[i]);
+	seq_putc(s, '\n');
+}
+
+/**
+ * sdma_seqfile_dump_hist() - debugfs dump of sde histograms
+ * @s: seq file
+ * @sde: send dma engine to dump
+ *
+ * One line per histogram, bucket i counts values in [2^i, 2^(i+1)):
+ * lat is submit to complete in ns, depth the descq entries in use at
+ * submit and sleep the time an iowait waited for descriptors in ns.
+ */
+void sdma_seqfile_dump_hist(struct seq_file *s, struct sdma_engine *sde)
+{
+	sdma_seqfile_dump_buckets(s, sde, "lat", sde->hist.lat);
+	sdma_seqfile_dump_buckets(s, sde, "depth", sde->hist.depth);
+	sdma_seqfile_dump_buckets(s, sde, "sleep", sde->hist.sleep);
+}
+
+/**
+ * sdma_hist_reset() - clear the sde histograms
+ * @sde: send dma engine
+ *
+ * The histograms are updated without a common lock, a sample racing
+ * with the reset may survive it.
+ */
+void sdma_hist_reset(struct sdma_engine *sde)
+{
+	memset(&sde->hist, 0, sizeof(sde->hist));
+}
+
 #define SDE_FMT \
 	"SDE %u CPU %d STE %s C 0x%llx S 0x%016llx E 0x%llx T(HW) 0x%llx T(SW) 0x%x H(HW) 0x%llx H(SW) 0x%x H(D) 0x%llx DM 0x%llx GL 0x%llx R 0x%llx LIS 0x%llx AHGI 0x%llx TXT %u TXH %u DT %u DH %u FLNE %d DQF %u SLC 0x%llx\n"
 /**
@@ -2281,12 +2556,12 @@ void sdma_seqfile_dump_sde(struct seq_file *s, struct sdma_engine *sde)
 }
 
 /*
- * add the generation number into
- * the qw1 and return
+ * add the generation number for descriptor
+ * index idx into the qw1 and return
  */
-static inline u64 add_gen(struct sdma_engine *sde, u64 qw1)
+static inline u64 add_gen(struct sdma_engine *sde, u64 qw1, u32 idx)
 {
-	u8 generation = (sde->descq_tail >> sde->sdma_shift) & 3;
+	u8 generation = (idx >> sde->sdma_shift) & 3;
 
 	qw1 &= ~SDMA_DESC1_GENERATION_SMASK;
 	qw1 |= ((u64)generation & SDMA_DESC1_GENERATION_MASK)
@@ -2295,14 +2570,44 @@ static inline u64 add_gen(struct sdma_engine *sde, u64 qw1)
 }
 
 /*
- * This routine submits the indicated tx
+ * This routine reserves ring space for the indicated tx
  *
  * Space has already been guaranteed and
  * tail side of ring is locked.
  *
- * The hardware tail update is done
- * in the caller and that is facilitated
- * by returning the new tail.
+ * The tx is placed on the tx_ring right away,
+ * the head side cannot complete it before the
+ * hardware tail moves past its descriptors.
+ *
+ * Returns the index of the first reserved
+ * descriptor for submit_tx().
+ */
+static inline u32 reserve_tx(struct sdma_engine *sde, struct sdma_txreq *tx)
+{
+	u32 start = sde->descq_tail;
+
+	if (sdma_hist) {
+		tx->submit_ns = ktime_get_ns();
+		sde->hist.depth[sdma_hist_bucket(sdma_descq_inprocess(sde))]++;
+	}
+	sde->descq_tail += tx->num_desc;
+	tx->next_descq_idx = sde->descq_tail & sde->sdma_mask;
+#ifdef CONFIG_HFI1_DEBUG_SDMA_ORDER
+	tx->sn = sde->tail_sn++;
+	trace_hfi1_sdma_in_sn(sde, tx->sn);
+	WARN_ON_ONCE(sde->tx_ring[sde->tx_tail & sde->sdma_mask]);
+#endif
+	sde->tx_ring[sde->tx_tail++ & sde->sdma_mask] = tx;
+	sde->desc_avail -= tx->num_desc;
+	return start;
+}
+
+/*
+ * This routine copies the indicated tx into
+ * the descriptors reserved at idx
+ *
+ * No lock is needed, the reserved slots
+ * belong to the caller until commit_tx().
  *
  * There is special case logic for ahg
  * to not add the generation number for
@@ -2310,19 +2615,20 @@ static inline u64 add_gen(struct sdma_engine *sde, u64 qw1)
  * first descriptor.
  *
  */
-static inline u16 submit_tx(struct sdma_engine *sde, struct sdma_txreq *tx)
+static inline void submit_tx(struct sdma_engine *sde, struct sdma_txreq *tx,
+			     u32 idx)
 {
 	int i;
 	u16 tail;
 	struct sdma_desc *descp = tx->descp;
 	u8 skip = 0, mode = ahg_mode(tx);
 
-	tail = sde->descq_tail & sde->sdma_mask;
+	tail = idx & sde->sdma_mask;
 	sde->descq[tail].qw[0] = cpu_to_le64(descp->qw[0]);
-	sde->descq[tail].qw[1] = cpu_to_le64(add_gen(sde, descp->qw[1]));
+	sde->descq[tail].qw[1] = cpu_to_le64(add_gen(sde, descp->qw[1], idx));
 	trace_hfi1_sdma_descriptor(sde, descp->qw[0], descp->qw[1],
 				   tail, &sde->descq[tail]);
-	tail = ++sde->descq_tail & sde->sdma_mask;
+	tail = ++idx & sde->sdma_mask;
 	descp++;
 	if (mode > SDMA_AHG_APPLY_UPDATE1)
 		skip = mode >> 1;
@@ -2336,22 +2642,39 @@ static inline u16 submit_tx(struct sdma_engine *sde, struct sdma_txreq *tx)
 			skip--;
 		} else {
 			/* replace generation with real one for non-edits */
-			qw1 = add_gen(sde, descp->qw[1]);
+			qw1 = add_gen(sde, descp->qw[1], idx);
 		}
 		sde->descq[tail].qw[1] = cpu_to_le64(qw1);
 		trace_hfi1_sdma_descriptor(sde, descp->qw[0], qw1,
 					   tail, &sde->descq[tail]);
-		tail = ++sde->descq_tail & sde->sdma_mask;
+		tail = ++idx & sde->sdma_mask;
 	}
-	tx->next_descq_idx = tail;
-#ifdef CONFIG_HFI1_DEBUG_SDMA_ORDER
-	tx->sn = sde->tail_sn++;
-	trace_hfi1_sdma_in_sn(sde, tx->sn);
-	WARN_ON_ONCE(sde->tx_ring[sde->tx_tail & sde->sdma_mask]);
-#endif
-	sde->tx_ring[sde->tx_tail++ & sde->sdma_mask] = tx;
-	sde->desc_avail -= tx->num_desc;
-	return tail;
+}
+
+/*
+ * This routine makes the filled descriptors
+ * [start, end) visible to the hardware
+ *
+ * Reservations commit in the order they were
+ * made, so wait for the ones before us.  Those
+ * producers run with interrupts off, and so
+ * does the caller.
+ *
+ * With defer the tail CSR is only written once
+ * SDMA_TAIL_UPDATE_THRESH commits are pending.
+ */
+static inline void commit_tx(struct sdma_engine *sde, u32 start, u32 end,
+			     bool defer)
+{
+	while (smp_load_acquire(&sde->descq_committed) != start)
+		cpu_relax();
+
+	spin_lock(&sde->commit_lock);
+	if (!defer || ++sde->tail_deferred > SDMA_TAIL_UPDATE_THRESH)
+		sdma_update_tail(sde, end & sde->sdma_mask);
+	/* after the doorbell, see sdma_wait_reservations() */
+	smp_store_release(&sde->descq_committed, end);
+	spin_unlock(&sde->commit_lock);
 }
 
 /*
@@ -2377,34 +2700,22 @@ static int sdma_check_progress(
 		ret = wait->iow->sleep(sde, wait, tx, seq, pkts_sent);
 		if (ret == -EAGAIN)
 			sde->desc_avail = sdma_descq_freecnt(sde);
+		else if (sdma_hist)
+			wait->iow->sleep_ns = ktime_get_ns();
 	} else {
 		ret = -EBUSY;
 	}
 	return ret;
 }
 
-/**
- * sdma_send_txreq() - submit a tx req to ring
- * @sde: sdma engine to use
- * @wait: SE wait structure to use when full (may be NULL)
- * @tx: sdma_txreq to submit
- * @pkts_sent: has any packet been sent yet?
- *
- * The call submits the tx into the ring.  If a iowait structure is non-NULL
- * the packet will be queued to the list in wait.
- *
- * Return:
- * 0 - Success, -EINVAL - sdma_txreq incomplete, -EBUSY - no space in
- * ring (wait == NULL)
- * -EIOCBQUEUED - tx queued to iowait, -ECOMM bad sdma state
- */
-int sdma_send_txreq(struct sdma_engine *sde,
-		    struct iowait_work *wait,
-		    struct sdma_txreq *tx,
-		    bool pkts_sent)
+static int __sdma_send_txreq(struct sdma_engine *sde,
+			     struct iowait_work *wait,
+			     struct sdma_txreq *tx,
+			     bool pkts_sent,
+			     bool defer)
 {
 	int ret = 0;
-	u16 tail;
+	u32 start;
 	unsigned long flags;
 
 	/* user should have supplied entire packet */
@@ -2417,10 +2728,15 @@ retry:
 		goto unlock_noconn;
 	if (unlikely(tx->num_desc > sde->desc_avail))
 		goto nodesc;
-	tail = submit_tx(sde, tx);
+	start = reserve_tx(sde, tx);
 	if (wait)
 		iowait_sdma_inc(iowait_ioww_to_iow(wait));
-	sdma_update_tail(sde, tail);
+	/* fill and commit with interrupts still off */
+	spin_unlock(&sde->tail_lock);
+	submit_tx(sde, tx, start);
+	commit_tx(sde, start, start + tx->num_desc, defer);
+	local_irq_restore(flags);
+	return ret;
 unlock:
 	spin_unlock_irqrestore(&sde->tail_lock, flags);
 	return ret;
@@ -2440,6 +2756,8 @@ unlock_noconn:
 	ret = -ECOMM;
 	goto unlock;
 nodesc:
+	/* the hardware cannot free what it has not been told about */
+	sdma_flush_deferred_tail(sde);
 	ret = sdma_check_progress(sde, wait, tx, pkts_sent);
 	if (ret == -EAGAIN) {
 		ret = 0;
@@ -2449,6 +2767,85 @@ nodesc:
 	goto unlock;
 }
 
+/**
+ * sdma_send_txreq() - submit a tx req to ring
+ * @sde: sdma engine to use
+ * @wait: SE wait structure to use when full (may be NULL)
+ * @tx: sdma_txreq to submit
+ * @pkts_sent: has any packet been sent yet?
+ *
+ * The call submits the tx into the ring.  If a iowait structure is non-NULL
+ * the packet will be queued to the list in wait.
+ *
+ * Return:
+ * 0 - Success, -EINVAL - sdma_txreq incomplete, -EBUSY - no space in
+ * ring (wait == NULL)
+ * -EIOCBQUEUED - tx queued to iowait, -ECOMM bad sdma state
+ */
+int sdma_send_txreq(struct sdma_engine *sde,
+		    struct iowait_work *wait,
+		    struct sdma_txreq *tx,
+		    bool pkts_sent)
+{
+	return __sdma_send_txreq(sde, wait, tx, pkts_sent, false);
+}
+
+/**
+ * sdma_batch_add() - submit a tx req with a deferred doorbell
+ * @batch: the batch, see sdma_batch_begin()
+ * @sde: sdma engine to use
+ * @wait: SE wait structure to use when full (may be NULL)
+ * @tx: sdma_txreq to submit
+ * @pkts_sent: has any packet been sent yet?
+ *
+ * Like sdma_send_txreq(), but the tail CSR is only written once
+ * SDMA_TAIL_UPDATE_THRESH submissions are outstanding, when the batch
+ * moves to another engine, or by sdma_batch_commit().  Any other
+ * submission to the engine rings for the batch as well.
+ *
+ * The caller must call sdma_batch_commit() before it stops submitting.
+ *
+ * Return: as sdma_send_txreq()
+ */
+int sdma_batch_add(struct sdma_batch *batch,
+		   struct sdma_engine *sde,
+		   struct iowait_work *wait,
+		   struct sdma_txreq *tx,
+		   bool pkts_sent)
+{
+	if (batch->sde != sde) {
+		sdma_batch_commit(batch);
+		batch->sde = sde;
+	}
+	return __sdma_send_txreq(sde, wait, tx, pkts_sent, true);
+}
+
+/**
+ * sdma_batch_commit() - ring the doorbell for a batch
+ * @batch: the batch
+ *
+ * The batch is empty afterwards and may be reused without
+ * sdma_batch_begin().
+ */
+void sdma_batch_commit(struct sdma_batch *batch)
+{
+	struct sdma_engine *sde = batch->sde;
+	unsigned long flags;
+
+	if (!sde)
+		return;
+	batch->sde = NULL;
+
+	/* someone else may already have rung for us */
+	if (!READ_ONCE(sde->tail_deferred))
+		return;
+
+	spin_lock_irqsave(&sde->tail_lock, flags);
+	if (__sdma_running(sde))
+		sdma_flush_deferred_tail(sde);
+	spin_unlock_irqrestore(&sde->tail_lock, flags);
+}
+
 /**
  * sdma_send_txlist() - submit a list of tx req to ring
  * @sde: sdma engine to use
@@ -2483,7 +2880,8 @@ int sdma_send_txlist(struct sdma_engine *sde, struct iowait_work *wait,
 	struct sdma_txreq *tx, *tx_next;
 	int ret = 0;
 	unsigned long flags;
-	u16 tail = INVALID_TAIL;
+	u32 start = 0, idx;
+	bool pending = false;
 	u32 submit_count = 0, flush_count = 0, total_count;
 
 	spin_lock_irqsave(&sde->tail_lock, flags);
@@ -2499,12 +2897,16 @@ retry:
 			goto update_tail;
 		}
 		list_del_init(&tx->list);
-		tail = submit_tx(sde, tx);
+		idx = reserve_tx(sde, tx);
+		if (!pending) {
+			start = idx;
+			pending = true;
+		}
+		submit_tx(sde, tx, idx);
 		submit_count++;
-		if (tail != INVALID_TAIL &&
-		    (submit_count & SDMA_TAIL_UPDATE_THRESH) == 0) {
-			sdma_update_tail(sde, tail);
-			tail = INVALID_TAIL;
+		if ((submit_count & SDMA_TAIL_UPDATE_THRESH) == 0) {
+			commit_tx(sde, start, sde->descq_tail, false);
+			pending = false;
 		}
 	}
 update_tail:
@@ -2514,8 +2916,8 @@ update_tail:
 		iowait_starve_clear(submit_count > 0,
 				    iowait_ioww_to_iow(wait));
 	}
-	if (tail != INVALID_TAIL)
-		sdma_update_tail(sde, tail);
+	if (pending)
+		commit_tx(sde, start, sde->descq_tail, false);
 	spin_unlock_irqrestore(&sde->tail_lock, flags);
 	*count_out = total_count;
 	return ret;
@@ -2538,6 +2940,11 @@ unlock_noconn:
 	ret = -ECOMM;
 	goto update_tail;
 nodesc:
+	if (pending) {
+		commit_tx(sde, start, sde->descq_tail, false);
+		pending = false;
+	}
+	sdma_flush_deferred_tail(sde);
 	ret = sdma_check_progress(sde, wait, tx, submit_count > 0);
 	if (ret == -EAGAIN) {
 		ret = 0;
@@ -2552,6 +2959,7 @@ static void sdma_process_event(struct sdma_engine *sde, enum sdma_events event)
 	unsigned long flags;
 
 	spin_lock_irqsave(&sde->tail_lock, flags);
+	sdma_wait_reservations(sde);
 	write_seqlock(&sde->head_lock);
 
 	__sdma_process_event(sde, event);
@@ -296,6 +296,19 @@ struct hw_sdma_desc {
 	__le64 qw[2];
 };
 
+#define SDMA_HIST_BUCKETS 32
+
+/*
+ * Per engine log2 histograms, bucket i counts values in [2^i, 2^(i+1)),
+ * see sdma_seqfile_dump_hist().  Filled only while the sdma_hist module
+ * parameter is set.
+ */
+struct sdma_hist {
+	u64 lat[SDMA_HIST_BUCKETS];	/* submit to complete, ns */
+	u64 depth[SDMA_HIST_BUCKETS];	/* descq entries in use at submit */
+	u64 sleep[SDMA_HIST_BUCKETS];	/* iowait queued for descq, ns */
+};
+
 /**
  * struct sdma_engine - Data pertaining to each SDMA engine.
  * @dd: a back-pointer to the device data
@@ -360,6 +373,15 @@ struct sdma_engine {
 	u16                   tx_tail;
 	/* private: */
 	u16 descq_cnt;
+	/* private: */
+	u32 idle_cnt;		/* idle interrupt delay in cclocks */
+
+	/* read/write using commit_lock */
+	spinlock_t            commit_lock ____cacheline_aligned_in_smp;
+	/* private: */
+	u32                   descq_committed;	/* filled up to here */
+	/* private: */
+	u16                   tail_deferred;	/* txreqs not yet rung */
 
 	/* read/write using head_lock */
 	/* private: */
@@ -373,13 +395,23 @@ struct sdma_engine {
 	/* private: */
 	u16                   tx_head;
 	/* private: */
+	u16                   desct_intr;	/* 0 means module default */
+	/* private: */
 	u64                   last_status;
+	/* private: */
+	unsigned long         lb_stamp;		/* jiffies of last rate sample */
+	/* private: */
+	u32                   lb_retired;	/* descs retired since lb_stamp */
+	/* private: */
+	u32                   lb_rate;		/* EWMA of descs retired/jiffy */
 	/* private */
 	u64                     err_cnt;
 	/* private */
 	u64                     sdma_int_cnt;
 	u64                     idle_int_cnt;
 	u64                     progress_int_cnt;
+	/* private */
+	struct sdma_hist        hist;
 
 	/* private: */
 	seqlock_t            waitlock;
@@ -555,6 +587,7 @@ static inline int sdma_txinit_ahg(
 	INIT_LIST_HEAD(&tx->list);
 	tx->num_desc = 0;
 	tx->flags = flags;
+	tx->submit_ns = 0;
 	tx->complete = cb;
 	tx->coalesce_buf = NULL;
 	tx->wait = NULL;
@@ -851,6 +884,21 @@ int sdma_send_txlist(struct sdma_engine *sde,
 		     struct iowait_work *wait,
 		     struct list_head *tx_list,
 		     u16 *count);
+int sdma_batch_add(struct sdma_batch *batch,
+		   struct sdma_engine *sde,
+		   struct iowait_work *wait,
+		   struct sdma_txreq *tx,
+		   bool pkts_sent);
+void sdma_batch_commit(struct sdma_batch *batch);
+
+/**
+ * sdma_batch_begin() - start a run of deferred doorbell submissions
+ * @batch: the batch
+ */
+static inline void sdma_batch_begin(struct sdma_batch *batch)
+{
+	batch->sde = NULL;
+}
 
 int sdma_ahg_alloc(struct sdma_engine *sde);
 void sdma_ahg_free(struct sdma_engine *sde, int ahg_index);
@@ -1043,13 +1091,28 @@ struct sdma_engine *sdma_select_engine_vl(
 	u32 selector,
 	u8 vl);
 
+struct sdma_engine *sdma_select_engine_lb(struct hfi1_devdata *dd,
+					  u32 selector, u8 vl,
+					  struct sdma_engine *cur,
+					  bool drained);
+
 struct sdma_engine *sdma_select_user_engine(struct hfi1_devdata *dd,
-					    u32 selector, u8 vl);
+					    u32 selector, u8 vl,
+					    struct sdma_engine *cur,
+					    bool drained);
 ssize_t sdma_get_cpu_to_sde_map(struct sdma_engine *sde, char *buf);
 ssize_t sdma_set_cpu_to_sde_map(struct sdma_engine *sde, const char *buf,
 				size_t count);
+ssize_t sdma_get_desct_intr(struct sdma_engine *sde, char *buf);
+ssize_t sdma_set_desct_intr(struct sdma_engine *sde, const char *buf,
+			    size_t count);
+ssize_t sdma_get_idle_ns(struct sdma_engine *sde, char *buf);
+ssize_t sdma_set_idle_ns(struct sdma_engine *sde, const char *buf,
+			 size_t count);
 int sdma_engine_get_vl(struct sdma_engine *sde);
 void sdma_seqfile_dump_sde(struct seq_file *s, struct sdma_engine *);
+void sdma_seqfile_dump_hist(struct seq_file *s, struct sdma_engine *sde);
+void sdma_hist_reset(struct sdma_engine *sde);
 void sdma_seqfile_dump_cpu_list(struct seq_file *s, struct hfi1_devdata *dd,
 				unsigned long cpuid);
 
@@ -1069,6 +1132,7 @@ static inline char *slashstrip(char *s)
 u16 sdma_get_descq_cnt(void);
 
 extern uint mod_num_sdma;
+extern bool sdma_load_balance;
 
 void sdma_update_lmc(struct hfi1_devdata *dd, u64 mask, u32 lid);
 
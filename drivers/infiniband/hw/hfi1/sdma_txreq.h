@@ -111,6 +111,8 @@ struct sdma_txreq {
 #ifdef CONFIG_HFI1_DEBUG_SDMA_ORDER
 	u64 sn;
 #endif
+	/* private: - ktime ns at submit, 0 when not sampled */
+	u64                         submit_ns;
 	/* private: - used in coalesce/pad processing */
 	u16                         packet_len;
 	/* private: - down-counted to trigger last */
@@ -134,4 +136,14 @@ static inline int sdma_txreq_built(struct sdma_txreq *tx)
 	return tx->num_desc;
 }
 
+struct sdma_engine;
+
+/*
+ * A run of submissions whose doorbell is deferred until commit, see
+ * sdma_batch_add().
+ */
+struct sdma_batch {
+	struct sdma_engine *sde;
+};
+
 #endif                          /* HFI1_SDMA_TXREQ_H */
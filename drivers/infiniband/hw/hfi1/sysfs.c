@@ -563,6 +563,64 @@ static ssize_t nfreectxts_show(struct device *device,
 }
 static DEVICE_ATTR_RO(nfreectxts);
 
+/*
+ * The kernel receive context of each QPN selected map entry.  Writing a
+ * list of kernel receive contexts spreads the map over them round robin;
+ * this fails with -EBUSY while verbs QPs exist.
+ */
+static ssize_t krcv_map_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hfi1_ibdev *dev =
+		rdma_device_to_drv_device(device, struct hfi1_ibdev, rdi.ibdev);
+	struct hfi1_devdata *dd = dd_from_dev(dev);
+	u8 map[256];
+	u32 n, i;
+	int len = 0;
+
+	n = hfi1_krcv_map_get(dd, map, ARRAY_SIZE(map));
+	for (i = 0; i < n; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u%c", map[i],
+				 i + 1 == n ? '\n' : ' ');
+	return len;
+}
+
+static ssize_t krcv_map_store(struct device *device,
+			      struct device_attribute *attr, const char *buf,
+			      size_t count)
+{
+	struct hfi1_ibdev *dev =
+		rdma_device_to_drv_device(device, struct hfi1_ibdev, rdi.ibdev);
+	struct hfi1_devdata *dd = dd_from_dev(dev);
+	char *str, *cur, *tok;
+	u8 ctxts[256];
+	u32 n = 0;
+	int ret = 0;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = str;
+	while ((tok = strsep(&cur, " ,\n"))) {
+		if (!*tok)
+			continue;
+		if (n == ARRAY_SIZE(ctxts)) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = kstrtou8(tok, 0, &ctxts[n++]);
+		if (ret)
+			break;
+	}
+	kfree(str);
+
+	if (!ret)
+		ret = hfi1_krcv_map_set(dd, ctxts, n);
+	return ret < 0 ? ret : count;
+}
+static DEVICE_ATTR_RW(krcv_map);
+
 static ssize_t serial_show(struct device *device,
 			   struct device_attribute *attr, char *buf)
 {
@@ -642,6 +700,7 @@ static struct attribute *hfi1_attributes[] = {
 	&dev_attr_board_id.attr,
 	&dev_attr_nctxts.attr,
 	&dev_attr_nfreectxts.attr,
+	&dev_attr_krcv_map.attr,
 	&dev_attr_serial.attr,
 	&dev_attr_boardversion.attr,
 	&dev_attr_tempsense.attr,
@@ -820,14 +879,126 @@ static ssize_t sde_show_vl(struct sdma_engine *sde, char *buf)
 	return snprintf(buf, PAGE_SIZE, "%d\n", vl);
 }
 
+static ssize_t sde_show_desct_intr(struct sdma_engine *sde, char *buf)
+{
+	return sdma_get_desct_intr(sde, buf);
+}
+
+static ssize_t sde_store_desct_intr(struct sdma_engine *sde,
+				    const char *buf, size_t count)
+{
+	return sdma_set_desct_intr(sde, buf, count);
+}
+
+static ssize_t sde_show_idle_ns(struct sdma_engine *sde, char *buf)
+{
+	return sdma_get_idle_ns(sde, buf);
+}
+
+static ssize_t sde_store_idle_ns(struct sdma_engine *sde,
+				 const char *buf, size_t count)
+{
+	return sdma_set_idle_ns(sde, buf, count);
+}
+
 static SDE_ATTR(cpu_list, S_IWUSR | S_IRUGO,
 		sde_show_cpu_to_sde_map,
 		sde_store_cpu_to_sde_map);
 static SDE_ATTR(vl, S_IRUGO, sde_show_vl, NULL);
+static SDE_ATTR(desct_intr, S_IWUSR | S_IRUGO,
+		sde_show_desct_intr,
+		sde_store_desct_intr);
+static SDE_ATTR(idle_ns, S_IWUSR | S_IRUGO,
+		sde_show_idle_ns,
+		sde_store_idle_ns);
 
 static struct sde_attribute *sde_attribs[] = {
 	&sde_attr_cpu_list,
-	&sde_attr_vl
+	&sde_attr_vl,
+	&sde_attr_desct_intr,
+	&sde_attr_idle_ns
+};
+
+struct ksc_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct send_context *sc, char *buf);
+	ssize_t (*store)(struct send_context *sc, const char *buf, size_t cnt);
+};
+
+static ssize_t ksc_show(struct kobject *kobj, struct attribute *attr,
+			char *buf)
+{
+	struct ksc_attribute *ksc_attr =
+		container_of(attr, struct ksc_attribute, attr);
+	struct send_context *sc =
+		container_of(kobj, struct send_context, kobj);
+
+	if (!ksc_attr->show)
+		return -EINVAL;
+
+	return ksc_attr->show(sc, buf);
+}
+
+static ssize_t ksc_store(struct kobject *kobj, struct attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct ksc_attribute *ksc_attr =
+		container_of(attr, struct ksc_attribute, attr);
+	struct send_context *sc =
+		container_of(kobj, struct send_context, kobj);
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!ksc_attr->store)
+		return -EINVAL;
+
+	return ksc_attr->store(sc, buf, count);
+}
+
+static const struct sysfs_ops ksc_sysfs_ops = {
+	.show = ksc_show,
+	.store = ksc_store,
+};
+
+static struct kobj_type ksc_ktype = {
+	.sysfs_ops = &ksc_sysfs_ops,
+};
+
+#define KSC_ATTR(_name, _mode, _show, _store) \
+	struct ksc_attribute ksc_attr_##_name = \
+		__ATTR(_name, _mode, _show, _store)
+
+static ssize_t ksc_show_cpu_to_sc_map(struct send_context *sc, char *buf)
+{
+	return pio_get_cpu_to_sc_map(sc, buf);
+}
+
+static ssize_t ksc_store_cpu_to_sc_map(struct send_context *sc,
+				       const char *buf, size_t count)
+{
+	return pio_set_cpu_to_sc_map(sc, buf, count);
+}
+
+static ssize_t ksc_show_vl(struct send_context *sc, char *buf)
+{
+	int vl;
+
+	vl = pio_sc_get_vl(sc);
+	if (vl < 0)
+		return vl;
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", vl);
+}
+
+static KSC_ATTR(cpu_list, S_IWUSR | S_IRUGO,
+		ksc_show_cpu_to_sc_map,
+		ksc_store_cpu_to_sc_map);
+static KSC_ATTR(vl, S_IRUGO, ksc_show_vl, NULL);
+
+static struct ksc_attribute *ksc_attribs[] = {
+	&ksc_attr_cpu_list,
+	&ksc_attr_vl
 };
 
 /*
@@ -837,7 +1008,7 @@ int hfi1_verbs_register_sysfs(struct hfi1_devdata *dd)
 {
 	struct ib_device *dev = &dd->verbs_dev.rdi.ibdev;
 	struct device *class_dev = &dev->dev;
-	int i, j, ret;
+	int i, j, n, ret;
 #ifndef HAVE_RDMA_SET_DEVICE_SYSFS_GROUP
 	int k;
 
@@ -867,7 +1038,31 @@ int hfi1_verbs_register_sysfs(struct hfi1_devdata *dd)
 		}
 	}
 
+	/* kernel send contexts, entry 0 is VL15 */
+	for (n = 1; n < dd->num_send_contexts; n++) {
+		struct send_context *sc = dd->kernel_send_context[n];
+
+		if (!sc)
+			break;
+		ret = kobject_init_and_add(&sc->kobj, &ksc_ktype,
+					   &class_dev->kobj, "ksc%u",
+					   sc->sw_index);
+		if (ret)
+			goto bail_ksc;
+
+		for (j = 0; j < ARRAY_SIZE(ksc_attribs); j++) {
+			ret = sysfs_create_file(&sc->kobj,
+						&ksc_attribs[j]->attr);
+			if (ret)
+				goto bail_ksc;
+		}
+	}
+
 	return 0;
+bail_ksc:
+	for (; n >= 1; n--)
+		kobject_put(&dd->kernel_send_context[n]->kobj);
+	i = dd->num_sdma - 1;
 bail:
 	/*
 	 * The function kobject_put() will call kobject_del() if the kobject
@@ -898,6 +1093,12 @@ void hfi1_verbs_unregister_sysfs(struct hfi1_devdata *dd)
 	int i;
 
 	/* Unwind operations in hfi1_verbs_register_sysfs() */
+	for (i = 1; i < dd->num_send_contexts; i++) {
+		if (!dd->kernel_send_context[i])
+			break;
+		kobject_put(&dd->kernel_send_context[i]->kobj);
+	}
+
 	for (i = 0; i < dd->num_sdma; i++)
 		kobject_put(&dd->per_sdma[i].kobj);
 
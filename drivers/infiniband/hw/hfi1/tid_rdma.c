@@ -441,9 +441,15 @@ int hfi1_qp_priv_init(struct rvt_dev_info *rdi, struct rvt_qp *qp,
 		      struct ib_qp_init_attr *init_attr)
 {
 	struct hfi1_qp_priv *qpriv = qp->priv;
+	struct hfi1_devdata *dd = dd_from_ibdev(qp->ibqp.device);
 	int i, ret;
 
+	/* hfi1_krcv_map_set() must not move the map under this QP */
+	mutex_lock(&dd->rmt_mutex);
 	qpriv->rcd = qp_to_rcd(rdi, qp);
+	if (hfi1_qp_uses_krcv_map(qp))
+		dd->krcv_map_qps++;
+	mutex_unlock(&dd->rmt_mutex);
 
 	spin_lock_init(&qpriv->opfn.lock);
 	INIT_WORK(&qpriv->opfn.opfn_work, opfn_send_conn_request);
@@ -468,8 +474,6 @@ int hfi1_qp_priv_init(struct rvt_dev_info *rdi, struct rvt_qp *qp,
 	INIT_LIST_HEAD(&qpriv->tid_wait);
 
 	if (init_attr->qp_type == IB_QPT_RC && HFI1_CAP_IS_KSET(TID_RDMA)) {
-		struct hfi1_devdata *dd = qpriv->rcd->dd;
-
 		qpriv->pages = kzalloc_node(TID_RDMA_MAX_PAGES *
 						sizeof(*qpriv->pages),
 					    GFP_KERNEL, dd->node);
@@ -5465,6 +5469,7 @@ static void hfi1_do_tid_send(struct rvt_qp *qp)
 	ps.cpu = priv->s_sde ? priv->s_sde->cpu :
 		cpumask_first(cpumask_of_node(ps.ppd->dd->node));
 	ps.pkts_sent = false;
+	sdma_batch_begin(&ps.batch);
 
 	/* insure a pre-built packet is handled  */
 	ps.s_txreq = get_waiting_verbs_txreq(ps.wait);
@@ -5481,8 +5486,10 @@ static void hfi1_do_tid_send(struct rvt_qp *qp)
 			 * If the packet cannot be sent now, return and
 			 * the send tasklet will be woken up later.
 			 */
-			if (hfi1_verbs_send(qp, &ps))
+			if (hfi1_verbs_send(qp, &ps)) {
+				sdma_batch_commit(&ps.batch);
 				return;
+			}
 
 			/* allow other tasks to run */
 			if (hfi1_schedule_send_yield(qp, &ps, true))
@@ -5501,6 +5508,7 @@ static void hfi1_do_tid_send(struct rvt_qp *qp)
 	} while (hfi1_make_tid_rdma_pkt(qp, &ps));
 	iowait_starve_clear(ps.pkts_sent, &priv->s_iowait);
 	spin_unlock_irqrestore(&qp->s_lock, ps.flags);
+	sdma_batch_commit(&ps.batch);
 }
 
 static bool _hfi1_schedule_tid_send(struct rvt_qp *qp)
@@ -225,6 +225,34 @@ TRACE_EVENT(hfi1_sdma_user_free_queues,
 		      )
 );
 
+TRACE_EVENT(hfi1_sdma_user_prepin,
+	    TP_PROTO(struct hfi1_devdata *dd, u16 ctxt, u16 subctxt,
+		     unsigned long addr, unsigned long len, int ret),
+	    TP_ARGS(dd, ctxt, subctxt, addr, len, ret),
+	    TP_STRUCT__entry(DD_DEV_ENTRY(dd)
+			     __field(u16, ctxt)
+			     __field(u16, subctxt)
+			     __field(unsigned long, addr)
+			     __field(unsigned long, len)
+			     __field(int, ret)
+			     ),
+	    TP_fast_assign(DD_DEV_ASSIGN(dd);
+			   __entry->ctxt = ctxt;
+			   __entry->subctxt = subctxt;
+			   __entry->addr = addr;
+			   __entry->len = len;
+			   __entry->ret = ret;
+			   ),
+	    TP_printk("[%s] SDMA [%u:%u] Prepin 0x%lx len %lu ret %d",
+		      __get_str(dev),
+		      __entry->ctxt,
+		      __entry->subctxt,
+		      __entry->addr,
+		      __entry->len,
+		      __entry->ret
+		      )
+);
+
 TRACE_EVENT(hfi1_sdma_user_process_request,
 	    TP_PROTO(struct hfi1_devdata *dd, u16 ctxt, u16 subctxt,
 		     u16 comp_idx),
@@ -559,7 +559,7 @@ int hfi1_make_ud_req(struct rvt_qp *qp, struct hfi1_pkt_state *ps)
 
 	/* Make the appropriate header */
 	hfi1_make_ud_req_tbl[priv->hdr_type](qp, ps, qp->s_wqe);
-	priv->s_sde = qp_to_sdma_engine(qp, priv->s_sc);
+	priv->s_sde = qp_pick_sdma_engine(qp, priv->s_sc);
 	ps->s_txreq->sde = priv->s_sde;
 	priv->s_sendcontext = qp_to_send_context(qp, priv->s_sc);
 	ps->s_txreq->psc = priv->s_sendcontext;
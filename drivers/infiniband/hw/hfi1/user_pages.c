@@ -74,15 +74,18 @@ MODULE_PARM_DESC(cache_size, "Send and receive side cache size limit (in MB)");
  * which are not limited in any other way (e.g. by HW resources) and, thus,
  * could keeping caching buffers.
  *
+ * hfi1_can_pin_pages_limit() takes the memlock limit and CAP_IPC_LOCK of
+ * the task the pages are pinned for, for pinning done on its behalf from
+ * a kernel thread.
  */
-bool hfi1_can_pin_pages(struct hfi1_devdata *dd, struct mm_struct *mm,
-			u32 nlocked, u32 npages)
+bool hfi1_can_pin_pages_limit(struct hfi1_devdata *dd, struct mm_struct *mm,
+			      u32 nlocked, u32 npages, unsigned long ulimit,
+			      bool can_lock)
 {
-	unsigned long ulimit = rlimit(RLIMIT_MEMLOCK), pinned, cache_limit,
+	unsigned long pinned, cache_limit,
 		size = (cache_size * (1UL << 20)); /* convert to bytes */
 	unsigned int usr_ctxts =
 			dd->num_rcv_contexts - dd->first_dyn_alloc_ctxt;
-	bool can_lock = capable(CAP_IPC_LOCK);
 
 	/*
 	 * Calculate per-cache size. The calculation below uses only a quarter
@@ -113,6 +116,14 @@ bool hfi1_can_pin_pages(struct hfi1_devdata *dd, struct mm_struct *mm,
 	return ((nlocked + npages) <= size) || can_lock;
 }
 
+bool hfi1_can_pin_pages(struct hfi1_devdata *dd, struct mm_struct *mm,
+			u32 nlocked, u32 npages)
+{
+	return hfi1_can_pin_pages_limit(dd, mm, nlocked, npages,
+					rlimit(RLIMIT_MEMLOCK),
+					capable(CAP_IPC_LOCK));
+}
+
 int hfi1_acquire_user_pages(struct mm_struct *mm, unsigned long vaddr, size_t npages,
 			    bool writable, struct page **pages)
 {
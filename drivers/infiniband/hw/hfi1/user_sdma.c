@@ -58,6 +58,10 @@
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/mmu_context.h>
+#ifndef NEED_SCHED_H
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#endif
 #include <linux/module.h>
 #include <linux/vmalloc.h>
 #include <linux/string.h>
@@ -76,14 +80,31 @@ static uint hfi1_sdma_comp_ring_size = 128;
 module_param_named(sdma_comp_size, hfi1_sdma_comp_ring_size, uint, S_IRUGO);
 MODULE_PARM_DESC(sdma_comp_size, "Size of User SDMA completion ring. Default: 128");
 
+static uint sdma_cache_policy = MMU_RB_POLICY_LRU;
+module_param(sdma_cache_policy, uint, S_IRUGO);
+MODULE_PARM_DESC(sdma_cache_policy, "User SDMA pin cache eviction policy: 0 - LRU, 1 - size-aware LRU, 2 - 2Q. Default: 0");
+
 static unsigned initial_pkt_count = 8;
 
+/*
+ * Memlock limit of the task pages are pinned for when that is not the
+ * current task.  Pinning on its behalf fails rather than exceeding it.
+ */
+struct user_sdma_pin_limit {
+	unsigned long memlock;
+	bool can_lock;
+};
+
+static int user_sdma_build_pkts(struct user_sdma_request *req, u16 maxpkts);
 static int user_sdma_send_pkts(struct user_sdma_request *req, u16 maxpkts);
+static int user_sdma_send_batch(struct user_sdma_request **batch, int nreqs);
 static void user_sdma_txreq_cb(struct sdma_txreq *txreq, int status);
 static inline void pq_update(struct hfi1_user_sdma_pkt_q *pq);
 static void user_sdma_free_request(struct user_sdma_request *req, bool unpin);
-static int pin_vector_pages(struct user_sdma_request *req,
-			    struct user_sdma_iovec *iovec);
+static int pin_vector_pages(struct hfi1_user_sdma_pkt_q *pq,
+			    struct user_sdma_request *req,
+			    struct user_sdma_iovec *iovec,
+			    const struct user_sdma_pin_limit *limit);
 static void unpin_vector_pages(struct mm_struct *mm, struct page **pages,
 			       unsigned start, unsigned npages);
 static int check_header_template(struct user_sdma_request *req,
@@ -109,6 +130,8 @@ static int defer_packet_queue(
 static void activate_packet_queue(struct iowait *wait, int reason);
 static bool sdma_rb_filter(struct mmu_rb_node *node, unsigned long addr,
 			   unsigned long len);
+static bool sdma_rb_get(void *arg, struct mmu_rb_node *mnode);
+static bool sdma_rb_extract(void *arg, struct mmu_rb_node *mnode);
 static int sdma_rb_insert(void *arg, struct mmu_rb_node *mnode);
 static int sdma_rb_evict(void *arg, struct mmu_rb_node *mnode,
 			 void *arg2, bool *stop);
@@ -117,6 +140,8 @@ static int sdma_rb_invalidate(void *arg, struct mmu_rb_node *mnode);
 
 static struct mmu_rb_ops sdma_rb_ops = {
 	.filter = sdma_rb_filter,
+	.get = sdma_rb_get,
+	.extract = sdma_rb_extract,
 	.insert = sdma_rb_insert,
 	.evict = sdma_rb_evict,
 	.remove = sdma_rb_remove,
@@ -188,8 +213,11 @@ int hfi1_user_sdma_alloc_queues(struct hfi1_ctxtdata *uctxt,
 	pq->subctxt = fd->subctxt;
 	pq->n_max_reqs = hfi1_sdma_comp_ring_size;
 	atomic_set(&pq->n_reqs, 0);
+	atomic_set(&pq->n_prepin, 0);
+	mutex_init(&pq->pin_lock);
 	init_waitqueue_head(&pq->wait);
 	atomic_set(&pq->n_locked, 0);
+	pq->pid = current->tgid;
 #ifdef NVIDIA_GPU_DIRECT
 	atomic_set(&pq->n_gpu_locked, 0);
 #endif
@@ -253,6 +281,12 @@ int hfi1_user_sdma_alloc_queues(struct hfi1_ctxtdata *uctxt,
 #endif
 		goto pq_mmu_fail;
 	}
+	if (sdma_cache_policy <= MMU_RB_POLICY_2Q)
+		hfi1_mmu_rb_set_policy(pq->handler, sdma_cache_policy);
+
+	spin_lock(&dd->user_sdma_pq_lock);
+	list_add_tail(&pq->list, &dd->user_sdma_pqs);
+	spin_unlock(&dd->user_sdma_pq_lock);
 
 	rcu_assign_pointer(fd->pq, pq);
 	fd->cq = cq;
@@ -305,6 +339,10 @@ int hfi1_user_sdma_free_queues(struct hfi1_filedata *fd,
 		spin_unlock(&fd->pq_rcu_lock);
 		synchronize_srcu(&fd->pq_srcu);
 		/* at this point there can be no more new requests */
+		wait_event(pq->wait, !atomic_read(&pq->n_prepin));
+		spin_lock(&uctxt->dd->user_sdma_pq_lock);
+		list_del(&pq->list);
+		spin_unlock(&uctxt->dd->user_sdma_pq_lock);
 		if (pq->handler)
 			hfi1_mmu_rb_unregister(pq->handler);
 #ifdef NVIDIA_GPU_DIRECT
@@ -353,16 +391,38 @@ static u8 dlid_to_selector(u16 dlid)
 	return mapping[hash];
 }
 
-/**
- * hfi1_user_sdma_process_request() - Process and start a user sdma request
- * @fd: valid file descriptor
- * @iovec: array of io vectors to process
- * @dim: overall iovec array size
- * @count: number of io vector array entries processed
+/*
+ * Tear down a request whose packets were not all submitted.  If
+ * seqsubmitted == npkts, the completion routine controls the final
+ * state.  If seqsubmitted < npkts, wait for any outstanding packets to
+ * finish before cleaning up.
+ */
+static int user_sdma_abort_request(struct user_sdma_request *req, int ret)
+{
+	struct hfi1_user_sdma_pkt_q *pq = req->pq;
+	struct hfi1_user_sdma_comp_q *cq = req->cq;
+	u16 comp_idx = req->info.comp_idx;
+
+	if (req->seqsubmitted < req->info.npkts) {
+		if (req->seqsubmitted)
+			wait_event(pq->busy.wait_dma,
+				   (req->seqcomp == req->seqsubmitted - 1));
+		user_sdma_free_request(req, true);
+		pq_update(pq);
+		set_comp_state(pq, cq, comp_idx, ERROR, ret);
+	}
+	return ret;
+}
+
+/*
+ * Parse, validate and pin one request, and pick its engine.  On success
+ * the request is claimed and counted in pq->n_reqs, and *count has been
+ * advanced past its io vectors.
  */
-int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
+static int user_sdma_setup_request(struct hfi1_filedata *fd,
 				   struct iovec *iovec, unsigned long dim,
-				   unsigned long *count)
+				   unsigned long *count,
+				   struct user_sdma_request **reqp)
 {
 	int ret = 0, i;
 	struct hfi1_ctxtdata *uctxt = fd->uctxt;
@@ -371,7 +431,6 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 	struct hfi1_user_sdma_comp_q *cq = fd->cq;
 	struct hfi1_devdata *dd = pq->dd;
 	unsigned long idx = 0;
-	u8 pcount = initial_pkt_count;
 	struct sdma_req_info info;
 	struct user_sdma_request *req;
 	u8 opcode, sc, vl;
@@ -622,7 +681,7 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 		memcpy(&req->iovs[i].iov,
 		       iovec + idx++,
 		       sizeof(req->iovs[i].iov));
-		ret = pin_vector_pages(req, &req->iovs[i]);
+		ret = pin_vector_pages(pq, req, &req->iovs[i], NULL);
 		if (ret) {
 			req->data_iovs = i;
 			goto free_req;
@@ -631,8 +690,6 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 	}
 	trace_hfi1_sdma_user_data_length(dd, uctxt->ctxt, fd->subctxt,
 					 info.comp_idx, req->data_len);
-	if (pcount > req->info.npkts)
-		pcount = req->info.npkts;
 	/*
 	 * Copy any TID info
 	 * User space will provide the TID info only when the
@@ -673,7 +730,10 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 	dlid = be16_to_cpu(req->hdr.lrh[1]);
 	selector = dlid_to_selector(dlid);
 	selector += uctxt->ctxt + fd->subctxt;
-	req->sde = sdma_select_user_engine(dd, selector, vl);
+	/* n_reqs already counts this request */
+	req->sde = sdma_select_user_engine(dd, selector, vl, pq->lb_sde[vl],
+					   atomic_read(&pq->n_reqs) == 1);
+	pq->lb_sde[vl] = req->sde;
 
 	if (!req->sde || !sdma_running(req->sde)) {
 		ret = -ECOMM;
@@ -687,17 +747,30 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 	set_comp_state(pq, cq, info.comp_idx, QUEUED, 0);
 	pq->state = SDMA_PKT_Q_ACTIVE;
 
-	/*
-	 * This is a somewhat blocking send implementation.
-	 * The driver will block the caller until all packets of the
-	 * request have been submitted to the SDMA engine. However, it
-	 * will not wait for send completions.
-	 */
+	*reqp = req;
+	*count += idx;
+	return 0;
+free_req:
+	return user_sdma_abort_request(req, ret);
+}
+
+/*
+ * This is a somewhat blocking send implementation.
+ * The driver will block the caller until all packets of the
+ * request have been submitted to the SDMA engine. However, it
+ * will not wait for send completions.
+ */
+static int user_sdma_submit_request(struct user_sdma_request *req)
+{
+	struct hfi1_user_sdma_pkt_q *pq = req->pq;
+	u16 pcount = min_t(u16, initial_pkt_count, req->info.npkts);
+	int ret;
+
 	while (req->seqsubmitted != req->info.npkts) {
 		ret = user_sdma_send_pkts(req, pcount);
 		if (ret < 0) {
 			if (ret != -EBUSY)
-				goto free_req;
+				return user_sdma_abort_request(req, ret);
 			if (wait_event_interruptible_timeout(
 				pq->busy.wait_dma,
 				pq->state == SDMA_PKT_Q_ACTIVE,
@@ -706,25 +779,104 @@ int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
 				flush_pq_iowait(pq);
 		}
 	}
-	*count += idx;
 	return 0;
-free_req:
-	/*
-	 * If the submitted seqsubmitted == npkts, the completion routine
-	 * controls the final state.  If sequbmitted < npkts, wait for any
-	 * outstanding packets to finish before cleaning up.
-	 */
-	if (req->seqsubmitted < req->info.npkts) {
-		if (req->seqsubmitted)
-			wait_event(pq->busy.wait_dma,
-				   (req->seqcomp == req->seqsubmitted - 1));
-		user_sdma_free_request(req, true);
-		pq_update(pq);
-		set_comp_state(pq, cq, info.comp_idx, ERROR, ret);
+}
+
+/*
+ * Send a batch of built requests, then finish each one with the
+ * blocking send loop.  Once a request fails, the requests after it are
+ * not sent any further.  Those the batched send already handed to their
+ * engine in full complete as usual; the others are aborted once any of
+ * their packets in flight are done.  *done is advanced by the number of
+ * requests handed over in full.  Returns the first error.
+ */
+static int user_sdma_flush_batch(struct user_sdma_request **batch, int nreqs,
+				 int *done)
+{
+	struct user_sdma_request *req;
+	int i, ret = 0;
+
+	if (!nreqs)
+		return 0;
+
+	/* packets an engine refused are retried per request below */
+	user_sdma_send_batch(batch, nreqs);
+	for (i = 0; i < nreqs; i++) {
+		req = batch[i];
+		if (ret) {
+			if (req->seqsubmitted == req->info.npkts)
+				(*done)++;
+			else
+				user_sdma_abort_request(req, -ECANCELED);
+			continue;
+		}
+		ret = user_sdma_submit_request(req);
+		if (!ret)
+			(*done)++;
 	}
 	return ret;
 }
 
+/**
+ * hfi1_user_sdma_process_requests() - Process and start user sdma requests
+ * @fd: valid file descriptor
+ * @iovec: array of io vectors to process
+ * @dim: overall iovec array size
+ *
+ * Up to USER_SDMA_MAX_BATCH requests are parsed, pinned and have their
+ * first packets built before anything is sent, and are then submitted
+ * with one sdma_send_txlist() per engine.  A request that does not fit
+ * in its first packets ends the batch, so the rest of it still reaches
+ * its engine ahead of any request written after it.
+ *
+ * Processing stops at the first request that fails and no request
+ * written after it is set up.  Its completion entry is set to ERROR, as
+ * are those of the requests behind it in the same batch, except for the
+ * ones the batched send already handed to their engine in full.  Those
+ * complete normally.
+ *
+ * Return: the number of requests handed to the hardware in full, which
+ * need not be the first ones written if a request failed, or the error
+ * if there are none.  The completion entries tell which requests failed.
+ */
+int hfi1_user_sdma_process_requests(struct hfi1_filedata *fd,
+				    struct iovec *iovec, unsigned long dim)
+{
+	struct user_sdma_request *batch[USER_SDMA_MAX_BATCH];
+	struct user_sdma_request *req;
+	unsigned long count = 0;
+	int nreqs = 0, reqs = 0, ret = 0;
+
+	while (count < dim) {
+		ret = user_sdma_setup_request(fd, iovec + count, dim - count,
+					      &count, &req);
+		if (ret)
+			break;
+		ret = user_sdma_build_pkts(req, initial_pkt_count);
+		if (ret) {
+			user_sdma_abort_request(req, ret);
+			break;
+		}
+		batch[nreqs++] = req;
+		if (nreqs == USER_SDMA_MAX_BATCH ||
+		    req->seqnum != req->info.npkts) {
+			ret = user_sdma_flush_batch(batch, nreqs, &reqs);
+			nreqs = 0;
+			if (ret)
+				break;
+		}
+	}
+	/* requests set up ahead of a failure are still submitted */
+	if (nreqs) {
+		int err = user_sdma_flush_batch(batch, nreqs, &reqs);
+
+		if (!ret)
+			ret = err;
+	}
+
+	return reqs ? reqs : ret;
+}
+
 static inline u32 compute_data_length(struct user_sdma_request *req,
 				      struct user_sdma_txreq *tx)
 {
@@ -830,6 +982,33 @@ static int user_sdma_txadd_ahg(struct user_sdma_request *req,
 	return ret;
 }
 
+/*
+ * Pages of a compound (THP or hugetlbfs) page are physically contiguous,
+ * so a fragment that crosses 4K boundaries inside one can still go out
+ * as a single descriptor.  Return how many of the want bytes starting at
+ * offset in pageidx are contiguous.
+ */
+static unsigned int user_sdma_contig_len(struct user_sdma_iovec *iovec,
+					 unsigned int pageidx,
+					 unsigned long offset,
+					 unsigned int want)
+{
+#ifdef NVIDIA_GPU_DIRECT
+	struct page **pages = iovec->pages.host;
+#else
+	struct page **pages = iovec->pages;
+#endif
+	unsigned int len = PAGE_SIZE - offset;
+
+	while (len < want && pageidx + 1 < iovec->npages &&
+	       page_to_pfn(pages[pageidx + 1]) ==
+	       page_to_pfn(pages[pageidx]) + 1) {
+		pageidx++;
+		len += PAGE_SIZE;
+	}
+	return min(len, want);
+}
+
 static int user_sdma_txadd(struct user_sdma_request *req,
 			   struct user_sdma_txreq *tx,
 			   struct user_sdma_iovec *iovec, u32 datalen,
@@ -850,6 +1029,11 @@ static int user_sdma_txadd(struct user_sdma_request *req,
 	len = offset + req->info.fragsize > PAGE_SIZE ?
 		PAGE_SIZE - offset : req->info.fragsize;
 	len = min((datalen - queued), len);
+	if (len < datalen - queued && len < req->info.fragsize &&
+	    iovec->node && iovec->node->compound)
+		len = user_sdma_contig_len(iovec, pageidx, offset,
+					   min_t(u32, datalen - queued,
+						 req->info.fragsize));
 #ifdef NVIDIA_GPU_DIRECT
 	ret = sdma_txadd_page(pq->dd, &tx->txreq, iovec->pages.host[pageidx],
 #else
@@ -876,10 +1060,13 @@ static int user_sdma_txadd(struct user_sdma_request *req,
 	return ret;
 }
 
-static int user_sdma_send_pkts(struct user_sdma_request *req, u16 maxpkts)
+/*
+ * Build up to maxpkts txreqs for the request and queue them on req->txps
+ * without submitting them.
+ */
+static int user_sdma_build_pkts(struct user_sdma_request *req, u16 maxpkts)
 {
 	int ret = 0;
-	u16 count;
 	unsigned npkts = 0;
 	struct user_sdma_txreq *tx = NULL;
 	struct hfi1_user_sdma_pkt_q *pq = NULL;
@@ -897,11 +1084,8 @@ static int user_sdma_send_pkts(struct user_sdma_request *req, u16 maxpkts)
 	/*
 	 * Check if we might have sent the entire request already
 	 */
-	if (unlikely(req->seqnum == req->info.npkts)) {
-		if (!list_empty(&req->txps))
-			goto dosend;
+	if (unlikely(req->seqnum == req->info.npkts))
 		return ret;
-	}
 
 	if (!maxpkts || maxpkts > req->info.npkts - req->seqnum)
 		maxpkts = req->info.npkts - req->seqnum;
@@ -1040,10 +1224,17 @@ static int user_sdma_send_pkts(struct user_sdma_request *req, u16 maxpkts)
 		tx->seqnum = req->seqnum++;
 		npkts++;
 	}
-dosend:
-	ret = sdma_send_txlist(req->sde,
-			       iowait_get_ib_work(&pq->busy),
-			       &req->txps, &count);
+	return ret;
+
+free_txreq:
+	sdma_txclean(pq->dd, &tx->txreq);
+free_tx:
+	kmem_cache_free(pq->txreq_cache, tx);
+	return ret;
+}
+
+static void user_sdma_add_submitted(struct user_sdma_request *req, u16 count)
+{
 	req->seqsubmitted += count;
 	if (req->seqsubmitted == req->info.npkts) {
 		/*
@@ -1055,12 +1246,68 @@ dosend:
 		if (req->ahg_idx >= 0)
 			sdma_ahg_free(req->sde, req->ahg_idx);
 	}
+}
+
+static int user_sdma_send_pkts(struct user_sdma_request *req, u16 maxpkts)
+{
+	int ret;
+	u16 count;
+
+	ret = user_sdma_build_pkts(req, maxpkts);
+	if (ret || list_empty(&req->txps))
+		return ret;
+
+	ret = sdma_send_txlist(req->sde,
+			       iowait_get_ib_work(&req->pq->busy),
+			       &req->txps, &count);
+	user_sdma_add_submitted(req, count);
 	return ret;
+}
 
-free_txreq:
-	sdma_txclean(pq->dd, &tx->txreq);
-free_tx:
-	kmem_cache_free(pq->txreq_cache, tx);
+/*
+ * Submit the already built packets of a batch of requests with one
+ * sdma_send_txlist() call per engine.  Requests keep their order on
+ * each engine.  Packets an engine could not take are handed back to
+ * their requests, and the remaining engines are left to
+ * user_sdma_submit_request() so a busy ring is waited on as usual.
+ */
+static int user_sdma_send_batch(struct user_sdma_request **batch, int nreqs)
+{
+	struct hfi1_user_sdma_pkt_q *pq = batch[0]->pq;
+	struct sdma_engine *sde;
+	LIST_HEAD(txlist);
+	int i, j, ret = 0;
+	u16 count, n, pending;
+
+	for (i = 0; i < nreqs; i++) {
+		sde = batch[i]->sde;
+		for (j = 0; j < i && batch[j]->sde != sde; j++)
+			;
+		if (j < i)
+			continue; /* engine already done */
+
+		for (j = i; j < nreqs; j++)
+			if (batch[j]->sde == sde)
+				list_splice_tail_init(&batch[j]->txps,
+						      &txlist);
+		ret = sdma_send_txlist(sde, iowait_get_ib_work(&pq->busy),
+				       &txlist, &count);
+
+		for (j = i; j < nreqs; j++) {
+			struct user_sdma_request *req = batch[j];
+
+			if (req->sde != sde)
+				continue;
+			pending = req->seqnum - req->seqsubmitted;
+			n = min_t(u16, count, pending);
+			count -= n;
+			user_sdma_add_submitted(req, n);
+			for (n = pending - n; n; n--)
+				list_move_tail(txlist.next, &req->txps);
+		}
+		if (ret)
+			break;
+	}
 	return ret;
 }
 
@@ -1074,14 +1321,25 @@ static u32 sdma_cache_evict(struct hfi1_user_sdma_pkt_q *pq, u32 npages)
 	return evict_data.cleared;
 }
 
-static int pin_sdma_pages(struct user_sdma_request *req,
+static bool user_sdma_can_pin(struct hfi1_user_sdma_pkt_q *pq, u32 npages,
+			      const struct user_sdma_pin_limit *limit)
+{
+	if (!limit)
+		return hfi1_can_pin_pages(pq->dd, pq->mm,
+					  atomic_read(&pq->n_locked), npages);
+	return hfi1_can_pin_pages_limit(pq->dd, pq->mm,
+					atomic_read(&pq->n_locked), npages,
+					limit->memlock, limit->can_lock);
+}
+
+static int pin_sdma_pages(struct hfi1_user_sdma_pkt_q *pq,
 			  struct user_sdma_iovec *iovec,
 			  struct sdma_mmu_node *node,
-			  int npages)
+			  int npages,
+			  const struct user_sdma_pin_limit *limit)
 {
-	int pinned, cleared;
+	int pinned, cleared, i;
 	struct page **pages;
-	struct hfi1_user_sdma_pkt_q *pq = req->pq;
 
 	pages = kcalloc(npages, sizeof(*pages), GFP_KERNEL);
 	if (!pages)
@@ -1094,11 +1352,14 @@ static int pin_sdma_pages(struct user_sdma_request *req,
 
 	npages -= node->npages;
 retry:
-	if (!hfi1_can_pin_pages(pq->dd, pq->mm,
-				atomic_read(&pq->n_locked), npages)) {
+	if (!user_sdma_can_pin(pq, npages, limit)) {
 		cleared = sdma_cache_evict(pq, npages);
 		if (cleared >= npages)
 			goto retry;
+		if (limit) {
+			kfree(pages);
+			return -ENOMEM;
+		}
 	}
 	pinned = hfi1_acquire_user_pages(pq->mm,
 					 ((unsigned long)iovec->iov.iov_base +
@@ -1112,6 +1373,9 @@ retry:
 		unpin_vector_pages(pq->mm, pages, node->npages, pinned);
 		return -EFAULT;
 	}
+	for (i = node->npages; !node->compound && i < node->npages + pinned;
+	     i++)
+		node->compound = PageCompound(pages[i]);
 #ifdef NVIDIA_GPU_DIRECT
 	kfree(node->pages.host);
 	node->pages.host = pages;
@@ -1136,11 +1400,16 @@ static void unpin_sdma_pages(struct sdma_mmu_node *node)
 	}
 }
 
-static int pin_vector_pages(struct user_sdma_request *req,
-			    struct user_sdma_iovec *iovec)
+/*
+ * req is NULL for pre-pinning, which only handles host memory.  limit is
+ * NULL when pinning for the current task.  Called with pq->pin_lock held.
+ */
+static int __pin_vector_pages(struct hfi1_user_sdma_pkt_q *pq,
+			      struct user_sdma_request *req,
+			      struct user_sdma_iovec *iovec,
+			      const struct user_sdma_pin_limit *limit)
 {
 	int ret = 0, pinned, npages;
-	struct hfi1_user_sdma_pkt_q *pq = req->pq;
 	struct sdma_mmu_node *node = NULL;
 	struct mmu_rb_node *rb_node;
 	struct iovec *iov = &iovec->iov;
@@ -1149,7 +1418,7 @@ static int pin_vector_pages(struct user_sdma_request *req,
 	struct mmu_rb_handler *handler;
 
 #ifdef NVIDIA_GPU_DIRECT
-	if (req->info.flags & HFI1_BUF_GPU_MEM) {
+	if (req && req->info.flags & HFI1_BUF_GPU_MEM) {
 		/*
 		 * We have to increase the pin size to account for any
 		 * potential offset from the beginning of the GPU page.
@@ -1176,7 +1445,7 @@ static int pin_vector_pages(struct user_sdma_request *req,
 	if (rb_node) {
 		node = container_of(rb_node, struct sdma_mmu_node, rb);
 		if (!extracted) {
-			atomic_inc(&node->refcount);
+			/* the cache took our reference in sdma_rb_get() */
 #ifdef NVIDIA_GPU_DIRECT
 			if (ongpu)
 				iovec->pages.gpu = node->pages.gpu;
@@ -1217,7 +1486,8 @@ static int pin_vector_pages(struct user_sdma_request *req,
 						    size, addr);
 		else
 #endif
-			pinned = pin_sdma_pages(req, iovec, node, npages);
+			pinned = pin_sdma_pages(pq, iovec, node, npages,
+						limit);
 		if (pinned < 0) {
 			ret = pinned;
 			goto bail;
@@ -1243,13 +1513,41 @@ static int pin_vector_pages(struct user_sdma_request *req,
 	}
 	return 0;
 bail:
+	if (extracted) {
+		/*
+		 * Requests still holding the node may have descriptors on
+		 * its pages, so it can't be freed here.  A failed pin left
+		 * it as it was; put it back in the cache.
+		 */
+		if (!WARN_ON_ONCE(hfi1_mmu_rb_insert(handler, &node->rb)))
+			atomic_dec(&node->refcount);
+		return ret;
+	}
 #ifdef NVIDIA_GPU_DIRECT
 	if (ongpu)
 		unpin_sdma_pages_gpu(node);
 	else
 #endif
 		unpin_sdma_pages(node);
-	kfree(node);
+	kfree_rcu(node, rb.rcu);
+	return ret;
+}
+
+/*
+ * The prepin worker and writev() can pin for the same pq at the same
+ * time.  Serialize them so neither inserts a node for a range the other
+ * has just extracted to grow.
+ */
+static int pin_vector_pages(struct hfi1_user_sdma_pkt_q *pq,
+			    struct user_sdma_request *req,
+			    struct user_sdma_iovec *iovec,
+			    const struct user_sdma_pin_limit *limit)
+{
+	int ret;
+
+	mutex_lock(&pq->pin_lock);
+	ret = __pin_vector_pages(pq, req, iovec, limit);
+	mutex_unlock(&pq->pin_lock);
 	return ret;
 }
 
@@ -1260,6 +1558,98 @@ static void unpin_vector_pages(struct mm_struct *mm, struct page **pages,
 	kfree(pages);
 }
 
+struct user_sdma_prepin {
+	struct work_struct work;
+	struct hfi1_user_sdma_pkt_q *pq;
+	unsigned long *ev;		/* events word of the owning subctxt */
+	struct iovec iov;
+	struct user_sdma_pin_limit limit;	/* of the ioctl caller */
+};
+
+/*
+ * Pin a buffer into the cache from a kernel worker, borrowing the
+ * owner's mm.  The cache reference taken by pinning is dropped right
+ * away so the node sits idle in the LRU until a send picks it up.
+ * Failures are not reported; the buffer is simply pinned on first use.
+ */
+static void user_sdma_prepin_work(struct work_struct *work)
+{
+	struct user_sdma_prepin *pp =
+		container_of(work, struct user_sdma_prepin, work);
+	struct hfi1_user_sdma_pkt_q *pq = pp->pq;
+	struct user_sdma_iovec iovec = { .iov = pp->iov };
+	int ret = -EFAULT;
+
+	if (mmget_not_zero(pq->mm)) {
+		use_mm(pq->mm);
+		ret = pin_vector_pages(pq, NULL, &iovec, &pp->limit);
+		unuse_mm(pq->mm);
+		mmput(pq->mm);
+	}
+	if (!ret)
+		atomic_dec(&iovec.node->refcount);
+	trace_hfi1_sdma_user_prepin(pq->dd, pq->ctxt, pq->subctxt,
+				    (unsigned long)pp->iov.iov_base,
+				    pp->iov.iov_len, ret);
+
+	if (atomic_dec_and_test(&pq->n_prepin)) {
+		if (pp->ev)
+			set_bit(_HFI1_EVENT_SDMA_PREPIN_BIT, pp->ev);
+		wake_up(&pq->wait);
+	}
+	kfree(pp);
+}
+
+int hfi1_user_sdma_prepin(struct hfi1_filedata *fd, unsigned long arg,
+			  u32 len)
+{
+	struct hfi1_ctxtdata *uctxt = fd->uctxt;
+	struct hfi1_sdma_prepin_info info;
+	struct hfi1_user_sdma_pkt_q *pq;
+	struct user_sdma_prepin *pp;
+	int idx, ret = 0;
+
+	if (sizeof(info) != len)
+		return -EINVAL;
+	if (copy_from_user(&info, (void __user *)arg, sizeof(info)))
+		return -EFAULT;
+	if (!info.length || info.vaddr + info.length < info.vaddr)
+		return -EINVAL;
+
+	idx = srcu_read_lock(&fd->pq_srcu);
+	pq = srcu_dereference(fd->pq, &fd->pq_srcu);
+	if (!pq || !pq->handler) {
+		ret = -EIO;
+		goto out;
+	}
+	if (atomic_inc_return(&pq->n_prepin) > pq->n_max_reqs) {
+		ret = -ENOSPC;
+		goto dec;
+	}
+
+	pp = kzalloc(sizeof(*pp), GFP_KERNEL);
+	if (!pp) {
+		ret = -ENOMEM;
+		goto dec;
+	}
+	INIT_WORK(&pp->work, user_sdma_prepin_work);
+	pp->pq = pq;
+	if (uctxt->dd->events)
+		pp->ev = uctxt->dd->events + uctxt_offset(uctxt) + fd->subctxt;
+	pp->iov.iov_base = (void __user *)(unsigned long)info.vaddr;
+	pp->iov.iov_len = info.length;
+	pp->limit.memlock = rlimit(RLIMIT_MEMLOCK);
+	pp->limit.can_lock = capable(CAP_IPC_LOCK);
+	queue_work(pq->dd->pport->prepin_wq, &pp->work);
+	goto out;
+dec:
+	if (atomic_dec_and_test(&pq->n_prepin))
+		wake_up(&pq->wait);
+out:
+	srcu_read_unlock(&fd->pq_srcu, idx);
+	return ret;
+}
+
 static int check_header_template(struct user_sdma_request *req,
 				 struct hfi1_pkt_header *hdr, u32 lrhlen,
 				 u32 datalen)
@@ -1635,7 +2025,8 @@ static void user_sdma_free_request(struct user_sdma_request *req, bool unpin)
 
 		req->iovs[i].node = NULL;
 
-		if (unpin)
+		/* only tear down the pinning if no one else is using it */
+		if (unpin && atomic_cmpxchg(&node->refcount, 1, -1) == 1)
 #ifdef NVIDIA_GPU_DIRECT
 				if (node->ongpu)
 					hfi1_mmu_rb_remove(req->pq->handler_gpu,
@@ -1671,11 +2062,49 @@ static bool sdma_rb_filter(struct mmu_rb_node *node, unsigned long addr,
 	return (bool)(node->addr == addr);
 }
 
+/*
+ * Take a reference on a cached node.  A refcount of -1 means eviction or
+ * invalidation has claimed the node and it is about to be removed.
+ */
+static bool sdma_rb_get(void *arg, struct mmu_rb_node *mnode)
+{
+	struct sdma_mmu_node *node =
+		container_of(mnode, struct sdma_mmu_node, rb);
+
+	return atomic_inc_unless_negative(&node->refcount);
+}
+
+/*
+ * Claim a partially matching node that is about to be grown.  Requests
+ * still holding it keep their references, but the bias keeps the count
+ * negative so sdma_rb_get() fails until sdma_rb_insert() removes it.
+ * Called with the rb tree lock held.
+ */
+static bool sdma_rb_extract(void *arg, struct mmu_rb_node *mnode)
+{
+	struct sdma_mmu_node *node =
+		container_of(mnode, struct sdma_mmu_node, rb);
+	int old, cnt = atomic_read(&node->refcount);
+
+	for (;;) {
+		if (cnt < 0)
+			return false; /* claimed by eviction or a free */
+		old = atomic_cmpxchg(&node->refcount, cnt,
+				     cnt + SDMA_NODE_EXTRACTED);
+		if (old == cnt)
+			return true;
+		cnt = old;
+	}
+}
+
 static int sdma_rb_insert(void *arg, struct mmu_rb_node *mnode)
 {
 	struct sdma_mmu_node *node =
 		container_of(mnode, struct sdma_mmu_node, rb);
 
+	/* a grown node comes back with the holders it had */
+	if (atomic_read(&node->refcount) < 0)
+		atomic_sub(SDMA_NODE_EXTRACTED, &node->refcount);
 	atomic_inc(&node->refcount);
 	return 0;
 }
@@ -1692,8 +2121,8 @@ static int sdma_rb_evict(void *arg, struct mmu_rb_node *mnode,
 		container_of(mnode, struct sdma_mmu_node, rb);
 	struct evict_data *evict_data = evict_arg;
 
-	/* is this node still being used? */
-	if (atomic_read(&node->refcount))
+	/* is this node still being used?  If not, claim it */
+	if (atomic_cmpxchg(&node->refcount, 0, -1))
 		return 0; /* keep this node */
 
 	/* this node will be evicted, add its pages to our count */
@@ -1717,7 +2146,8 @@ static void sdma_rb_remove(void *arg, struct mmu_rb_node *mnode)
 	else
 #endif
 		unpin_sdma_pages(node);
-	kfree(node);
+	/* lockless lookups may still be looking at it */
+	kfree_rcu(node, rb.rcu);
 }
 
 static int sdma_rb_invalidate(void *arg, struct mmu_rb_node *mnode)
@@ -1725,7 +2155,7 @@ static int sdma_rb_invalidate(void *arg, struct mmu_rb_node *mnode)
 	struct sdma_mmu_node *node =
 		container_of(mnode, struct sdma_mmu_node, rb);
 
-	if (!atomic_read(&node->refcount))
+	if (!atomic_cmpxchg(&node->refcount, 0, -1))
 		return 1;
 	return 0;
 }
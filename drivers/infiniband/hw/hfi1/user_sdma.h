@@ -60,6 +60,8 @@
  * before moving to the next one.
  */
 #define MAX_PKTS_PER_QUEUE 16
+/* Maximum number of requests built before a writev() submits them */
+#define USER_SDMA_MAX_BATCH 16
 
 #define num_pages(x) (1 + ((((x) - 1) & PAGE_MASK) >> PAGE_SHIFT))
 
@@ -122,6 +124,9 @@ struct hfi1_user_sdma_pkt_q {
 	u16 subctxt;
 	u16 n_max_reqs;
 	atomic_t n_reqs;
+	atomic_t n_prepin;	/* queued hfi1_user_sdma_prepin() work */
+	/* serializes cache lookup, pinning and insert across writev/prepin */
+	struct mutex pin_lock;
 	u16 reqidx;
 	struct hfi1_devdata *dd;
 	struct kmem_cache *txreq_cache;
@@ -138,6 +143,10 @@ struct hfi1_user_sdma_pkt_q {
 #endif
 	atomic_t n_locked;
 	struct mm_struct *mm;
+	struct list_head list;	/* on dd->user_sdma_pqs */
+	pid_t pid;
+	/* engine last used per VL, kept while requests are outstanding */
+	struct sdma_engine *lb_sde[HFI1_MAX_VLS_SUPPORTED];
 };
 
 struct hfi1_user_sdma_comp_q {
@@ -145,6 +154,9 @@ struct hfi1_user_sdma_comp_q {
 	struct hfi1_sdma_comp_entry *comps;
 };
 
+/* sdma_mmu_node refcount bias while a node is out of the cache to grow */
+#define SDMA_NODE_EXTRACTED (INT_MIN / 2)
+
 struct sdma_mmu_node {
 	struct mmu_rb_node rb;
 	struct hfi1_user_sdma_pkt_q *pq;
@@ -159,6 +171,8 @@ struct sdma_mmu_node {
 	bool ongpu;
 #endif
 	unsigned int npages;
+	/* some pages are THP/hugetlbfs backed, see user_sdma_contig_len() */
+	bool compound;
 };
 
 struct user_sdma_iovec {
@@ -265,8 +279,9 @@ int hfi1_user_sdma_alloc_queues(struct hfi1_ctxtdata *uctxt,
 				struct hfi1_filedata *fd);
 int hfi1_user_sdma_free_queues(struct hfi1_filedata *fd,
 			       struct hfi1_ctxtdata *uctxt);
-int hfi1_user_sdma_process_request(struct hfi1_filedata *fd,
-				   struct iovec *iovec, unsigned long dim,
-				   unsigned long *count);
+int hfi1_user_sdma_process_requests(struct hfi1_filedata *fd,
+				    struct iovec *iovec, unsigned long dim);
+int hfi1_user_sdma_prepin(struct hfi1_filedata *fd, unsigned long arg,
+			  u32 len);
 
 #endif /* _HFI1_USER_SDMA_H */
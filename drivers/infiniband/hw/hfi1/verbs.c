@@ -134,10 +134,25 @@ unsigned int hfi1_max_srq_wrs = 0x1FFFF;
 module_param_named(max_srq_wrs, hfi1_max_srq_wrs, uint, S_IRUGO);
 MODULE_PARM_DESC(max_srq_wrs, "Maximum number of SRQ WRs support");
 
+static uint sdma_inline_max = 64;
+module_param(sdma_inline_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sdma_inline_max,
+		 "Largest SDMA verbs payload sent inline with the header, 0 disables");
+
 unsigned short piothreshold = 256;
 module_param(piothreshold, ushort, S_IRUGO);
 MODULE_PARM_DESC(piothreshold, "size used to determine sdma vs. pio");
 
+static bool pio_adapt;
+module_param(pio_adapt, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pio_adapt,
+		 "Move the per VL pio vs. sdma crossover below piothreshold with load");
+
+/* crossover adjustment period, step and stalls that mean PIO is short */
+#define PIO_XOVER_PERIOD (HZ / 10)
+#define PIO_XOVER_STEP 32
+#define PIO_XOVER_STALLS 16
+
 static unsigned int sge_copy_mode;
 module_param(sge_copy_mode, uint, S_IRUGO);
 MODULE_PARM_DESC(sge_copy_mode,
@@ -520,6 +535,7 @@ static inline void hfi1_handle_packet(struct hfi1_packet *packet,
 		struct rvt_mcast *mcast;
 		struct rvt_mcast_qp *p;
 
+		hfi1_rcv_batch_flush(packet);
 		if (!packet->grh)
 			goto drop;
 		mcast = rvt_mcast_find(&ibp->rvp,
@@ -555,6 +571,24 @@ static inline void hfi1_handle_packet(struct hfi1_packet *packet,
 		else
 			qp_num = ib_bth_get_qpn(packet->ohdr);
 
+		/* the QP of the previous packet is still locked */
+		if (packet->rqp) {
+			if (packet->rbatch &&
+			    packet->rqp->ibqp.qp_num == qp_num) {
+				packet->rbatch--;
+				packet->qp = packet->rqp;
+				if (hfi1_do_pkey_check(packet))
+					goto drop;
+				packet_handler = qp_ok(packet);
+				if (likely(packet_handler))
+					packet_handler(packet);
+				else
+					ibp->rvp.n_pkt_drops++;
+				return;
+			}
+			hfi1_rcv_batch_flush(packet);
+		}
+
 		rcu_read_lock();
 		packet->qp = rvt_lookup_qpn(rdi, &ibp->rvp, qp_num);
 		if (!packet->qp)
@@ -569,6 +603,13 @@ static inline void hfi1_handle_packet(struct hfi1_packet *packet,
 			packet_handler(packet);
 		else
 			ibp->rvp.n_pkt_drops++;
+		if (packet->rbatch_max > 1) {
+			/* keep the locks for the following packets */
+			packet->rqp = packet->qp;
+			packet->rflags = flags;
+			packet->rbatch = packet->rbatch_max - 1;
+			return;
+		}
 		spin_unlock_irqrestore(&packet->qp->r_lock, flags);
 		rcu_read_unlock();
 	}
@@ -631,6 +672,100 @@ static void mem_timer(struct timer_list *t)
 		hfi1_qp_wakeup(qp, RVT_S_WAIT_KMEM);
 }
 
+/*
+ * Adaptive PIO vs SDMA crossover
+ *
+ * Each VL starts at piothreshold.  With pio_adapt set, every
+ * PIO_XOVER_PERIOD the crossover steps down when RC/UC senders stalled
+ * on PIO credits, and steps back up when verbs SDMA completions take
+ * more than twice the lowest recent latency, i.e. the engines queue.
+ * It never exceeds piothreshold, for which the kernel send context
+ * buffers are sized.  A calibrated value can be written per VL through
+ * the pio_crossover debugfs file.
+ */
+static void hfi1_pio_xover_init(struct hfi1_devdata *dd)
+{
+	int i;
+
+	for (i = 0; i < HFI1_MAX_VLS_SUPPORTED; i++) {
+		dd->pio_xover[i].thresh = piothreshold;
+		atomic_set(&dd->pio_xover[i].stalls, 0);
+		atomic_set(&dd->pio_xover[i].samples, 0);
+		dd->pio_xover[i].next = jiffies;
+	}
+}
+
+void hfi1_pio_xover_set(struct hfi1_devdata *dd, u8 vl, u16 thresh)
+{
+	WRITE_ONCE(dd->pio_xover[vl].thresh, min(thresh, piothreshold));
+}
+
+static void pio_xover_adjust(struct hfi1_pio_xover *x)
+{
+	u32 stalls = atomic_xchg(&x->stalls, 0);
+	u32 samples = atomic_xchg(&x->samples, 0);
+	u32 lat = READ_ONCE(x->sdma_lat_ns);
+	u32 floor = READ_ONCE(x->sdma_lat_floor);
+	int thresh = READ_ONCE(x->thresh);
+
+	if (stalls > PIO_XOVER_STALLS)
+		thresh -= PIO_XOVER_STEP;
+	else if (samples && floor && lat / 2 > floor)
+		thresh += PIO_XOVER_STEP;
+	WRITE_ONCE(x->thresh, clamp_t(int, thresh, 0, piothreshold));
+
+	/*
+	 * Let the floor follow load changes, but not past the average.  A
+	 * period without SDMA samples leaves nothing to compare against,
+	 * so start over from the next sample.
+	 */
+	if (samples)
+		floor = min(floor + floor / 8, lat);
+	else
+		floor = 0;
+	WRITE_ONCE(x->sdma_lat_floor, floor);
+}
+
+static void pio_xover_tick(struct hfi1_pio_xover *x)
+{
+	unsigned long next = READ_ONCE(x->next);
+
+	if (time_before(jiffies, next) ||
+	    cmpxchg(&x->next, next, jiffies + PIO_XOVER_PERIOD) != next)
+		return;
+	pio_xover_adjust(x);
+}
+
+static void pio_xover_sdma_sample(struct rvt_qp *qp, struct sdma_txreq *tx)
+{
+	struct hfi1_devdata *dd = dd_from_ibdev(qp->ibqp.device);
+	struct hfi1_qp_priv *priv = qp->priv;
+	struct hfi1_pio_xover *x;
+	u32 lat, ewma;
+
+	x = &dd->pio_xover[sc_to_vlt(dd, priv->s_sc) &
+			   (HFI1_MAX_VLS_SUPPORTED - 1)];
+	lat = min_t(u64, ktime_get_ns() - tx->submit_ns, U32_MAX);
+	ewma = READ_ONCE(x->sdma_lat_ns);
+	WRITE_ONCE(x->sdma_lat_ns, ewma ? ewma - ewma / 8 + lat / 8 : lat);
+	if (!READ_ONCE(x->sdma_lat_floor) || lat < READ_ONCE(x->sdma_lat_floor))
+		WRITE_ONCE(x->sdma_lat_floor, lat);
+	atomic_inc(&x->samples);
+	pio_xover_tick(x);
+}
+
+static void pio_xover_stall(struct rvt_qp *qp)
+{
+	struct hfi1_devdata *dd = dd_from_ibdev(qp->ibqp.device);
+	struct hfi1_qp_priv *priv = qp->priv;
+	struct hfi1_pio_xover *x;
+
+	x = &dd->pio_xover[sc_to_vlt(dd, priv->s_sc) &
+			   (HFI1_MAX_VLS_SUPPORTED - 1)];
+	atomic_inc(&x->stalls);
+	pio_xover_tick(x);
+}
+
 /*
  * This is called with progress side lock held.
  */
@@ -643,6 +778,9 @@ static void verbs_sdma_complete(
 		container_of(cookie, struct verbs_txreq, txreq);
 	struct rvt_qp *qp = tx->qp;
 
+	if (cookie->submit_ns && pio_adapt && status == SDMA_TXREQ_S_OK)
+		pio_xover_sdma_sample(qp, cookie);
+
 	spin_lock(&qp->s_lock);
 	if (tx->wqe) {
 		rvt_send_complete(qp, tx->wqe, IB_WC_SUCCESS);
@@ -750,6 +888,42 @@ bail_txadd:
 	return ret;
 }
 
+/*
+ * Copy the ulp payload behind the header at phdr_buf + offset so that
+ * the header, payload and 16B tail go out as one descriptor.
+ */
+static noinline int build_verbs_inline_payload(struct sdma_engine *sde,
+					       u32 length,
+					       struct verbs_txreq *tx,
+					       u16 offset)
+{
+	struct rvt_sge *sg_list = tx->ss->sg_list;
+	struct rvt_sge sge = tx->ss->sge;
+	u8 num_sge = tx->ss->num_sge;
+	u8 *dst = tx->phdr_buf + offset;
+	u32 len;
+
+	while (length) {
+		len = tx->ss->sge.length;
+		if (len > length)
+			len = length;
+		if (len > tx->ss->sge.sge_length)
+			len = tx->ss->sge.sge_length;
+		if (WARN_ON_ONCE(len == 0)) {
+			/* unwind cursor */
+			tx->ss->sge = sge;
+			tx->ss->num_sge = num_sge;
+			tx->ss->sg_list = sg_list;
+			return handle_corrupted_sge(sde, tx);
+		}
+		memcpy(dst, tx->ss->sge.vaddr, len);
+		dst += len;
+		rvt_update_sge(tx->ss, len, false);
+		length -= len;
+	}
+	return 0;
+}
+
 /**
  * update_tx_opstats - record stats by opcode
  * @qp; the qp
@@ -814,6 +988,27 @@ static int build_verbs_tx_desc(
 		if (ret)
 			goto bail_txadd;
 		phdr->pbc = cpu_to_le64(pbc);
+		/*
+		 * Small payloads are copied behind the header: one
+		 * descriptor and one mapping instead of three.
+		 */
+		if (tx->ss && length &&
+		    length <= min_t(uint, READ_ONCE(sdma_inline_max),
+				    VERBS_INLINE_MAX) &&
+		    hdrbytes + length + extra_bytes <= sizeof(tx->phdr_buf)) {
+			ret = build_verbs_inline_payload(sde, length, tx,
+							 hdrbytes);
+			if (ret)
+				goto bail_txadd;
+			memset(tx->phdr_buf + hdrbytes + length, 0,
+			       extra_bytes);
+			ret = sdma_txadd_kvaddr(
+				sde->dd,
+				&tx->txreq,
+				tx->phdr_buf,
+				hdrbytes + length + extra_bytes);
+			goto bail_txadd;
+		}
 		ret = sdma_txadd_kvaddr(
 			sde->dd,
 			&tx->txreq,
@@ -914,7 +1109,10 @@ int hfi1_verbs_send_dma(struct rvt_qp *qp, struct hfi1_pkt_state *ps,
 		if (unlikely(ret))
 			goto bail_build;
 	}
-	ret =  sdma_send_txreq(tx->sde, ps->wait, &tx->txreq, ps->pkts_sent);
+	if (pio_adapt)
+		tx->txreq.submit_ns = ktime_get_ns();
+	ret = sdma_batch_add(&ps->batch, tx->sde, ps->wait, &tx->txreq,
+			     ps->pkts_sent);
 	if (unlikely(ret < 0)) {
 		if (ret == -ECOMM)
 			goto bail_ecomm;
@@ -972,6 +1170,8 @@ static int pio_wait(struct rvt_qp *qp,
 			int was_empty;
 
 			dev->n_piowait += !!(flag & RVT_S_WAIT_PIO);
+			if (pio_adapt && (flag & RVT_S_WAIT_PIO))
+				pio_xover_stall(qp);
 			dev->n_piodrain += !!(flag & HFI1_S_WAIT_PIO_DRAIN);
 			qp->s_flags |= flag;
 			was_empty = list_empty(&sc->piowait);
@@ -1045,7 +1245,20 @@ int hfi1_verbs_send_pio(struct rvt_qp *qp, struct hfi1_pkt_state *ps,
 
 	/* vl15 special case taken care of in ud.c */
 	sc5 = priv->s_sc;
-	sc = ps->s_txreq->psc;
+	sc = pio_cpu_send_context(ps->s_txreq->psc, sc5);
+	if (cb && sc != priv->s_sendcontext) {
+		/*
+		 * RC/UC packets must stay in order, so a QP only moves to
+		 * this CPU's context once nothing is pending on the old one.
+		 * That also keeps qp_pio_drain() and the piowait of the old
+		 * context valid: a QP queued on a context's piowait has PIO
+		 * pending there and is woken by that context.
+		 */
+		if (iowait_pio_pending(&priv->s_iowait))
+			sc = priv->s_sendcontext;
+		else
+			priv->s_sendcontext = sc;
+	}
 
 	if (likely(pbc == 0)) {
 		u8 vl = sc_to_vlt(dd_from_ibdev(qp->ibqp.device), sc5);
@@ -1243,6 +1456,14 @@ bad:
 	return 1;
 }
 
+static inline u16 pio_xover_thresh(struct hfi1_devdata *dd,
+				   struct hfi1_qp_priv *priv)
+{
+	u8 vl = sc_to_vlt(dd, priv->s_sc) & (HFI1_MAX_VLS_SUPPORTED - 1);
+
+	return READ_ONCE(dd->pio_xover[vl].thresh);
+}
+
 /**
  * get_send_routine - choose an egress routine
  *
@@ -1269,7 +1490,8 @@ static inline send_routine get_send_routine(struct rvt_qp *qp,
 		priv->s_running_pkt_size =
 			(tx->s_cur_size + priv->s_running_pkt_size) / 2;
 		if (piothreshold &&
-		    priv->s_running_pkt_size <= min(piothreshold, qp->pmtu) &&
+		    priv->s_running_pkt_size <=
+			min_t(u32, pio_xover_thresh(dd, priv), qp->pmtu) &&
 		    (BIT(ps->opcode & OPMASK) & pio_opmask[ps->opcode >> 5]) &&
 		    iowait_sdma_pending(&priv->s_iowait) == 0 &&
 		    !sdma_txreq_built(&tx->txreq))
@@ -1940,6 +2162,7 @@ int hfi1_register_ib_device(struct hfi1_devdata *dd)
 
 	timer_setup(&dev->mem_timer, mem_timer, 0);
 
+	hfi1_pio_xover_init(dd);
 	seqlock_init(&dev->iowait_lock);
 	seqlock_init(&dev->txwait_lock);
 	INIT_LIST_HEAD(&dev->txwait);
@@ -2026,6 +2249,7 @@ int hfi1_register_ib_device(struct hfi1_devdata *dd)
 	dd->verbs_dev.rdi.driver_f.modify_qp = hfi1_modify_qp;
 	dd->verbs_dev.rdi.driver_f.notify_restart_rc = hfi1_restart_rc;
 	dd->verbs_dev.rdi.driver_f.setup_wqe = hfi1_setup_wqe;
+	dd->verbs_dev.rdi.driver_f.busy_poll_cq = hfi1_busy_poll_cq;
 	dd->verbs_dev.rdi.driver_f.comp_vect_cpu_lookup =
 						hfi1_comp_vect_mappings_lookup;
 
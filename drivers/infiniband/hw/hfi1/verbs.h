@@ -240,6 +240,8 @@ struct hfi1_pkt_state {
 	unsigned long timeout;
 	unsigned long timeout_int;
 	int cpu;
+	/* SDMA submissions not yet rung, committed before the loop exits */
+	struct sdma_batch batch;
 	u8 opcode;
 	bool in_thread;
 	bool pkts_sent;
@@ -538,6 +540,8 @@ extern unsigned int hfi1_max_srq_wrs;
 
 extern unsigned short piothreshold;
 
+void hfi1_pio_xover_set(struct hfi1_devdata *dd, u8 vl, u16 thresh);
+
 extern const u32 ib_hfi1_rnr_table[];
 
 #endif                          /* HFI1_VERBS_H */
@@ -55,8 +55,16 @@
 #include "sdma_txreq.h"
 #include "iowait.h"
 
+/* largest payload that can be copied behind the header, see verbs.c */
+#define VERBS_INLINE_MAX 256
+
 struct verbs_txreq {
-	struct hfi1_sdma_header	phdr;
+	union {
+		struct hfi1_sdma_header	phdr;
+		/* header, inline payload and 16B tail in one buffer */
+		u8 phdr_buf[sizeof(struct hfi1_sdma_header) +
+			    VERBS_INLINE_MAX + MAX_16B_PADDING];
+	};
 	struct sdma_txreq       txreq;
 	struct rvt_qp           *qp;
 	struct rvt_swqe         *wqe;
@@ -87,6 +87,8 @@ struct hfi1_vnic_sdma {
 	struct hfi1_vnic_vport_info *vinfo;
 	struct iowait wait;
 	struct sdma_txreq stx;
+	/* submissions deferred by netdev_xmit_more() */
+	struct sdma_batch batch;
 	unsigned int state;
 	u8 q_idx;
 	bool pkts_sent;
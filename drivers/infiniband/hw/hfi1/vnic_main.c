@@ -305,12 +305,16 @@ static netdev_tx_t hfi1_netdev_start_xmit(struct sk_buff *skb,
 	skb_pull(skb, OPA_VNIC_HDR_LEN);
 
 	if (unlikely(err == -EBUSY)) {
+		sdma_batch_commit(&vinfo->sdma[q_idx].batch);
 		hfi1_vnic_maybe_stop_tx(vinfo, q_idx);
 		dev_kfree_skb_any(skb);
 		return NETDEV_TX_BUSY;
 	}
 
 tx_finish:
+	/* the last packet of a burst rings for the ones deferred before it */
+	if (!netdev_xmit_more())
+		sdma_batch_commit(&vinfo->sdma[q_idx].batch);
 	/* update tx counters */
 	hfi1_vnic_update_tx_counters(vinfo, q_idx, skb, err);
 	dev_kfree_skb_any(skb);
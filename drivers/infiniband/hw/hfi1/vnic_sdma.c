@@ -193,8 +193,15 @@ int hfi1_vnic_send_dma(struct hfi1_devdata *dd, u8 q_idx,
 	if (unlikely(ret))
 		goto free_desc;
 
-	ret = sdma_send_txreq(sde, iowait_get_ib_work(&vnic_sdma->wait),
-			      &tx->txreq, vnic_sdma->pkts_sent);
+	/* a normal submission also rings for the deferred ones */
+	if (netdev_xmit_more())
+		ret = sdma_batch_add(&vnic_sdma->batch, sde,
+				     iowait_get_ib_work(&vnic_sdma->wait),
+				     &tx->txreq, vnic_sdma->pkts_sent);
+	else
+		ret = sdma_send_txreq(sde,
+				      iowait_get_ib_work(&vnic_sdma->wait),
+				      &tx->txreq, vnic_sdma->pkts_sent);
 	/* When -ECOMM, sdma callback will be called with ABORT status */
 	if (unlikely(ret && unlikely(ret != -ECOMM)))
 		goto free_desc;
@@ -287,6 +294,7 @@ void hfi1_vnic_sdma_init(struct hfi1_vnic_vport_info *vinfo)
 		vnic_sdma->vinfo = vinfo;
 		vnic_sdma->q_idx = i;
 		vnic_sdma->state = HFI1_VNIC_SDMA_Q_ACTIVE;
+		sdma_batch_begin(&vnic_sdma->batch);
 
 		/* Add a free descriptor watermark for wakeups */
 		if (vnic_sdma->sde->descq_cnt > HFI1_VNIC_SDMA_DESC_WTRMRK) {
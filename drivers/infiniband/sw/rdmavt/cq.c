@@ -143,6 +143,7 @@ bool rvt_cq_enter(struct rvt_cq *cq, struct ib_wc *entry, bool solicited)
 	} else {
 		kqueue[head] = *entry;
 		k_wc->head = next;
+		WRITE_ONCE(cq->poll_qpn, entry->qp->qp_num);
 	}
 
 	if (cq->notify == IB_CQ_NEXT_COMP ||
@@ -531,6 +532,7 @@ int rvt_poll_cq(struct ib_cq *ibcq, int num_entries, struct ib_wc *entry)
 	struct rvt_cq *cq = ibcq_to_rvtcq(ibcq);
 	struct rvt_k_cq_wc *wc;
 	unsigned long flags;
+	bool busy_polled = false;
 	int npolled;
 	u32 tail;
 
@@ -538,6 +540,7 @@ int rvt_poll_cq(struct ib_cq *ibcq, int num_entries, struct ib_wc *entry)
 	if (cq->ip)
 		return -EINVAL;
 
+again:
 	spin_lock_irqsave(&cq->lock, flags);
 
 	wc = cq->kqueue;
@@ -559,6 +562,18 @@ int rvt_poll_cq(struct ib_cq *ibcq, int num_entries, struct ib_wc *entry)
 
 	spin_unlock_irqrestore(&cq->lock, flags);
 
+	/*
+	 * Give the driver one chance to pull in completions.  Only consumers
+	 * that asked to poll the CQ themselves, from process context, do
+	 * this; others may be polling under their own locks.
+	 */
+	if (!npolled && !busy_polled && cq->rdi->driver_f.busy_poll_cq &&
+	    cq->ibcq.poll_ctx == IB_POLL_DIRECT) {
+		busy_polled = true;
+		if (cq->rdi->driver_f.busy_poll_cq(cq))
+			goto again;
+	}
+
 	return npolled;
 }
 
@@ -74,6 +74,7 @@ struct trap_list {
 
 struct rvt_qp;
 struct rvt_qpn_table;
+struct rvt_cq;
 struct rvt_ibport {
 	struct rvt_qp __rcu *qp[2];
 	struct ib_mad_agent *send_agent;	/* agent for SMI (traps) */
@@ -420,6 +421,15 @@ struct rvt_driver_provided {
 
 	/* Get and return CPU to pin CQ processing thread */
 	int (*comp_vect_cpu_lookup)(struct rvt_dev_info *rdi, int comp_vect);
+
+	/*
+	 * Optional. Called when a kernel consumer of an IB_POLL_DIRECT CQ
+	 * finds it empty, to let the driver poll its receive hardware instead
+	 * of waiting for an interrupt. Called from process context.
+	 * cq->poll_qpn names the QP that last completed into the CQ. Returns
+	 * true if any packets were processed.
+	 */
+	bool (*busy_poll_cq)(struct rvt_cq *cq);
 };
 
 struct rvt_dev_info {
@@ -99,6 +99,7 @@ struct rvt_cq {
 	struct rvt_cq_wc *queue;
 	struct rvt_mmap_info *ip;
 	struct rvt_k_cq_wc *kqueue;
+	u32 poll_qpn; /* QP of the last kernel completion, for busy_poll_cq */
 };
 
 static inline struct rvt_cq *ibcq_to_rvtcq(struct ib_cq *ibcq)
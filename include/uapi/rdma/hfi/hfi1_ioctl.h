@@ -106,6 +106,17 @@ struct hfi1_tid_info {
 	__u32 length;
 };
 
+/*
+ * Buffer to pin into the user SDMA cache ahead of use.  The pinning is
+ * done asynchronously; HFI1_EVENT_SDMA_PREPIN is set once all queued
+ * buffers have been handled.  A later send of exactly this address and
+ * length finds the pages already pinned.
+ */
+struct hfi1_sdma_prepin_info {
+	__u64 vaddr;
+	__u64 length;
+};
+
 #ifdef NVIDIA_GPU_DIRECT
 /*
  * struct hfi1_tid_info_v2 is a copy of struct hfi1_tid_info plus a flags field
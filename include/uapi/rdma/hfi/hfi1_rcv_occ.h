@@ -0,0 +1,88 @@
+/*
+ *
+ * This file is provided under a dual BSD/GPLv2 license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * GPL LICENSE SUMMARY
+ *
+ * Copyright(c) 2020 Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * BSD LICENSE
+ *
+ * Copyright(c) 2020 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  - Neither the name of Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _LINUX__HFI1_RCV_OCC_H
+#define _LINUX__HFI1_RCV_OCC_H
+#include <linux/types.h>
+
+/*
+ * Binary layout of the per device "rcv_occupancy" debugfs file: one
+ * header followed by nrecords records of record_size bytes, one per
+ * kernel or netdev receive context.
+ *
+ * Every histogram has nbuckets buckets and counts receive calls:
+ * - hdrq: header queue entries queued when the call started, in
+ *   1/nbuckets of hdrq_cnt
+ * - egr_used: eager entries the call consumed, in 1/nbuckets of egr_cnt
+ * - burst: packets the call processed, in log2 buckets
+ */
+#define HFI1_RCV_OCC_VERSION 2
+#define HFI1_RCV_OCC_BUCKETS 16
+
+struct hfi1_rcv_occ_header {
+	__u32 version;
+	__u32 nbuckets;
+	__u32 nrecords;
+	__u32 record_size;
+};
+
+struct hfi1_rcv_occ_record {
+	__u16 ctxt;
+	__u16 reserved;
+	__u32 hdrq_cnt;
+	__u32 egr_cnt;
+	__u32 max_burst;
+	__u64 samples;
+	__u64 hdrq[HFI1_RCV_OCC_BUCKETS];
+	__u64 egr_used[HFI1_RCV_OCC_BUCKETS];
+	__u64 burst[HFI1_RCV_OCC_BUCKETS];
+};
+
+#endif /* _LINUX__HFI1_RCV_OCC_H */
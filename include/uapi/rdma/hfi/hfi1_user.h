@@ -76,7 +76,7 @@
  * may not be implemented; the user code must deal with this if it
  * cares, or it must abort after initialization reports the difference.
  */
-#define HFI1_USER_SWMINOR 3
+#define HFI1_USER_SWMINOR 4
 
 /*
  * We will encode the major/minor inside a single 32bit version number.
@@ -127,7 +127,8 @@
 #define _HFI1_EVENT_LMC_CHANGE_BIT     3
 #define _HFI1_EVENT_SL2VL_CHANGE_BIT   4
 #define _HFI1_EVENT_TID_MMU_NOTIFY_BIT 5
-#define _HFI1_MAX_EVENT_BIT _HFI1_EVENT_TID_MMU_NOTIFY_BIT
+#define _HFI1_EVENT_SDMA_PREPIN_BIT    6
+#define _HFI1_MAX_EVENT_BIT _HFI1_EVENT_SDMA_PREPIN_BIT
 
 #define HFI1_EVENT_FROZEN            (1UL << _HFI1_EVENT_FROZEN_BIT)
 #define HFI1_EVENT_LINKDOWN          (1UL << _HFI1_EVENT_LINKDOWN_BIT)
@@ -135,6 +136,7 @@
 #define HFI1_EVENT_LMC_CHANGE        (1UL << _HFI1_EVENT_LMC_CHANGE_BIT)
 #define HFI1_EVENT_SL2VL_CHANGE      (1UL << _HFI1_EVENT_SL2VL_CHANGE_BIT)
 #define HFI1_EVENT_TID_MMU_NOTIFY    (1UL << _HFI1_EVENT_TID_MMU_NOTIFY_BIT)
+#define HFI1_EVENT_SDMA_PREPIN       (1UL << _HFI1_EVENT_SDMA_PREPIN_BIT)
 
 #ifdef NVIDIA_GPU_DIRECT
 #define HFI1_BUF_GPU_MEM_BIT 0
@@ -81,6 +81,8 @@
 #define HFI1_IOCTL_TID_INVAL_READ	_IOWR(RDMA_IOCTL_MAGIC, 0xED, struct hfi1_tid_info)
 /* get the version of the user cdev */
 #define HFI1_IOCTL_GET_VERS		_IOR(RDMA_IOCTL_MAGIC,  0xEE, int)
+/* pin a user SDMA buffer ahead of its first send */
+#define HFI1_IOCTL_SDMA_PREPIN		_IOW(RDMA_IOCTL_MAGIC,  0xEF, struct hfi1_sdma_prepin_info)
 
 #ifdef NVIDIA_GPU_DIRECT
 #define HFI1_IOCTL_SDMA_CACHE_EVICT     _IOWR(RDMA_IOCTL_MAGIC, 0xFD, struct hfi1_sdma_gpu_cache_evict_params)
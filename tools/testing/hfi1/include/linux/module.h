@@ -0,0 +1,2 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/* empty: pio_copy_test.c provides what pio_copy.c needs */
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+/*
+ * Userspace byte-exactness test for the hfi1 PIO copy routines.
+ *
+ * drivers/infiniband/hw/hfi1/pio_copy.c is compiled as is against a
+ * fake 32 MB TXE PIO space.  Every packet is written once with the
+ * writeq() loops and once with each wide block store flavor the CPU
+ * supports, and the SOP=0 and SOP=1 views of the send context must come
+ * out byte for byte the same.  Packet lengths cover the PBC-only, odd
+ * DWORD (dangling u32) and partial/full SOP block cases, every start
+ * block covers the buffer wrap, and pio_copy() as well as the segmented
+ * start/mid/end copies are checked.
+ *
+ * Build and run with:
+ *	make -C tools/testing/hfi1 run
+ */
+
+#define _HFI1_KERNEL_H	/* keep the real hfi.h out */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define __iomem
+#define __percpu
+#define __read_mostly
+#define __aligned(x) __attribute__((aligned(x)))
+#define ____cacheline_aligned __aligned(64)
+#define S_IRUGO 0444
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+
+#define TXE_PIO_SIZE (32 * 0x100000)
+#define PIO_BLOCK_SIZE 64
+
+#define X86_FEATURE_AVX512F "avx512f"
+#define X86_FEATURE_AVX2 "avx2"
+#define XFEATURE_MASK_SSE 0
+#define XFEATURE_MASK_YMM 0
+#define XFEATURE_MASK_AVX512 0
+#define boot_cpu_has(feature) __builtin_cpu_supports(feature)
+#define cpu_has_xfeatures(mask, name) 1
+
+static inline bool irq_fpu_usable(void)
+{
+	return true;
+}
+
+static inline void kernel_fpu_begin(void)
+{
+}
+
+static inline void kernel_fpu_end(void)
+{
+}
+
+static inline void writeq(u64 val, volatile void *addr)
+{
+	*(volatile u64 *)addr = val;
+}
+
+#define this_cpu_dec(var) ((var)--)
+#define preempt_enable() do { } while (0)
+
+union mix {
+	u64 val64;
+	u32 val32[2];
+	u8  val8[8];
+};
+
+struct send_context {
+	u32 __percpu *buffers_allocated;
+	u32 size;
+};
+
+struct pio_buf {
+	struct send_context *sc;
+	void __iomem *start;
+	void __iomem *end;
+	union mix carry;
+	u16 qw_written;
+	u8 carry_bytes;
+};
+
+struct hfi1_devdata;
+
+#include "../../../drivers/infiniband/hw/hfi1/pio_copy.c"
+
+/* a send context somewhere in the SOP=0 half of the PIO space */
+#define CTX_OFFSET	(1 << 20)
+#define CTX_BLOCKS	32
+#define CTX_SIZE	(CTX_BLOCKS * PIO_BLOCK_SIZE)
+/* largest packet: the PBC plus this many DWORDs fill the context */
+#define MAX_DWORDS	((CTX_SIZE - sizeof(u64)) / sizeof(u32))
+#define POISON		0xa5
+
+static u8 *pio_space;
+static u64 src[CTX_SIZE / sizeof(u64)];
+static struct send_context sc;
+static u32 allocated;
+
+struct snapshot {
+	u8 sop0[CTX_SIZE];
+	u8 sop1[CTX_SIZE];
+};
+
+static void *ctx_base(void)
+{
+	return pio_space + CTX_OFFSET;
+}
+
+static void setup(struct pio_buf *pbuf, u32 first_block)
+{
+	memset(ctx_base(), POISON, CTX_SIZE);
+	memset(ctx_base() + SOP_DISTANCE, POISON, CTX_SIZE);
+	allocated = 1;
+	memset(pbuf, 0, sizeof(*pbuf));
+	pbuf->sc = &sc;
+	pbuf->start = ctx_base() + first_block * PIO_BLOCK_SIZE;
+	pbuf->end = ctx_base() + CTX_SIZE;
+}
+
+static void take(struct snapshot *snap)
+{
+	memcpy(snap->sop0, ctx_base(), CTX_SIZE);
+	memcpy(snap->sop1, ctx_base() + SOP_DISTANCE, CTX_SIZE);
+}
+
+/*
+ * Segment lengths, in bytes, to split a packet into.  Zero ends the
+ * list and the last segment takes whatever is left.  The QWORD multiple
+ * splits keep the source aligned for mid_copy_straight().
+ */
+static const u32 splits[][4] = {
+	{ 0 },
+	{ 8, 0 },
+	{ 56, 0 },
+	{ 64, 0 },
+	{ 8, 200, 0 },
+	{ 56, 136, 0 },
+	{ 16, 4, 0 },
+};
+
+#define NUM_SPLITS (sizeof(splits) / sizeof(splits[0]))
+
+/* split < 0 is pio_copy(), else the segmented copy with splits[split] */
+static void copy(int mode, int split, u32 first_block, u32 dwords,
+		 struct snapshot *snap)
+{
+	u64 pbc = 0x1122334455667700ULL | dwords;
+	struct pio_buf pbuf;
+
+	pio_wide = mode;
+	setup(&pbuf, first_block);
+	if (split < 0) {
+		pio_copy(NULL, &pbuf, pbc, src, dwords);
+	} else {
+		u32 left = dwords * sizeof(u32);
+		const u8 *from = (const u8 *)src;
+		const u32 *seg = splits[split];
+		u32 n = min(*seg ? *seg : left, left);
+
+		seg_pio_copy_start(&pbuf, pbc, from, n);
+		for (from += n, left -= n, seg++; left; from += n, left -= n) {
+			n = *seg ? min(*seg++, left) : left;
+			seg_pio_copy_mid(&pbuf, from, n);
+		}
+		seg_pio_copy_end(&pbuf);
+	}
+	take(snap);
+	if (allocated) {
+		fprintf(stderr, "buffers_allocated not released\n");
+		exit(1);
+	}
+}
+
+static const char * const mode_names[] = {
+	[PIO_WIDE_NONE] = "writeq",
+	[PIO_WIDE_AVX2] = "avx2",
+	[PIO_WIDE_AVX512] = "avx512",
+};
+
+static int compare(const struct snapshot *ref, const struct snapshot *got,
+		   int mode, int split, u32 first_block, u32 dwords)
+{
+	const u8 *r, *g;
+	size_t i;
+
+	if (!memcmp(ref, got, sizeof(*ref)))
+		return 0;
+
+	r = (const u8 *)ref;
+	g = (const u8 *)got;
+	for (i = 0; r[i] == g[i]; i++)
+		;
+	fprintf(stderr,
+		"%s differs from writeq: %s split %d, start block %u, %u dwords: SOP=%d byte %zu is 0x%02x, expected 0x%02x\n",
+		mode_names[mode], split < 0 ? "pio_copy" : "segmented",
+		split, first_block, dwords, i >= CTX_SIZE,
+		i % CTX_SIZE, g[i], r[i]);
+	return 1;
+}
+
+int main(void)
+{
+	static struct snapshot ref, got;
+	int modes[2], nmodes = 0;
+	unsigned long cases = 0;
+	int failed = 0;
+	u32 first_block, dwords;
+	size_t i;
+	int m, split;
+
+	pio_space = aligned_alloc(PIO_BLOCK_SIZE, TXE_PIO_SIZE);
+	if (!pio_space) {
+		perror("aligned_alloc");
+		return 1;
+	}
+	sc.buffers_allocated = &allocated;
+	sc.size = CTX_SIZE;
+	srand(1);
+	for (i = 0; i < sizeof(src); i++)
+		((u8 *)src)[i] = rand();
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		modes[nmodes++] = PIO_WIDE_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		modes[nmodes++] = PIO_WIDE_AVX512;
+	if (!nmodes) {
+		printf("SKIP: CPU has neither AVX2 nor AVX-512F\n");
+		return 0;
+	}
+
+	for (first_block = 0; first_block < CTX_BLOCKS; first_block++) {
+		for (dwords = 0; dwords <= MAX_DWORDS; dwords++) {
+			for (split = -1; split < (int)NUM_SPLITS; split++) {
+				copy(PIO_WIDE_NONE, split, first_block, dwords,
+				     &ref);
+				for (m = 0; m < nmodes; m++) {
+					copy(modes[m], split, first_block,
+					     dwords, &got);
+					failed |= compare(&ref, &got, modes[m],
+							  split, first_block,
+							  dwords);
+					cases++;
+				}
+			}
+		}
+	}
+
+	for (m = 0; m < nmodes; m++)
+		printf("%s ", mode_names[modes[m]]);
+	printf("%s: %lu cases\n", failed ? "FAIL" : "PASS", cases);
+	free(pio_space);
+	return failed;
+}